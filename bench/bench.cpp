@@ -0,0 +1,619 @@
+// Benchmarks of BTree on the memory and disk storage managers. Every
+// workload prints one JSON object per line:
+//
+//   {"benchmark":"query","storage":"disk","key":"int32",...,
+//    "ops":1000000,"seconds":0.81,"ops_per_sec":1234567.8,
+//    "p50_ns":610,"p99_ns":2300,"p999_ns":9100,"max_ns":120000,...}
+//
+// Run with --help for the options.
+
+#include "playdb/btree/BTree.h"
+#include "playdb/btree/tools.h"
+#include "playdb/storage/MemoryStorageManager.h"
+#include "playdb/storage/DiskStorageManager.h"
+#include "playdb/Exception.h"
+#include "playdb/Metrics.h"
+#include "playdb/Trace.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+
+using namespace playdb;
+
+struct Options
+{
+	std::string storage = "memory";
+	std::string key = "int32";
+	std::string order = "random";
+	std::string codec = "none";
+	std::string pages = "plain";
+	std::string dir = ".";
+	std::string workloads = "insert,query,miss,update,scan,traverse,mixed,open";
+
+	uint64_t count = 1000000;
+	uint64_t ops = 0;
+	uint64_t seed = 42;
+
+	size_t degree = 32;
+	size_t page_size = 4096;
+	size_t value_size = 100;
+	size_t cache_size = 64 << 20;
+	size_t node_cache = 4096;
+
+	// with PLAYDB_TRACE, slow operations are dumped to stderr
+	uint64_t slow_us = 0;
+};
+
+void usage()
+{
+	printf(
+		"usage: playdb_bench [options]\n"
+		"  --storage memory|disk        (memory)\n"
+		"  --key int32|int64|string     (int32)\n"
+		"  --count N                    keys loaded, k/M/G suffixes (1M)\n"
+		"  --ops N                      operations per workload (min(count, 1M))\n"
+		"  --order random|sequential    insert order (random)\n"
+		"  --degree N                   B-tree min degree (32)\n"
+		"  --value-size N               bytes per value (100)\n"
+		"  --page-size N                disk page size (4096)\n"
+		"  --cache-size N               disk page cache bytes, 0 for none (64M)\n"
+		"  --node-cache N               resident tree nodes (4096)\n"
+		"  --codec none|lz|lz4|zstd     disk compression (none)\n"
+		"  --pages plain|compact        node page format (plain)\n"
+		"  --dir PATH                   where the disk files go (.)\n"
+		"  --seed N                     (42)\n"
+		"  --slow-us N                  dump operations slower than N us to stderr,\n"
+		"                               needs a PLAYDB_TRACE build\n"
+		"  --workloads LIST             comma separated, from\n"
+		"                               insert,query,miss,update,scan,traverse,mixed,open\n");
+}
+
+// 10k, 64M, 1G; decimal for counts, binary for byte sizes
+uint64_t parse_size(const std::string& s, uint64_t unit)
+{
+	char* end = nullptr;
+	double v = strtod(s.c_str(), &end);
+	if (end == s.c_str()) {
+		throw std::invalid_argument("bad number: " + s);
+	}
+	switch (*end)
+	{
+	case 'k': case 'K': v *= unit; break;
+	case 'm': case 'M': v *= unit * unit; break;
+	case 'g': case 'G': v *= unit * unit * unit; break;
+	case '\0': break;
+	default:
+		throw std::invalid_argument("bad number: " + s);
+	}
+	return static_cast<uint64_t>(v);
+}
+
+Options parse_options(int argc, char* argv[])
+{
+	Options opt;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string name = argv[i];
+		if (name == "--help" || name == "-h") {
+			usage();
+			exit(0);
+		}
+		if (i + 1 >= argc) {
+			throw std::invalid_argument("missing value for " + name);
+		}
+		std::string value = argv[++i];
+
+		if (name == "--storage") opt.storage = value;
+		else if (name == "--key") opt.key = value;
+		else if (name == "--order") opt.order = value;
+		else if (name == "--codec") opt.codec = value;
+		else if (name == "--pages") opt.pages = value;
+		else if (name == "--dir") opt.dir = value;
+		else if (name == "--workloads") opt.workloads = value;
+		else if (name == "--count") opt.count = parse_size(value, 1000);
+		else if (name == "--ops") opt.ops = parse_size(value, 1000);
+		else if (name == "--seed") opt.seed = parse_size(value, 1000);
+		else if (name == "--degree") opt.degree = parse_size(value, 1000);
+		else if (name == "--value-size") opt.value_size = parse_size(value, 1024);
+		else if (name == "--page-size") opt.page_size = parse_size(value, 1024);
+		else if (name == "--cache-size") opt.cache_size = parse_size(value, 1024);
+		else if (name == "--node-cache") opt.node_cache = parse_size(value, 1000);
+		else if (name == "--slow-us") opt.slow_us = parse_size(value, 1000);
+		else throw std::invalid_argument("unknown option " + name);
+	}
+
+	if (opt.ops == 0) {
+		opt.ops = std::min<uint64_t>(opt.count, 1000000);
+	}
+	if (opt.pages != "plain" && opt.pages != "compact") {
+		throw std::invalid_argument("unknown page format " + opt.pages);
+	}
+	if (opt.count == 0 || opt.degree < 2) {
+		throw std::invalid_argument("count must be positive and degree at least 2");
+	}
+	return opt;
+}
+
+storage::Codec parse_codec(const std::string& name)
+{
+	if (name == "none") return storage::Codec::NONE;
+	if (name == "lz")   return storage::Codec::LZ;
+	if (name == "lz4")  return storage::Codec::LZ4;
+	if (name == "zstd") return storage::Codec::ZSTD;
+	throw std::invalid_argument("unknown codec " + name);
+}
+
+// Key i of the loaded set. Misses come from the odd numbers in between,
+// so both are spread over the same range.
+template <typename T>
+struct KeyTraits;
+
+template <>
+struct KeyTraits<int32_t>
+{
+	static int32_t Make(uint64_t i, bool miss = false) {
+		return static_cast<int32_t>(i * 2 + (miss ? 1 : 0));
+	}
+};
+
+template <>
+struct KeyTraits<int64_t>
+{
+	static int64_t Make(uint64_t i, bool miss = false) {
+		return static_cast<int64_t>(i * 2 + (miss ? 1 : 0));
+	}
+};
+
+template <>
+struct KeyTraits<std::string>
+{
+	// zero padded, so the string order is the numeric one
+	static std::string Make(uint64_t i, bool miss = false) {
+		char buf[24];
+		snprintf(buf, sizeof(buf), "%016llu", static_cast<unsigned long long>(i * 2 + (miss ? 1 : 0)));
+		return buf;
+	}
+};
+
+class CountVisitor : public IVisitor
+{
+public:
+	virtual void VisitNode(const INode& node) override { ++nodes; }
+	virtual void VisitData(const IData& data) override { ++entries; }
+
+	uint64_t nodes = 0;
+	uint64_t entries = 0;
+
+}; // CountVisitor
+
+class Timer
+{
+public:
+	Timer() : m_start(std::chrono::steady_clock::now()) {}
+
+	uint64_t Nanoseconds() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - m_start).count();
+	}
+
+private:
+	std::chrono::steady_clock::time_point m_start;
+
+}; // Timer
+
+template <typename T>
+class Bench
+{
+public:
+	Bench(const Options& opt)
+		: m_opt(opt)
+		, m_value(opt.value_size, 'v')
+		, m_rng(opt.seed)
+		, m_stride(1)
+		, m_loaded(false)
+	{
+		if (opt.order == "random")
+		{
+			// i * stride mod count visits every key once, in a scattered order
+			m_stride = static_cast<uint64_t>(opt.count * 0.6180339887) | 1;
+			while (gcd(m_stride, opt.count) != 1) {
+				++m_stride;
+			}
+		}
+		else if (opt.order != "sequential")
+		{
+			throw std::invalid_argument("unknown order " + opt.order);
+		}
+	}
+
+	void Run()
+	{
+		Open(true);
+
+		size_t begin = 0;
+		while (begin <= m_opt.workloads.size())
+		{
+			size_t end = m_opt.workloads.find(',', begin);
+			if (end == std::string::npos) {
+				end = m_opt.workloads.size();
+			}
+			std::string name = m_opt.workloads.substr(begin, end - begin);
+			begin = end + 1;
+
+			if (name == "insert") {
+				Insert();
+				continue;
+			}
+
+			if (!m_loaded) {
+				Load();
+			}
+			if (name == "query") {
+				Query(false);
+			} else if (name == "miss") {
+				Query(true);
+			} else if (name == "update") {
+				Update();
+			} else if (name == "scan") {
+				Scan();
+			} else if (name == "traverse") {
+				Traverse();
+			} else if (name == "mixed") {
+				Mixed();
+			} else if (name == "open") {
+				Reopen();
+			} else if (!name.empty()) {
+				throw std::invalid_argument("unknown workload " + name);
+			}
+		}
+
+		Close();
+	}
+
+private:
+	void Open(bool create)
+	{
+		if (m_opt.storage == "memory")
+		{
+			m_storage.reset(new storage::MemoryStorageManager(m_opt.page_size));
+		}
+		else if (m_opt.storage == "disk")
+		{
+			m_storage.reset(new storage::DiskStorageManager(
+				m_opt.dir + "/playdb_bench.idx", m_opt.dir + "/playdb_bench.dat",
+				create, m_opt.page_size, parse_codec(m_opt.codec), m_opt.cache_size));
+		}
+		else
+		{
+			throw std::invalid_argument("unknown storage " + m_opt.storage);
+		}
+
+		if (create) {
+			m_tree.reset(new btree::BTree<T>(m_storage.get(), m_opt.degree));
+			m_tree->EnableCompactPages(m_opt.pages == "compact");
+		} else {
+			m_tree.reset(new btree::BTree<T>(m_storage.get()));
+		}
+		m_tree->SetCacheCapacity(m_opt.node_cache);
+	}
+
+	void Close()
+	{
+		m_tree.reset();
+		m_storage.reset();
+	}
+
+	uint64_t KeyIndex(uint64_t i) const
+	{
+		return i * m_stride % m_opt.count;
+	}
+
+	void InsertKey(uint64_t idx)
+	{
+		m_tree->InsertData(KeyTraits<T>::Make(idx), m_value.size(), m_value.data());
+	}
+
+	void Insert()
+	{
+		if (m_loaded) {
+			throw std::invalid_argument("insert must come before the other workloads");
+		}
+
+		LatencyHistogram hist;
+		Begin();
+		Timer total;
+		for (uint64_t i = 0; i < m_opt.count; ++i)
+		{
+			Timer t;
+			InsertKey(KeyIndex(i));
+			hist.Record(t.Nanoseconds());
+		}
+		Report("insert", m_opt.count, total.Nanoseconds(), &hist);
+		m_loaded = true;
+	}
+
+	void Load()
+	{
+		for (uint64_t i = 0; i < m_opt.count; ++i) {
+			InsertKey(KeyIndex(i));
+		}
+		m_loaded = true;
+	}
+
+	void Query(bool miss)
+	{
+		std::uniform_int_distribution<uint64_t> dist(0, m_opt.count - 1);
+		LatencyHistogram hist;
+		uint64_t found = 0;
+
+		Begin();
+		Timer total;
+		for (uint64_t i = 0; i < m_opt.ops; ++i)
+		{
+			T key = KeyTraits<T>::Make(dist(m_rng), miss);
+			btree::Data<T> data;
+			Timer t;
+			found += m_tree->Query(key, data);
+			hist.Record(t.Nanoseconds());
+		}
+		Report(miss ? "miss" : "query", m_opt.ops, total.Nanoseconds(), &hist);
+
+		if (found != (miss ? 0 : m_opt.ops)) {
+			throw std::runtime_error("query results are wrong");
+		}
+	}
+
+	// rewrites the values of random keys in place, same size
+	void Update()
+	{
+		std::uniform_int_distribution<uint64_t> dist(0, m_opt.count - 1);
+		LatencyHistogram hist;
+		uint64_t found = 0;
+		std::vector<byte> value(m_value);
+
+		Begin();
+		Timer total;
+		for (uint64_t i = 0; i < m_opt.ops; ++i)
+		{
+			T key = KeyTraits<T>::Make(dist(m_rng));
+			if (!value.empty()) {
+				value[0] = static_cast<byte>(i);
+			}
+			Timer t;
+			found += m_tree->Update(key, value.size(), value.data());
+			hist.Record(t.Nanoseconds());
+		}
+		Report("update", m_opt.ops, total.Nanoseconds(), &hist);
+
+		if (found != m_opt.ops) {
+			throw std::runtime_error("updates missed keys");
+		}
+	}
+
+	// short range scans of SCAN_LENGTH keys
+	void Scan()
+	{
+		static const uint64_t SCAN_LENGTH = 100;
+		uint64_t ops = std::max<uint64_t>(m_opt.ops / SCAN_LENGTH, 1);
+		std::uniform_int_distribution<uint64_t> dist(0, m_opt.count - 1);
+		LatencyHistogram hist;
+		CountVisitor visitor;
+
+		Begin();
+		Timer total;
+		for (uint64_t i = 0; i < ops; ++i)
+		{
+			uint64_t lo = dist(m_rng);
+			Timer t;
+			m_tree->RangeQuery(KeyTraits<T>::Make(lo), KeyTraits<T>::Make(lo + SCAN_LENGTH - 1), visitor);
+			hist.Record(t.Nanoseconds());
+		}
+		Report("scan", ops, total.Nanoseconds(), &hist, visitor.entries);
+	}
+
+	void Traverse()
+	{
+		CountVisitor visitor;
+		Begin();
+		Timer total;
+		m_tree->LayerTraverse(visitor);
+		Report("traverse", 1, total.Nanoseconds(), nullptr, visitor.entries);
+
+		if (visitor.entries != m_opt.count) {
+			throw std::runtime_error("traversal missed entries");
+		}
+	}
+
+	// 70% hits, 10% misses, 15% inserts of new keys, 5% deletes
+	void Mixed()
+	{
+		std::uniform_int_distribution<uint64_t> dist(0, m_opt.count - 1);
+		std::uniform_int_distribution<int> pick(0, 99);
+		LatencyHistogram hist;
+		uint64_t next = m_opt.count;
+		std::vector<uint64_t> inserted;
+
+		Begin();
+		Timer total;
+		for (uint64_t i = 0; i < m_opt.ops; ++i)
+		{
+			int op = pick(m_rng);
+			uint64_t idx = dist(m_rng);
+			btree::Data<T> data;
+			Timer t;
+			if (op < 70) {
+				m_tree->Query(KeyTraits<T>::Make(idx), data);
+			} else if (op < 80) {
+				m_tree->Query(KeyTraits<T>::Make(idx, true), data);
+			} else if (op < 95) {
+				inserted.push_back(next);
+				InsertKey(next++);
+			} else if (!inserted.empty()) {
+				m_tree->DeleteData(KeyTraits<T>::Make(inserted.back()));
+				inserted.pop_back();
+			}
+			hist.Record(t.Nanoseconds());
+		}
+		Report("mixed", m_opt.ops, total.Nanoseconds(), &hist);
+
+		// back to count keys for the workloads after this one
+		for (auto idx : inserted) {
+			m_tree->DeleteData(KeyTraits<T>::Make(idx));
+		}
+	}
+
+	// closing writes the tree and the storage index, opening reads them
+	// back, the first queries after it start cold
+	void Reopen()
+	{
+		if (m_opt.storage != "disk") {
+			fprintf(stderr, "open: skipped, the memory storage does not persist\n");
+			return;
+		}
+
+		Begin();
+		Timer flush;
+		Close();
+		Report("flush", 1, flush.Nanoseconds(), nullptr);
+
+		Timer open;
+		Open(false);
+		uint64_t ns = open.Nanoseconds();
+		// a new tree and storage, their counters start from zero
+		m_start_stats = typename btree::BTree<T>::Statistics();
+		m_start_storage = StorageStatistics();
+		Report("open", 1, ns, nullptr);
+
+		// the rest of the page index, loaded in the background meanwhile
+		Begin();
+		Timer index;
+		static_cast<storage::DiskStorageManager*>(m_storage.get())->LoadIndex();
+		Report("index_load", 1, index.Nanoseconds(), nullptr);
+
+		Query(false);
+	}
+
+	void Begin()
+	{
+		m_start_stats = m_tree->GetStatistics();
+		m_start_storage = m_storage->GetStatistics();
+	}
+
+	void Report(const char* name, uint64_t ops, uint64_t ns, const LatencyHistogram* hist, uint64_t entries = 0)
+	{
+		double seconds = ns / 1e9;
+		printf("{\"benchmark\":\"%s\",\"storage\":\"%s\",\"key\":\"%s\",\"order\":\"%s\",\"codec\":\"%s\",\"pages\":\"%s\","
+			"\"degree\":%zu,\"page_size\":%zu,\"value_size\":%zu,\"cache_size\":%zu,\"node_cache\":%zu,"
+			"\"count\":%llu,\"ops\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f",
+			name, m_opt.storage.c_str(), m_opt.key.c_str(), m_opt.order.c_str(), m_opt.codec.c_str(), m_opt.pages.c_str(),
+			m_opt.degree, m_opt.page_size, m_opt.value_size, m_opt.cache_size, m_opt.node_cache,
+			static_cast<unsigned long long>(m_opt.count), static_cast<unsigned long long>(ops),
+			seconds, seconds > 0 ? ops / seconds : 0.0);
+		if (hist) {
+			printf(",\"mean_ns\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu",
+				hist->GetMean(),
+				static_cast<unsigned long long>(hist->Percentile(0.5)),
+				static_cast<unsigned long long>(hist->Percentile(0.99)),
+				static_cast<unsigned long long>(hist->Percentile(0.999)),
+				static_cast<unsigned long long>(hist->GetMax()));
+		}
+		if (entries > 0) {
+			printf(",\"entries\":%llu", static_cast<unsigned long long>(entries));
+		}
+		if (m_tree)
+		{
+			auto stats = m_tree->GetStatistics();
+			printf(",\"node_reads\":%llu,\"node_writes\":%llu,\"nodes\":%llu,\"tree_height\":%llu",
+				static_cast<unsigned long long>(stats.reads - m_start_stats.reads),
+				static_cast<unsigned long long>(stats.writes - m_start_stats.writes),
+				static_cast<unsigned long long>(stats.nodes),
+				static_cast<unsigned long long>(stats.tree_height));
+
+			auto storage = m_storage->GetStatistics();
+			printf(",\"bytes_read\":%llu,\"bytes_written\":%llu",
+				static_cast<unsigned long long>(storage.bytes_read - m_start_storage.bytes_read),
+				static_cast<unsigned long long>(storage.bytes_written - m_start_storage.bytes_written));
+		}
+		printf("}\n");
+		fflush(stdout);
+
+#ifdef PLAYDB_TRACE
+		if (m_opt.slow_us > 0) {
+			std::cerr << "slow operations of " << name << ":\n";
+			trace::DumpSlowOps(std::cerr);
+			trace::ClearSlowOps();
+		}
+#endif
+	}
+
+	static uint64_t gcd(uint64_t a, uint64_t b)
+	{
+		while (b) {
+			uint64_t t = a % b;
+			a = b;
+			b = t;
+		}
+		return a;
+	}
+
+private:
+	const Options& m_opt;
+
+	std::vector<byte> m_value;
+	std::mt19937_64 m_rng;
+	uint64_t m_stride;
+	bool m_loaded;
+
+	std::unique_ptr<IStorageManager> m_storage;
+	std::unique_ptr<btree::BTree<T>> m_tree;
+
+	typename btree::BTree<T>::Statistics m_start_stats;
+	StorageStatistics m_start_storage;
+
+}; // Bench
+
+}
+
+int main(int argc, char* argv[])
+{
+	try {
+		Options opt = parse_options(argc, argv);
+#ifdef PLAYDB_TRACE
+		trace::SetSlowThreshold(opt.slow_us > 0 ? opt.slow_us * 1000 : UINT64_MAX);
+#else
+		if (opt.slow_us > 0) {
+			fprintf(stderr, "playdb_bench: --slow-us needs a PLAYDB_TRACE build\n");
+		}
+#endif
+		if (opt.key == "int32") {
+			Bench<int32_t>(opt).Run();
+		} else if (opt.key == "int64") {
+			Bench<int64_t>(opt).Run();
+		} else if (opt.key == "string") {
+			Bench<std::string>(opt).Run();
+		} else {
+			throw std::invalid_argument("unknown key type " + opt.key);
+		}
+	} catch (std::exception& e) {
+		fprintf(stderr, "playdb_bench: %s\n", e.what());
+		return 1;
+	} catch (playdb::Exception& e) {
+		fprintf(stderr, "playdb_bench: %s\n", e.what().c_str());
+		return 1;
+	}
+
+	return 0;
+}
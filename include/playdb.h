@@ -2,6 +2,7 @@
 #define _PLAYDB_PLAYDB_H_
 
 #include "playdb/typedef.h"
+#include "playdb/Metrics.h"
 
 namespace playdb
 {
@@ -12,6 +13,24 @@ public:
 	virtual void LoadByteArray(const id_type id, size_t& len, byte** data) = 0;
 	virtual void StoreByteArray(id_type& id, const size_t len, const byte* const data) = 0;
 	virtual void DeleteByteArray(const id_type id) = 0;
+
+	// Return the stored bytes without copying into a new allocation, or
+	// nullptr if the backend can't lend them. Valid until the next call on
+	// the storage manager.
+	virtual const byte* BorrowByteArray(const id_type id, size_t& len) { return nullptr; }
+
+	// Hint that the entries will be loaded soon, a backend may start
+	// reading them in the background.
+	virtual void Prefetch(const id_type* ids, size_t count) {}
+
+	// snapshot of the counters, callable while other threads use the
+	// storage manager
+	virtual StorageStatistics GetStatistics() const { return StorageStatistics(); }
+
+	// writes out whatever the backend still buffers, nothing to do for
+	// backends that aren't persistent
+	virtual void Flush() {}
+
 	virtual ~IStorageManager() {}
 }; // IStorageManager
 
@@ -0,0 +1,91 @@
+#ifndef _PLAYDB_CATALOG_H_
+#define _PLAYDB_CATALOG_H_
+
+#include "playdb.h"
+#include "playdb/typedef.h"
+
+#include <map>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <atomic>
+
+namespace playdb
+{
+
+// Node cache budget of the trees opened through one catalog, each open
+// tree keeps an even share of it. Trees apply a new share the next time
+// they load a node.
+class CacheBudget
+{
+public:
+	CacheBudget(size_t nodes) : m_capacity(nodes), m_trees(0) {}
+
+	void SetCapacity(size_t nodes) { m_capacity = nodes; }
+	size_t GetCapacity() const { return m_capacity; }
+
+	// nodes a tree may keep now
+	size_t GetShare() const;
+
+	void Attach() { ++m_trees; }
+	void Detach() { --m_trees; }
+
+private:
+	std::atomic<size_t> m_capacity;
+	std::atomic<size_t> m_trees;
+
+}; // CacheBudget
+
+// Names of the trees kept in one storage manager, each mapped to the page
+// id of its header. The catalog is the storage's first entry (id 0), it is
+// created on an empty storage and loaded otherwise. Trees are created and
+// opened by name through their catalog constructors, all of them share
+// the storage and its page cache, and a budget for their node caches
+// that holds however many trees are open. Changes are stored right away.
+class Catalog
+{
+public:
+	Catalog(IStorageManager* storage_mgr, size_t cache_nodes = DEFAULT_CACHE_NODES);
+
+	bool Find(const std::string& name, id_type& header_id) const;
+
+	// the name must be new
+	void Insert(const std::string& name, id_type header_id);
+	// only forgets the name, the tree's pages stay
+	bool Erase(const std::string& name);
+
+	std::vector<std::string> GetNames() const;
+	size_t GetSize() const;
+
+	IStorageManager* GetStorageManager() const { return m_storage_mgr; }
+
+	// resident nodes of all the trees opened through the catalog
+	void SetCacheCapacity(size_t nodes) { m_cache_budget->SetCapacity(nodes); }
+	const std::shared_ptr<CacheBudget>& GetCacheBudget() const { return m_cache_budget; }
+
+	static const size_t DEFAULT_CACHE_NODES = 4096;
+
+private:
+	// magic, the tree count as uint64, then name and header id of each tree
+	void Store(bool create = false);
+	void Load();
+
+private:
+	static const id_type CATALOG_ID = 0;
+	static const uint32_t MAGIC = 0x43424450; // "PDBC"
+
+	IStorageManager* m_storage_mgr;
+
+	std::map<std::string, id_type> m_trees;
+
+	// shared with the trees, which may outlive the catalog
+	std::shared_ptr<CacheBudget> m_cache_budget;
+
+	mutable std::mutex m_mutex;
+
+}; // Catalog
+
+}
+
+#endif // _PLAYDB_CATALOG_H_
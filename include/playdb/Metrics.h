@@ -0,0 +1,133 @@
+#ifndef _PLAYDB_METRICS_H_
+#define _PLAYDB_METRICS_H_
+
+#include "playdb/typedef.h"
+
+#include <atomic>
+#include <chrono>
+
+namespace playdb
+{
+
+// Statistics counter, readable from any thread while its owner updates it.
+// Updates must come from one thread at a time (the owner's lock or thread),
+// which keeps them plain loads and stores instead of atomic read-modify-
+// writes. Copying takes a snapshot.
+class Counter
+{
+public:
+	Counter(size_t value = 0) : m_value(value) {}
+	Counter(const Counter& c) : m_value(c.Get()) {}
+	Counter& operator = (const Counter& c) { Set(c.Get()); return *this; }
+
+	size_t Get() const { return m_value.load(std::memory_order_relaxed); }
+	void Set(size_t value) { m_value.store(value, std::memory_order_relaxed); }
+	operator size_t () const { return Get(); }
+
+	Counter& operator += (size_t n) { Set(Get() + n); return *this; }
+	Counter& operator -= (size_t n) { Set(Get() - n); return *this; }
+	Counter& operator ++ () { return *this += 1; }
+	Counter& operator -- () { return *this -= 1; }
+	size_t operator ++ (int) { size_t v = Get(); Set(v + 1); return v; }
+	size_t operator -- (int) { size_t v = Get(); Set(v - 1); return v; }
+
+private:
+	std::atomic<size_t> m_value;
+
+}; // Counter
+
+// Latency histogram in nanoseconds with log-linear buckets: exact below 32,
+// then 16 per power of two, so percentiles are within ~3%. Same threading
+// rules as Counter, fixed size, recording never allocates.
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+	LatencyHistogram(const LatencyHistogram& h);
+	LatencyHistogram& operator = (const LatencyHistogram& h);
+
+	void Record(uint64_t ns);
+
+	// p in [0, 1], 0 if nothing was recorded
+	uint64_t Percentile(double p) const;
+
+	uint64_t GetCount() const { return m_count.load(std::memory_order_relaxed); }
+	uint64_t GetMax() const { return m_max.load(std::memory_order_relaxed); }
+	uint64_t GetSum() const { return m_sum.load(std::memory_order_relaxed); }
+	double GetMean() const;
+
+private:
+	static size_t Index(uint64_t ns);
+	static uint64_t Value(size_t idx);
+
+private:
+	static const int SUB_BITS = 4;
+	static const uint64_t SUB = 1 << SUB_BITS;
+	static const size_t BUCKETS = 2 * SUB + (64 - SUB_BITS - 1) * SUB;
+
+	std::atomic<uint64_t> m_buckets[BUCKETS];
+
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum;
+	std::atomic<uint64_t> m_max;
+
+}; // LatencyHistogram
+
+// Records the time until it goes out of scope, nothing if hist is null.
+class LatencyTimer
+{
+public:
+	LatencyTimer(LatencyHistogram* hist)
+		: m_hist(hist)
+	{
+		if (m_hist) {
+			m_start = std::chrono::steady_clock::now();
+		}
+	}
+	~LatencyTimer()
+	{
+		if (m_hist) {
+			m_hist->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - m_start).count());
+		}
+	}
+
+	LatencyTimer(const LatencyTimer&) = delete;
+	LatencyTimer& operator = (const LatencyTimer&) = delete;
+
+private:
+	LatencyHistogram* m_hist;
+	std::chrono::steady_clock::time_point m_start;
+
+}; // LatencyTimer
+
+// Counters of a storage manager. Backends fill in what applies to them.
+struct StorageStatistics
+{
+	// LoadByteArray/BorrowByteArray, StoreByteArray and DeleteByteArray calls
+	Counter loads;
+	Counter stores;
+	Counter deletes;
+
+	// bytes moved from and to the backing store, pages for a disk file
+	Counter bytes_read;
+	Counter bytes_written;
+
+	// page cache lookups of reads
+	Counter cache_hits;
+	Counter cache_misses;
+
+	Counter pages_allocated;
+	Counter pages_freed;
+
+	// at the time of the snapshot
+	Counter pages;
+	Counter free_pages;
+
+	Counter flushes;
+	LatencyHistogram flush_latency;
+};
+
+}
+
+#endif // _PLAYDB_METRICS_H_
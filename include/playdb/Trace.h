@@ -0,0 +1,122 @@
+#ifndef _PLAYDB_TRACE_H_
+#define _PLAYDB_TRACE_H_
+
+// Per-operation tracing, built in with PLAYDB_TRACE defined. Without it
+// the PLAYDB_TRACE_* macros expand to nothing.
+//
+// A span covers one top-level call (a BTree query, insert, delete or range
+// query, a storage flush) on the calling thread and collects what the
+// layers below did for it. Spans slower than the threshold are kept in a
+// ring buffer for GetSlowOps()/DumpSlowOps().
+
+#ifdef PLAYDB_TRACE
+
+#include "playdb/typedef.h"
+
+#include <vector>
+#include <iosfwd>
+
+namespace playdb
+{
+namespace trace
+{
+
+struct Record
+{
+	const char* op;
+
+	// steady clock, ns
+	uint64_t start_ns;
+	uint64_t total_ns;
+
+	// child nodes descended into, and the ones not resident
+	size_t nodes;
+	size_t node_loads;
+	size_t node_stores;
+	size_t splits;
+
+	// data file pages, cache hits not included
+	size_t pages_read;
+	size_t pages_written;
+
+	// node serialization and page copies
+	size_t bytes_copied;
+
+	// (de)serializing nodes, inside storage manager calls, and the file
+	// reads and writes among the latter
+	uint64_t serialize_ns;
+	uint64_t storage_ns;
+	uint64_t io_ns;
+};
+
+// span of the calling thread, nullptr outside of one
+Record* Current();
+
+// 1ms by default
+void SetSlowThreshold(uint64_t ns);
+uint64_t GetSlowThreshold();
+
+// 256 by default, the oldest record goes when full
+void SetSlowOpCapacity(size_t capacity);
+
+// oldest first
+std::vector<Record> GetSlowOps();
+void ClearSlowOps();
+void DumpSlowOps(std::ostream& os);
+
+// Starts a span unless the thread is in one already, nested calls add to
+// the outer span.
+class Span
+{
+public:
+	Span(const char* op);
+	~Span();
+
+	Span(const Span&) = delete;
+	Span& operator = (const Span&) = delete;
+
+private:
+	Record m_record;
+	bool   m_active;
+
+}; // Span
+
+// adds the time until it goes out of scope to a field of the current span
+class Timer
+{
+public:
+	Timer(uint64_t Record::*field);
+	~Timer();
+
+	Timer(const Timer&) = delete;
+	Timer& operator = (const Timer&) = delete;
+
+private:
+	Record*  m_record;
+	uint64_t Record::*m_field;
+	uint64_t m_start;
+
+}; // Timer
+
+}
+}
+
+#define PLAYDB_TRACE_CONCAT_(a, b) a##b
+#define PLAYDB_TRACE_CONCAT(a, b) PLAYDB_TRACE_CONCAT_(a, b)
+
+#define PLAYDB_TRACE_SPAN(op) \
+	::playdb::trace::Span PLAYDB_TRACE_CONCAT(_trace_span_, __LINE__)(op)
+#define PLAYDB_TRACE_TIME(field) \
+	::playdb::trace::Timer PLAYDB_TRACE_CONCAT(_trace_timer_, __LINE__)(&::playdb::trace::Record::field)
+#define PLAYDB_TRACE_ADD(field, n) \
+	do { if (::playdb::trace::Record* _r = ::playdb::trace::Current()) _r->field += (n); } while (0)
+
+#else
+
+#define PLAYDB_TRACE_SPAN(op)
+#define PLAYDB_TRACE_TIME(field)
+#define PLAYDB_TRACE_ADD(field, n) do {} while (0)
+
+#endif // PLAYDB_TRACE
+
+#endif // _PLAYDB_TRACE_H_
@@ -2,8 +2,21 @@
 #define _PLAYDB_BTREE_BTREE_H_
 
 #include "playdb/typedef.h"
+#include "playdb/Metrics.h"
+#include "playdb/Catalog.h"
 #include "playdb/btree/BTreeNode.h"
 #include "playdb/btree/tools.h"
+#include "playdb/btree/BloomFilter.h"
+#include "playdb/btree/ValueCache.h"
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <set>
+#include <functional>
+#include <mutex>
+#include <string>
 
 namespace playdb
 {
@@ -14,24 +27,267 @@ template <typename T>
 class BTree
 {
 public:
-	// degree = order / 2
-	BTree(IStorageManager* storage_mgr, size_t degree);
+	// Counters only grow, except for the sizes, take differences of
+	// snapshots for rates.
+	struct Statistics
+	{
+		// node pages loaded and stored, node cache hits and misses
+		Counter reads;
+		Counter writes;
+		Counter hits;
+		Counter misses;
+
+		// node splits, and rotations and merges of deletes
+		Counter splits;
+		Counter adjustments;
+
+		// entries returned by Query and RangeQuery
+		Counter query_results;
+
+		// values changed in place by Update, Upsert and Modify
+		Counter updates;
+
+		// sizes: nodes, entries and levels
+		Counter nodes;
+		Counter data;
+		Counter tree_height;
+
+		// misses answered by the filter, and misses it let through
+		Counter filter_negatives;
+		Counter filter_false_positives;
+
+		// Query calls answered by the value cache
+		Counter value_hits;
+
+		// right-heavy splits, and inserts that skipped the descent
+		Counter append_splits;
+		Counter fast_appends;
+
+		// per call, recorded while latency tracking is on
+		LatencyHistogram insert_latency;
+		LatencyHistogram delete_latency;
+		LatencyHistogram query_latency;
+		LatencyHistogram range_latency;
+		LatencyHistogram update_latency;
+	};
+
+	enum class SplitPolicy
+	{
+		// always in the middle
+		EVEN,
+		// while inserts keep coming in ascending order, a node that takes
+		// one past its largest key keeps ~90% and the new one starts small
+		AUTO,
+	};
+
+	// Frozen view of the tree as of CreateSnapshot(). Writers copy the pages
+	// it sees instead of changing them, the old versions are freed once the
+	// last snapshot seeing them is destroyed. Must not outlive the tree.
+	class Snapshot
+	{
+	public:
+		~Snapshot();
+		Snapshot(const Snapshot&) = delete;
+		Snapshot& operator = (const Snapshot&) = delete;
+
+		bool Query(const T& key, Data<T>& result);
+		void RangeQuery(const T& lo, const T& hi, IVisitor& visitor);
+		void LayerTraverse(IVisitor& visitor);
+
+		id_type GetRootID() const { return m_root_id; }
+
+	private:
+		Snapshot(BTree<T>* tree, id_type root_id, uint64_t epoch)
+			: m_tree(tree), m_root_id(root_id), m_epoch(epoch) {}
+
+	private:
+		BTree<T>* m_tree;
+		id_type   m_root_id;
+		uint64_t  m_epoch;
+
+		friend class BTree<T>;
+
+	}; // Snapshot
+
+public:
+	// degree = order / 2, counted trees keep the entry count of every
+	// subtree next to the child pointers for the order statistics below
+	BTree(IStorageManager* storage_mgr, size_t degree, bool counted = false);
+	// the tree stored first, the only one in a storage without a catalog
 	BTree(IStorageManager* storage_mgr);
+	// a new tree in the catalog's storage, listed as name
+	BTree(Catalog& catalog, const std::string& name, size_t degree, bool counted = false);
+	// the tree listed as name
+	BTree(Catalog& catalog, const std::string& name);
 	~BTree();
 
 	void InsertData(const T& key, size_t len, const byte* data);
+	bool DeleteData(const T& key);
+
+	// Replaces the value of the entry Query would return, found in one
+	// descent, and writes only its node. Data from earlier queries of the
+	// key must not be used after it. False if there is no such key.
+	bool Update(const T& key, size_t len, const byte* data);
+	// Update, or InsertData if the key is new
+	void Upsert(const T& key, size_t len, const byte* data);
+
+	typedef std::function<void(byte* data, size_t len)> Modifier;
+	// changes the value where it is, its size stays
+	bool Modify(const T& key, const Modifier& modify);
 
 	void LayerTraverse(IVisitor& visitor);
 
+	typedef std::function<std::unique_ptr<IVisitor>()> VisitorFactory;
+	typedef std::function<void(IVisitor&)> VisitorReduce;
+
+	// Visits every node and entry on threads threads (0 for one per core),
+	// each with its own visitor from factory. The top levels are visited
+	// by the first visitor, the subtrees below are handed out to the threads
+	// and visited breadth first, or in key order if ordered is set. reduce
+	// gets the visitors one after another once all threads are done.
+	// Nothing else may use the tree meanwhile.
+	void ParallelTraverse(size_t threads, const VisitorFactory& factory,
+		const VisitorReduce& reduce, bool ordered = false);
+
+	std::unique_ptr<Snapshot> CreateSnapshot();
+
 	bool Query(const T& key, Data<T>& result);
+	// visits the entries with lo <= key <= hi in key order
+	void RangeQuery(const T& lo, const T& hi, IVisitor& visitor);
+
+	// node writes between the two are held in the node cache and go out
+	// once per node on commit, sorted runs of inserts then cost one write
+	// per touched page instead of one per entry
+	void BeginBatch();
+	void CommitBatch();
+
+	// stores the writes of an open batch, the filter and the header, then
+	// flushes the storage, what the destructor leaves behind at any time
+	void Flush();
+
+	//
+	// order statistics, O(log n) node reads on a counted tree
+	//
+	// entries with a smaller key, the 0 based rank of key
+	size_t Rank(const T& key);
+	// the entry of rank k
+	bool SelectByRank(size_t k, Data<T>& result);
+	// visits the entries of rank [k, k + n) in key order
+	void SelectByRank(size_t k, size_t n, IVisitor& visitor);
+	// entries with lo <= key <= hi
+	size_t CountRange(const T& lo, const T& hi);
+
+	size_t GetDataCount();
+
+	// max resident nodes, parents of resident nodes hold direct pointers to
+	// them so a fully cached descent never goes through the page id lookup.
+	// Trees opened through a catalog share its budget instead, until this
+	// gives them their own.
+	void SetCacheCapacity(size_t nodes);
+	size_t GetCachedNodes() const { return m_resident.size(); }
+
+	// keeps a Bloom filter of all keys so most Query misses never leave
+	// memory, stored with the tree. Deleted keys stay in the filter until it
+	// is rebuilt, which happens whenever it outgrows its capacity.
+	void EnableFilter(size_t bits_per_key = DEFAULT_FILTER_BITS);
+
+	// caches Query results of hot keys, capacity in bytes, 0 turns it off
+	void SetValueCacheCapacity(size_t capacity);
+
+	// Stores nodes in the compact format from now on: ids and integer keys
+	// frame of reference bit packed, lengths and counts as varints. Pages
+	// of integer-keyed trees shrink several times, so a larger degree fits
+	// the same page budget and the tree gets lower. Pages in either format
+	// are read, the setting is kept with the tree.
+	void EnableCompactPages(bool enable);
+
+	void SetSplitPolicy(SplitPolicy policy) { m_split_policy = policy; }
+	// keeps the rightmost leaf at hand so inserts above the largest key go
+	// straight to it, not used on counted trees or while snapshots are open
+	void EnableAppendFastPath(bool enable);
+
+	// node page ids depth first, so parents precede their subtrees and
+	// leaves come in key order. Given to DiskStorageManager::BeginCompaction
+	// it lays the tree out for sequential scans.
+	void GetPageOrder(std::vector<id_type>& ids);
+
+	// page id of the tree's header, what a catalog lists
+	id_type GetHeaderID() const { return m_header_id; }
+
+	// a snapshot, may be taken by another thread while the tree is in use
+	Statistics GetStatistics() const { return m_stats; }
+	// times InsertData, DeleteData, Query, RangeQuery and Update calls,
+	// off by default, two clock reads per call
+	void EnableLatencyTracking(bool enable) { m_track_latency = enable; }
 
 private:
+	// opens the tree with its header at id
+	struct Header
+	{
+		id_type id;
+	};
+	BTree(IStorageManager* storage_mgr, Header header);
+
+	static IStorageManager* CheckNewName(Catalog& catalog, const std::string& name);
+	static Header FindName(const Catalog& catalog, const std::string& name);
+
+	void ShareCache(const std::shared_ptr<CacheBudget>& budget);
+
 	id_type WriteNode(BTreeNode<T>& node);
+	void StoreNode(BTreeNode<T>& node);
 	NodePtr<T> ReadNode(id_type id);
-	void DeleteNode(const BTreeNode<T>& node);
+	void DeleteNode(BTreeNode<T>& node);
+
+	// copy on write for pages a snapshot sees
+	bool IsShared(const BTreeNode<T>& node) const;
+	NodePtr<T> CopyNode(const BTreeNode<T>& node);
+	NodePtr<T> GetWritableRoot();
+	void ReleaseSnapshot(uint64_t epoch);
+	void ReclaimPages();
+
+	void CacheNode(const NodePtr<T>& node);
+	void EvictNodes();
+	void EvictNode(typename std::list<NodePtr<T>>::iterator itr);
+
+	bool Find(const NodePtr<T>& root, const T& key, Data<T>* result);
+	// the node holding key and its index, copied on the way down if a
+	// snapshot sees them, null if the key is missing
+	NodePtr<T> FindWritable(const T& key, size_t& idx);
+	void LayerTraverse(const NodePtr<T>& root, IVisitor& visitor);
+
+	// parts of ParallelTraverse, nodes are fetched under m_traverse_mutex
+	NodePtr<T> FetchChild(BTreeNode<T>& node, size_t i);
+	void VisitLayers(const NodePtr<T>& root, IVisitor& visitor);
+	void VisitInOrder(const NodePtr<T>& node, IVisitor& visitor);
+	void RangeQuery(const NodePtr<T>& node, const T& lo, const T& hi, IVisitor& visitor);
+
+	// hints the storage about children [first, last] that are not resident
+	void PrefetchChildren(const BTreeNode<T>& node, size_t first, size_t last);
+
+	// split policy for child idx of parent about to take key
+	bool SplitRightHeavy(const BTreeNode<T>& parent, size_t idx,
+		const BTreeNode<T>& child, const T& key) const;
+	bool AppendToRightmost(const T& key, size_t len, const byte* data);
+	NodePtr<T> FindRightmostLeaf();
+
+	size_t CountLess(const T& key, bool inclusive);
+	void SelectRange(const NodePtr<T>& node, size_t& k, size_t& n, IVisitor& visitor);
+	void CheckCounted() const;
+
+	void BuildFilter(size_t capacity, size_t bits_per_key);
+	void StoreFilter();
+	void LoadFilter();
 
+	// fixed width fields, the same in every build: magic, version, root
+	// id, degree, counted, filter id, sizes and compact pages. Headers of
+	// older versions hold native ids and size_t and are told apart by size
 	void StoreHeader();
 	void LoadHeader();
+	void LoadLegacyHeader(const byte* data, size_t len);
+
+	static const uint32_t HEADER_MAGIC = 0x54424450; // "PDBT"
+	static const uint32_t HEADER_VERSION = 2;
+	static const size_t HEADER_SIZE = 2 * sizeof(uint32_t) + 6 * sizeof(uint64_t) + 2 * sizeof(uint8_t);
 
 private:
 	size_t MaxKeys() const {
@@ -41,22 +297,6 @@ private:
 		return m_degree - 1;
 	}
 
-private:
-	struct Statistics
-	{
-		size_t reads;
-		size_t writes;
-		size_t splits;
-		size_t hits;
-		size_t misses;
-
-		size_t nodes;
-		size_t adjustments;
-		size_t query_results;
-		size_t data;
-		size_t tree_height;
-	};
-
 private:
 	IStorageManager* m_storage_mgr;
 
@@ -65,7 +305,57 @@ private:
 
 	size_t m_degree;
 
+	bool m_counted;
+
+	bool m_compact_pages;
+
+	NodePtr<T> m_root;
+
+	// resident nodes, swept by a clock hand
+	static const size_t DEFAULT_CACHE_CAPACITY = 1024;
+	size_t m_cache_capacity;
+	std::shared_ptr<CacheBudget> m_cache_budget;
+	std::list<NodePtr<T>> m_resident;
+	typename std::list<NodePtr<T>>::iterator m_clock_hand;
+	std::unordered_map<id_type, typename std::list<NodePtr<T>>::iterator> m_cache;
+
 	mutable Statistics m_stats;
+	bool m_track_latency;
+
+	std::vector<byte> m_write_buf;
+	std::vector<id_type> m_prefetch_ids;
+
+	// partitions per thread of a parallel traversal, uneven subtrees even
+	// out when idle threads take the remaining ones
+	static const size_t PARTITIONS_PER_THREAD = 8;
+	std::mutex m_traverse_mutex;
+
+	static const size_t DEFAULT_FILTER_BITS = 10;
+	std::unique_ptr<BloomFilter> m_filter;
+	id_type m_filter_id;
+	bool m_filter_dirty;
+
+	std::unique_ptr<ValueCache<T>> m_value_cache;
+
+	// +1 for an insert not below the previous one, halved otherwise
+	static const size_t APPEND_THRESHOLD = 16;
+	static const size_t APPEND_SCORE_MAX = 64;
+	SplitPolicy m_split_policy;
+	size_t m_append_score;
+	T m_last_key;
+
+	bool m_fast_append;
+	NodePtr<T> m_rightmost;
+
+	// deferred writes of an open batch, pinned in the cache until commit
+	bool m_batch;
+	std::vector<NodePtr<T>> m_dirty;
+
+	// epochs of the open snapshots, pages retired in some epoch are freed
+	// when no snapshot older than it is left
+	uint64_t m_epoch;
+	std::multiset<uint64_t> m_snapshots;
+	std::vector<std::pair<uint64_t, id_type>> m_retired;
 
 	friend class BTreeNode<T>;
 
@@ -4,9 +4,18 @@
 #include "playdb.h"
 #include "playdb/btree/BTree.h"
 #include "playdb/Exception.h"
+#include "playdb/Trace.h"
 
 #include <iostream>
 #include <queue>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <limits>
+
+#include <assert.h>
+#include <string.h>
 
 namespace playdb
 {
@@ -14,115 +23,941 @@ namespace btree
 {
 
 template <typename T>
-BTree<T>::BTree(IStorageManager* storage_mgr, size_t degree)
-	: m_storage_mgr(storage_mgr)
-	, m_root_id(storage::NEW_PAGE)
-	, m_header_id(storage::NEW_PAGE)
-	, m_degree(degree)
+BTree<T>::BTree(IStorageManager* storage_mgr, size_t degree, bool counted)
+	: m_storage_mgr(storage_mgr)
+	, m_root_id(storage::NEW_PAGE)
+	, m_header_id(storage::NEW_PAGE)
+	, m_degree(degree)
+	, m_counted(counted)
+	, m_compact_pages(false)
+	, m_cache_capacity(DEFAULT_CACHE_CAPACITY)
+	, m_stats()
+	, m_track_latency(false)
+	, m_filter_id(storage::NEW_PAGE)
+	, m_filter_dirty(false)
+	, m_split_policy(SplitPolicy::AUTO)
+	, m_append_score(0)
+	, m_last_key()
+	, m_fast_append(false)
+	, m_batch(false)
+	, m_epoch(1)
+{
+	m_clock_hand = m_resident.end();
+
+	StoreHeader();
+
+	m_root = std::make_shared<BTreeNode<T>>(this, storage::NEW_PAGE, true);
+	m_root_id = WriteNode(*m_root);
+	CacheNode(m_root);
+	m_stats.tree_height = 1;
+}
+
+template <typename T>
+BTree<T>::BTree(IStorageManager* storage_mgr)
+	: BTree(storage_mgr, Header{ 0 })
+{
+}
+
+template <typename T>
+BTree<T>::BTree(Catalog& catalog, const std::string& name, size_t degree, bool counted)
+	: BTree(CheckNewName(catalog, name), degree, counted)
+{
+	catalog.Insert(name, m_header_id);
+	ShareCache(catalog.GetCacheBudget());
+}
+
+template <typename T>
+BTree<T>::BTree(Catalog& catalog, const std::string& name)
+	: BTree(catalog.GetStorageManager(), FindName(catalog, name))
+{
+	ShareCache(catalog.GetCacheBudget());
+}
+
+template <typename T>
+BTree<T>::BTree(IStorageManager* storage_mgr, Header header)
+	: m_storage_mgr(storage_mgr)
+	, m_root_id(storage::NEW_PAGE)
+	, m_header_id(header.id)
+	, m_degree(0)
+	, m_counted(false)
+	, m_compact_pages(false)
+	, m_cache_capacity(DEFAULT_CACHE_CAPACITY)
+	, m_stats()
+	, m_track_latency(false)
+	, m_filter_id(storage::NEW_PAGE)
+	, m_filter_dirty(false)
+	, m_split_policy(SplitPolicy::AUTO)
+	, m_append_score(0)
+	, m_last_key()
+	, m_fast_append(false)
+	, m_batch(false)
+	, m_epoch(1)
+{
+	m_clock_hand = m_resident.end();
+
+	LoadHeader();
+	LoadFilter();
+
+	m_root = ReadNode(m_root_id);
+
+	// older headers don't keep the sizes
+	if (m_stats.tree_height == 0)
+	{
+		m_stats.tree_height = 1;
+		for (NodePtr<T> node = m_root; !node->m_leaf; node = node->GetChild(0)) {
+			m_stats.tree_height++;
+		}
+		if (m_counted) {
+			m_stats.data = m_root->GetCount();
+		}
+	}
+}
+
+template <typename T>
+BTree<T>::~BTree()
+{
+	assert(m_snapshots.empty());
+
+	// errors are lost here, Flush first to see them
+	try {
+		ReclaimPages();
+
+		CommitBatch();
+		StoreFilter();
+		StoreHeader();
+	} catch (...) {
+	}
+
+	if (m_cache_budget) {
+		m_cache_budget->Detach();
+	}
+}
+
+template <typename T>
+IStorageManager* BTree<T>::CheckNewName(Catalog& catalog, const std::string& name)
+{
+	// before any page of the tree is written
+	id_type id;
+	if (catalog.Find(name, id)) {
+		throw IllegalArgumentException("BTree: Tree " + name + " exists already.");
+	}
+	return catalog.GetStorageManager();
+}
+
+template <typename T>
+typename BTree<T>::Header BTree<T>::FindName(const Catalog& catalog, const std::string& name)
+{
+	Header header;
+	if (!catalog.Find(name, header.id)) {
+		throw IllegalArgumentException("BTree: No tree " + name + " in the catalog.");
+	}
+	return header;
+}
+
+template <typename T>
+void BTree<T>::ShareCache(const std::shared_ptr<CacheBudget>& budget)
+{
+	m_cache_budget = budget;
+	m_cache_budget->Attach();
+	EvictNodes();
+}
+
+template <typename T>
+void BTree<T>::InsertData(const T& key, size_t len, const byte* const data)
+{
+	PLAYDB_TRACE_SPAN("insert");
+	LatencyTimer timer(m_track_latency ? &m_stats.insert_latency : nullptr);
+
+	if (m_filter)
+	{
+		if (m_filter->GetCount() >= m_filter->GetCapacity()) {
+			BuildFilter(m_filter->GetCapacity() * 2, m_filter->GetBitsPerKey());
+		}
+		m_filter->Add(bloom_hash(key));
+		m_filter_dirty = true;
+	}
+	if (m_value_cache) {
+		m_value_cache->Erase(key);
+	}
+
+	bool append = !(key < m_last_key);
+	if (append) {
+		if (m_append_score < APPEND_SCORE_MAX) {
+			++m_append_score;
+		}
+	} else {
+		m_append_score /= 2;
+	}
+	m_last_key = key;
+
+	if (append && m_rightmost && AppendToRightmost(key, len, data)) {
+		m_stats.data++;
+		return;
+	}
+
+	NodePtr<T> root = GetWritableRoot();
+	if (root->m_entry_num == MaxKeys())
+	{
+		auto new_root = std::make_shared<BTreeNode<T>>(this, storage::NEW_PAGE, false);
+		new_root->m_children[0] = m_root_id;
+		new_root->SwizzleChild(0, root.get());
+		new_root->SplitChild(0, root, SplitRightHeavy(*new_root, 0, *root, key));
+		CacheNode(new_root);
+
+		m_root = new_root;
+		m_root_id = new_root->m_id;
+		root = new_root;
+		m_stats.tree_height++;
+	}
+	root->InsertEntryNonFull(len, data, key, storage::NEW_PAGE);
+	m_stats.data++;
+
+	// the next append can start where this one ended up, any other insert
+	// may have split the cached leaf or grown the root over it
+	if (m_fast_append && append && !m_counted && m_snapshots.empty()) {
+		m_rightmost = FindRightmostLeaf();
+	} else {
+		m_rightmost.reset();
+	}
+}
+
+template <typename T>
+bool BTree<T>::DeleteData(const T& key)
+{
+	PLAYDB_TRACE_SPAN("delete");
+	LatencyTimer timer(m_track_latency ? &m_stats.delete_latency : nullptr);
+
+	if (m_value_cache) {
+		m_value_cache->Erase(key);
+	}
+	m_rightmost.reset();
+
+	// a miss would still copy the search path while snapshots are open
+	if (!m_snapshots.empty() && !Find(m_root, key, nullptr)) {
+		return false;
+	}
+
+	NodePtr<T> root = GetWritableRoot();
+	bool found = root->DeleteEntry(key);
+
+	// a merge below the root took its last key
+	if (root->m_entry_num == 0 && !root->m_leaf)
+	{
+		m_root = root->GetChild(0);
+		m_root_id = m_root->m_id;
+		DeleteNode(*root);
+		m_stats.tree_height--;
+	}
+
+	if (found && m_stats.data > 0) {
+		m_stats.data--;
+	}
+	return found;
+}
+
+template <typename T>
+bool BTree<T>::Update(const T& key, size_t len, const byte* data)
+{
+	PLAYDB_TRACE_SPAN("update");
+	LatencyTimer timer(m_track_latency ? &m_stats.update_latency : nullptr);
+
+	size_t i;
+	NodePtr<T> node = FindWritable(key, i);
+	if (!node) {
+		return false;
+	}
+
+	node->SetEntryData(i, len, data);
+	WriteNode(*node);
+	m_stats.updates++;
+	return true;
+}
+
+template <typename T>
+void BTree<T>::Upsert(const T& key, size_t len, const byte* data)
+{
+	if (!Update(key, len, data)) {
+		InsertData(key, len, data);
+	}
+}
+
+template <typename T>
+bool BTree<T>::Modify(const T& key, const Modifier& modify)
+{
+	PLAYDB_TRACE_SPAN("modify");
+	LatencyTimer timer(m_track_latency ? &m_stats.update_latency : nullptr);
+
+	size_t i;
+	NodePtr<T> node = FindWritable(key, i);
+	if (!node) {
+		return false;
+	}
+
+	modify(node->m_entry_data[i], node->m_entry_len[i]);
+	WriteNode(*node);
+	m_stats.updates++;
+	return true;
+}
+
+template <typename T>
+void BTree<T>::SetCacheCapacity(size_t nodes)
+{
+	m_cache_capacity = nodes;
+	if (m_cache_budget) {
+		m_cache_budget->Detach();
+		m_cache_budget.reset();
+	}
+	EvictNodes();
+}
+
+template <typename T>
+void BTree<T>::EnableFilter(size_t bits_per_key)
+{
+	BuildFilter(1024, bits_per_key);
+}
+
+template <typename T>
+void BTree<T>::SetValueCacheCapacity(size_t capacity)
+{
+	if (capacity == 0) {
+		m_value_cache.reset();
+	} else {
+		m_value_cache.reset(new ValueCache<T>(capacity));
+	}
+}
+
+template <typename T>
+void BTree<T>::EnableCompactPages(bool enable)
+{
+	// resident nodes are stored in the new format the next time they change
+	m_compact_pages = enable;
+}
+
+template <typename T>
+void BTree<T>::EnableAppendFastPath(bool enable)
+{
+	m_fast_append = enable;
+	if (!enable) {
+		m_rightmost.reset();
+	}
+}
+
+template <typename T>
+bool BTree<T>::SplitRightHeavy(const BTreeNode<T>& parent, size_t idx,
+	                           const BTreeNode<T>& child, const T& key) const
+{
+	// only the last child of its parent, the nodes left of it are done
+	// filling up
+	return m_split_policy == SplitPolicy::AUTO
+		&& m_append_score >= APPEND_THRESHOLD
+		&& idx == parent.m_entry_num
+		&& child.m_entry_key[child.m_entry_num - 1] < key;
+}
+
+template <typename T>
+bool BTree<T>::AppendToRightmost(const T& key, size_t len, const byte* data)
+{
+	// counts on the path and copy on write both need the descent
+	if (m_counted || !m_snapshots.empty()) {
+		m_rightmost.reset();
+		return false;
+	}
+
+	BTreeNode<T>& leaf = *m_rightmost;
+	if (leaf.m_entry_num == 0 || leaf.m_entry_num == MaxKeys()
+	 || !(leaf.m_entry_key[leaf.m_entry_num - 1] < key)) {
+		return false;
+	}
+
+	leaf.InsertEntryNonFull(len, data, key, storage::NEW_PAGE);
+	m_stats.fast_appends++;
+	return true;
+}
+
+template <typename T>
+NodePtr<T> BTree<T>::FindRightmostLeaf()
+{
+	NodePtr<T> node = m_root;
+	while (!node->m_leaf) {
+		node = node->GetChild(node->m_entry_num);
+	}
+	return node;
+}
+
+template <typename T>
+std::unique_ptr<typename BTree<T>::Snapshot> BTree<T>::CreateSnapshot()
+{
+	// pages written up to now belong to the snapshot, later changes go to
+	// copies made in the next epoch
+	m_rightmost.reset();
+	uint64_t epoch = m_epoch++;
+	m_snapshots.insert(epoch);
+	return std::unique_ptr<Snapshot>(new Snapshot(this, m_root_id, epoch));
+}
+
+template <typename T>
+void BTree<T>::LayerTraverse(IVisitor& visitor)
+{
+	LayerTraverse(m_root, visitor);
+}
+
+template <typename T>
+void BTree<T>::LayerTraverse(const NodePtr<T>& root, IVisitor& visitor)
+{
+	std::queue<NodePtr<T>> st;
+	st.push(root);
+	while (!st.empty())
+	{
+		NodePtr<T> n = st.front(); st.pop();
+		visitor.VisitNode(*n);
+		for (size_t i = 0; i < n->m_entry_num; ++i) {
+			visitor.VisitData(Data<T>(
+					n->m_entry_id[i],
+					n->m_entry_key[i],
+					n->m_entry_data[i],
+					n->m_entry_len[i]));
+		}
+		if (!n->m_leaf) {
+			PrefetchChildren(*n, 0, n->m_entry_num);
+			for (size_t i = 0; i < n->m_entry_num + 1; ++i) {
+				st.push(n->GetChild(i));
+			}
+		}
+	}
+}
+
+template <typename T>
+void BTree<T>::ParallelTraverse(size_t threads, const VisitorFactory& factory,
+	                            const VisitorReduce& reduce, bool ordered)
+{
+	if (threads == 0) {
+		threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+
+	std::vector<std::unique_ptr<IVisitor>> visitors;
+	for (size_t i = 0; i < threads; ++i) {
+		visitors.push_back(factory());
+	}
+
+	// split level by level until there are enough subtrees, narrow ones
+	// also keep the breadth first queues short
+	size_t min_parts = threads * PARTITIONS_PER_THREAD;
+	std::vector<NodePtr<T>> parts;
+	parts.push_back(m_root);
+	while (parts.size() < min_parts && !parts.front()->m_leaf)
+	{
+		std::vector<NodePtr<T>> next;
+		for (auto& n : parts)
+		{
+			visitors[0]->VisitNode(*n);
+			for (size_t i = 0; i < n->m_entry_num; ++i) {
+				visitors[0]->VisitData(Data<T>(
+					n->m_entry_id[i],
+					n->m_entry_key[i],
+					n->m_entry_data[i],
+					n->m_entry_len[i]));
+			}
+			PrefetchChildren(*n, 0, n->m_entry_num);
+			for (size_t i = 0; i < n->m_entry_num + 1; ++i) {
+				next.push_back(n->GetChild(i));
+			}
+		}
+		parts.swap(next);
+	}
+
+	std::atomic<size_t> next_part(0);
+	std::exception_ptr error;
+	auto work = [&](IVisitor& visitor)
+	{
+		try {
+			size_t i;
+			while ((i = next_part++) < parts.size())
+			{
+				if (ordered) {
+					VisitInOrder(parts[i], visitor);
+				} else {
+					VisitLayers(parts[i], visitor);
+				}
+				parts[i].reset();
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(m_traverse_mutex);
+			if (!error) {
+				error = std::current_exception();
+			}
+			next_part = parts.size();
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (size_t i = 1; i < threads && i < parts.size(); ++i) {
+		pool.emplace_back(work, std::ref(*visitors[i]));
+	}
+	work(*visitors[0]);
+	for (auto& t : pool) {
+		t.join();
+	}
+
+	if (error) {
+		std::rethrow_exception(error);
+	}
+
+	for (auto& v : visitors) {
+		reduce(*v);
+	}
+}
+
+template <typename T>
+NodePtr<T> BTree<T>::FetchChild(BTreeNode<T>& node, size_t i)
+{
+	// the node cache and the storage are shared, visiting the entries is
+	// done outside the lock
+	std::lock_guard<std::mutex> lock(m_traverse_mutex);
+	return node.GetChild(i);
+}
+
+template <typename T>
+void BTree<T>::VisitLayers(const NodePtr<T>& root, IVisitor& visitor)
+{
+	std::queue<NodePtr<T>> st;
+	st.push(root);
+	while (!st.empty())
+	{
+		NodePtr<T> n = st.front(); st.pop();
+		visitor.VisitNode(*n);
+		for (size_t i = 0; i < n->m_entry_num; ++i) {
+			visitor.VisitData(Data<T>(
+					n->m_entry_id[i],
+					n->m_entry_key[i],
+					n->m_entry_data[i],
+					n->m_entry_len[i]));
+		}
+		if (!n->m_leaf) {
+			for (size_t i = 0; i < n->m_entry_num + 1; ++i) {
+				st.push(FetchChild(*n, i));
+			}
+		}
+	}
+}
+
+template <typename T>
+void BTree<T>::VisitInOrder(const NodePtr<T>& node, IVisitor& visitor)
+{
+	visitor.VisitNode(*node);
+	for (size_t i = 0; i <= node->m_entry_num; ++i)
+	{
+		if (!node->m_leaf) {
+			VisitInOrder(FetchChild(*node, i), visitor);
+		}
+		if (i < node->m_entry_num) {
+			visitor.VisitData(Data<T>(
+				node->m_entry_id[i],
+				node->m_entry_key[i],
+				node->m_entry_data[i],
+				node->m_entry_len[i]));
+		}
+	}
+}
+
+template <typename T>
+void BTree<T>::GetPageOrder(std::vector<id_type>& ids)
+{
+	std::vector<id_type> st;
+	st.push_back(m_root_id);
+	while (!st.empty())
+	{
+		id_type id = st.back(); st.pop_back();
+		ids.push_back(id);
+
+		NodePtr<T> n = ReadNode(id);
+		if (!n->m_leaf) {
+			for (size_t i = n->m_entry_num + 1; i > 0; --i) {
+				st.push_back(n->m_children[i - 1]);
+			}
+		}
+	}
+}
+
+template <typename T>
+bool BTree<T>::Query(const T& key, Data<T>& result)
+{
+	PLAYDB_TRACE_SPAN("query");
+	LatencyTimer timer(m_track_latency ? &m_stats.query_latency : nullptr);
+
+	if (m_value_cache && m_value_cache->Find(key, result)) {
+		m_stats.value_hits++;
+		m_stats.query_results++;
+		return true;
+	}
+
+	if (m_filter && !m_filter->MayContain(bloom_hash(key))) {
+		m_stats.filter_negatives++;
+		return false;
+	}
+
+	if (Find(m_root, key, &result)) {
+		if (m_value_cache) {
+			m_value_cache->Admit(result);
+		}
+		m_stats.query_results++;
+		return true;
+	}
+
+	if (m_filter) {
+		m_stats.filter_false_positives++;
+	}
+	return false;
+}
+
+template <typename T>
+bool BTree<T>::Find(const NodePtr<T>& root, const T& key, Data<T>* result)
+{
+	NodePtr<T> node = root;
+	while (true)
+	{
+		size_t i = 0;
+		while (i < node->m_entry_num && key > node->m_entry_key[i]) {
+			++i;
+		}
+		if (i < node->m_entry_num && node->m_entry_key[i] == key)
+		{
+			if (result) {
+				*result = Data<T>(
+					node->m_entry_id[i],
+					node->m_entry_key[i],
+					node->m_entry_data[i],
+					node->m_entry_len[i]);
+				result->holder = node;
+			}
+			return true;
+		}
+		if (node->m_leaf) {
+			return false;
+		}
+		node = node->GetChild(i);
+	}
+}
+
+template <typename T>
+NodePtr<T> BTree<T>::FindWritable(const T& key, size_t& idx)
+{
+	if (m_value_cache) {
+		m_value_cache->Erase(key);
+	}
+	if (m_filter && !m_filter->MayContain(bloom_hash(key))) {
+		return nullptr;
+	}
+
+	// a miss would still copy the search path while snapshots are open
+	if (!m_snapshots.empty() && !Find(m_root, key, nullptr)) {
+		return nullptr;
+	}
+
+	// the same search as Find, so it ends at the entry Query returns
+	NodePtr<T> node = GetWritableRoot();
+	while (true)
+	{
+		size_t i = 0;
+		while (i < node->m_entry_num && key > node->m_entry_key[i]) {
+			++i;
+		}
+		if (i < node->m_entry_num && node->m_entry_key[i] == key) {
+			idx = i;
+			return node;
+		}
+		if (node->m_leaf) {
+			return nullptr;
+		}
+		node = node->GetWritableChild(i);
+	}
+}
+
+template <typename T>
+void BTree<T>::RangeQuery(const T& lo, const T& hi, IVisitor& visitor)
+{
+	PLAYDB_TRACE_SPAN("range_query");
+	LatencyTimer timer(m_track_latency ? &m_stats.range_latency : nullptr);
+	if (!(hi < lo)) {
+		RangeQuery(m_root, lo, hi, visitor);
+	}
+}
+
+template <typename T>
+void BTree<T>::BeginBatch()
+{
+	m_batch = true;
+}
+
+template <typename T>
+void BTree<T>::CommitBatch()
+{
+	m_batch = false;
+	for (auto& node : m_dirty) {
+		if (node->m_dirty) {
+			StoreNode(*node);
+		}
+	}
+	m_dirty.clear();
+	EvictNodes();
+}
+
+template <typename T>
+void BTree<T>::Flush()
 {
+	if (m_batch) {
+		CommitBatch();
+		BeginBatch();
+	}
+	StoreFilter();
 	StoreHeader();
+	m_storage_mgr->Flush();
+}
+
+template <typename T>
+void BTree<T>::RangeQuery(const NodePtr<T>& node, const T& lo, const T& hi, IVisitor& visitor)
+{
+	visitor.VisitNode(*node);
 
-	BTreeNode<T> root(this, storage::NEW_PAGE, true);
-	m_root_id = WriteNode(root);
+	// child i holds keys between entry i - 1 and entry i, duplicates of lo
+	// may sit left of the first entry equal to it
+	size_t i = 0;
+	while (i < node->m_entry_num && lo > node->m_entry_key[i]) {
+		++i;
+	}
+	if (!node->m_leaf)
+	{
+		size_t last = i;
+		while (last < node->m_entry_num && !(node->m_entry_key[last] > hi)) {
+			++last;
+		}
+		if (last > i) {
+			PrefetchChildren(*node, i, last);
+		}
+	}
+	for ( ; i <= node->m_entry_num; ++i)
+	{
+		if (!node->m_leaf) {
+			RangeQuery(node->GetChild(i), lo, hi, visitor);
+		}
+		if (i == node->m_entry_num || node->m_entry_key[i] > hi) {
+			break;
+		}
+		m_stats.query_results++;
+		visitor.VisitData(Data<T>(
+			node->m_entry_id[i],
+			node->m_entry_key[i],
+			node->m_entry_data[i],
+			node->m_entry_len[i]));
+	}
 }
 
 template <typename T>
-BTree<T>::BTree(IStorageManager* storage_mgr)
-	: m_storage_mgr(storage_mgr)
-	, m_root_id(storage::NEW_PAGE)
-	, m_header_id(0)
-	, m_degree(0)
+void BTree<T>::PrefetchChildren(const BTreeNode<T>& node, size_t first, size_t last)
 {
-	LoadHeader();
+	m_prefetch_ids.clear();
+	for (size_t i = first; i <= last; ++i) {
+		if (!node.m_child_ptrs[i] && m_cache.find(node.m_children[i]) == m_cache.end()) {
+			m_prefetch_ids.push_back(node.m_children[i]);
+		}
+	}
+	if (!m_prefetch_ids.empty()) {
+		m_storage_mgr->Prefetch(m_prefetch_ids.data(), m_prefetch_ids.size());
+	}
 }
 
 template <typename T>
-BTree<T>::~BTree()
+size_t BTree<T>::Rank(const T& key)
 {
-	StoreHeader();
+	return CountLess(key, false);
 }
 
 template <typename T>
-void BTree<T>::InsertData(const T& key, size_t len, const byte* const data)
+bool BTree<T>::SelectByRank(size_t k, Data<T>& result)
 {
-	NodePtr<T> root = ReadNode(m_root_id);
-	if (root->m_entry_num < MaxKeys()) {
-		root->InsertEntryNonFull(len, data, key, storage::NEW_PAGE);
-		return;
+	CheckCounted();
+
+	NodePtr<T> node = m_root;
+	if (k >= node->GetCount()) {
+		return false;
 	}
 
-	auto new_root = std::make_shared<BTreeNode<T>>(this, storage::NEW_PAGE, false);
-	new_root->m_children[0] = m_root_id;
-	new_root->SplitChild(0, root);
-	int i = 0;
-	if (new_root->m_entry_key[i] < key) {
-		++i;
+	while (!node->m_leaf)
+	{
+		size_t i = 0;
+		for ( ; i < node->m_entry_num; ++i)
+		{
+			if (k < node->m_counts[i]) {
+				break;
+			}
+			k -= node->m_counts[i];
+			if (k == 0) {
+				result = Data<T>(
+					node->m_entry_id[i],
+					node->m_entry_key[i],
+					node->m_entry_data[i],
+					node->m_entry_len[i]);
+				result.holder = node;
+				return true;
+			}
+			--k;
+		}
+		node = node->GetChild(i);
 	}
-	auto child = ReadNode(new_root->m_children[i]);
-	child->InsertEntryNonFull(len, data, key, storage::NEW_PAGE);
-	WriteNode(*new_root);
 
-	m_root_id = new_root->m_id;
+	result = Data<T>(
+		node->m_entry_id[k],
+		node->m_entry_key[k],
+		node->m_entry_data[k],
+		node->m_entry_len[k]);
+	result.holder = node;
+	return true;
 }
 
 template <typename T>
-void BTree<T>::LayerTraverse(IVisitor& visitor)
+void BTree<T>::SelectByRank(size_t k, size_t n, IVisitor& visitor)
 {
-	std::queue<NodePtr<T>> st;
-	NodePtr<T> root = ReadNode(m_root_id);
-	st.push(root);
-	while (!st.empty())
+	CheckCounted();
+	SelectRange(m_root, k, n, visitor);
+}
+
+template <typename T>
+size_t BTree<T>::CountRange(const T& lo, const T& hi)
+{
+	if (hi < lo) {
+		return 0;
+	}
+	return CountLess(hi, true) - CountLess(lo, false);
+}
+
+template <typename T>
+size_t BTree<T>::GetDataCount()
+{
+	CheckCounted();
+	return m_root->GetCount();
+}
+
+template <typename T>
+size_t BTree<T>::CountLess(const T& key, bool inclusive)
+{
+	CheckCounted();
+
+	// sum the entries and subtrees left of the search path
+	size_t count = 0;
+	NodePtr<T> node = m_root;
+	while (true)
 	{
-		NodePtr<T> n = st.front(); st.pop();
-		visitor.VisitNode(*n);
-		for (size_t i = 0; i < n->m_entry_num; ++i) {
-			visitor.VisitData(Data<T>(
-					n->m_entry_id[i],
-					n->m_entry_key[i],
-					n->m_entry_data[i],
-					n->m_entry_len[i]));
+		size_t i = 0;
+		while (i < node->m_entry_num &&
+			(inclusive ? !(node->m_entry_key[i] > key) : key > node->m_entry_key[i])) {
+			count += node->m_leaf ? 1 : node->m_counts[i] + 1;
+			++i;
 		}
-		if (!n->m_leaf) {
-			for (size_t i = 0; i < n->m_entry_num + 1; ++i) {
-				NodePtr<T> child = ReadNode(n->m_children[i]);
-				st.push(child);
-			}
+		if (node->m_leaf) {
+			return count;
 		}
+		node = node->GetChild(i);
 	}
 }
 
 template <typename T>
-bool BTree<T>::Query(const T& key, Data<T>& result)
+void BTree<T>::SelectRange(const NodePtr<T>& node, size_t& k, size_t& n, IVisitor& visitor)
 {
-	NodePtr<T> node = ReadNode(m_root_id);
-	while (node)
+	visitor.VisitNode(*node);
+	for (size_t i = 0; i <= node->m_entry_num && n > 0; ++i)
 	{
-		size_t i = 0;
-		while (i < node->m_entry_num && key > node->m_entry_key[i]) {
-			++i;
+		// skip whole subtrees that end before rank k
+		if (!node->m_leaf)
+		{
+			if (k >= node->m_counts[i]) {
+				k -= node->m_counts[i];
+			} else {
+				SelectRange(node->GetChild(i), k, n, visitor);
+			}
+		}
+
+		if (i == node->m_entry_num || n == 0) {
+			break;
 		}
-		if (node->m_entry_key[i] == key) {
-			result = Data<T>(
+		if (k > 0) {
+			--k;
+		} else {
+			visitor.VisitData(Data<T>(
 				node->m_entry_id[i],
 				node->m_entry_key[i],
 				node->m_entry_data[i],
-				node->m_entry_len[i]);
-			return true;
-		}
-		if (node->m_leaf) {
-			return false;
+				node->m_entry_len[i]));
+			--n;
 		}
-		node = ReadNode(node->m_children[i]);
 	}
-	return false;
+}
+
+template <typename T>
+void BTree<T>::CheckCounted() const
+{
+	if (!m_counted) {
+		throw IllegalStateException("BTree: order statistics need a counted tree");
+	}
+}
+
+template <typename T>
+BTree<T>::Snapshot::~Snapshot()
+{
+	m_tree->ReleaseSnapshot(m_epoch);
+}
+
+template <typename T>
+bool BTree<T>::Snapshot::Query(const T& key, Data<T>& result)
+{
+	// the filter and the value cache follow the live tree
+	return m_tree->Find(m_tree->ReadNode(m_root_id), key, &result);
+}
+
+template <typename T>
+void BTree<T>::Snapshot::RangeQuery(const T& lo, const T& hi, IVisitor& visitor)
+{
+	if (!(hi < lo)) {
+		m_tree->RangeQuery(m_tree->ReadNode(m_root_id), lo, hi, visitor);
+	}
+}
+
+template <typename T>
+void BTree<T>::Snapshot::LayerTraverse(IVisitor& visitor)
+{
+	m_tree->LayerTraverse(m_tree->ReadNode(m_root_id), visitor);
 }
 
 template <typename T>
 id_type BTree<T>::WriteNode(BTreeNode<T>& node)
 {
-	byte* buf;
-	size_t len;
-	node.StoreToByteArray(&buf, len);
+	// new nodes still need their page id right away
+	if (m_batch && node.m_id >= 0)
+	{
+		if (!node.m_dirty) {
+			node.m_dirty = true;
+			m_dirty.push_back(node.shared_from_this());
+		}
+		return node.m_id;
+	}
+
+	StoreNode(node);
+	return node.m_id;
+}
+
+template <typename T>
+void BTree<T>::StoreNode(BTreeNode<T>& node)
+{
+	// serialize into the tree's scratch buffer, it only ever grows
+	size_t len = node.GetByteArraySize();
+	if (m_write_buf.size() < len) {
+		m_write_buf.resize(len);
+	}
+	byte* buf = m_write_buf.data();
+	{
+		PLAYDB_TRACE_TIME(serialize_ns);
+		len = node.StoreToBuffer(buf);
+	}
+	PLAYDB_TRACE_ADD(node_stores, 1);
+	PLAYDB_TRACE_ADD(bytes_copied, len);
 
 	id_type page;
 	if (node.m_id < 0) {
@@ -132,10 +967,9 @@ id_type BTree<T>::WriteNode(BTreeNode<T>& node)
 	}
 
 	try {
+		PLAYDB_TRACE_TIME(storage_ns);
 		m_storage_mgr->StoreByteArray(page, len, buf);
-		delete[] buf;
 	} catch (InvalidPageException& e) {
-		delete[] buf;
 		std::cerr << e.what() << std::endl;
 		throw IllegalStateException("WriteNode: failed with InvalidPageException");
 	}
@@ -143,80 +977,394 @@ id_type BTree<T>::WriteNode(BTreeNode<T>& node)
 	if (node.m_id < 0)
 	{
 		node.m_id = page;
+		node.m_epoch = m_epoch;
 		m_stats.nodes++;
 	}
+	node.m_dirty = false;
 
 	m_stats.writes++;
-
-	return page;
 }
 
 template <typename T>
 NodePtr<T> BTree<T>::ReadNode(id_type id)
 {
+	auto itr = m_cache.find(id);
+	if (itr != m_cache.end())
+	{
+		const NodePtr<T>& node = *itr->second;
+		node->m_referenced = true;
+		m_stats.hits++;
+		return node;
+	}
+	m_stats.misses++;
+
 	size_t len;
-	byte* buf;
+	byte* buf = nullptr;
+	const byte* borrowed = nullptr;
 
 	try {
-		m_storage_mgr->LoadByteArray(id, len, &buf);
+		PLAYDB_TRACE_TIME(storage_ns);
+		borrowed = m_storage_mgr->BorrowByteArray(id, len);
+		if (!borrowed) {
+			m_storage_mgr->LoadByteArray(id, len, &buf);
+		}
 	} catch (InvalidPageException& e) {
 		std::cerr << e.what() << std::endl;
 		throw playdb::IllegalStateException("ReadNode: failed with InvalidPageException");
 	}
 
 	auto node = std::make_shared<BTreeNode<T>>(this, id, true);
-	node->LoadFromByteArray(buf);
+	{
+		PLAYDB_TRACE_TIME(serialize_ns);
+		node->LoadFromByteArray(borrowed ? borrowed : buf);
+	}
+	PLAYDB_TRACE_ADD(node_loads, 1);
+	PLAYDB_TRACE_ADD(bytes_copied, len);
 
 	m_stats.reads++;
 
 	delete[] buf;
+
+	CacheNode(node);
+
 	return node;
 }
 
 template <typename T>
-void BTree<T>::DeleteNode(const BTreeNode<T>& node)
+void BTree<T>::DeleteNode(BTreeNode<T>& node)
 {
+	if (IsShared(node)) {
+		m_retired.push_back(std::make_pair(m_epoch, node.m_id));
+		return;
+	}
+
 	try {
-		m_storage_mgr->DeleteByteArray(node->m_id);
+		PLAYDB_TRACE_TIME(storage_ns);
+		m_storage_mgr->DeleteByteArray(node.m_id);
 	} catch (InvalidPageException& e) {
 		std::cerr << e.what() << std::endl;
 		throw IllegalStateException("DeleteNode: failed with InvalidPageException");
 	}
+	node.m_dirty = false;
+
+	auto itr = m_cache.find(node.m_id);
+	if (itr != m_cache.end()) {
+		EvictNode(itr->second);
+	}
 
 	m_stats.nodes--;
 }
 
 template <typename T>
-void BTree<T>::StoreHeader()
+bool BTree<T>::IsShared(const BTreeNode<T>& node) const
+{
+	return !m_snapshots.empty() && node.m_epoch <= *m_snapshots.rbegin();
+}
+
+template <typename T>
+NodePtr<T> BTree<T>::CopyNode(const BTreeNode<T>& node)
 {
-	size_t sz = 0;
-	sz += sizeof(id_type);		// m_root_id
-	sz += sizeof(size_t);		// m_degree
+	auto copy = std::make_shared<BTreeNode<T>>(this, storage::NEW_PAGE, node.m_leaf);
+	copy->m_entry_num = node.m_entry_num;
+	copy->m_byte_size = node.m_byte_size;
+	for (size_t i = 0; i < node.m_entry_num; ++i)
+	{
+		copy->m_entry_id[i]  = node.m_entry_id[i];
+		copy->m_entry_key[i] = node.m_entry_key[i];
+		copy->m_entry_len[i] = node.m_entry_len[i];
+		copy->m_entry_data[i] = nullptr;
+		if (node.m_entry_len[i] > 0) {
+			copy->m_entry_data[i] = new byte[node.m_entry_len[i]];
+			memcpy(copy->m_entry_data[i], node.m_entry_data[i], node.m_entry_len[i]);
+		}
+	}
+	for (size_t i = 0; i < node.m_entry_num + 1; ++i) {
+		copy->m_children[i] = node.m_children[i];
+		copy->m_counts[i] = node.m_counts[i];
+	}
 
-	byte* data = new byte[sz];
-	byte* ptr = data;
+	WriteNode(*copy);
+	CacheNode(copy);
+
+	// the original stays readable until the snapshots that see it are gone
+	m_retired.push_back(std::make_pair(m_epoch, node.m_id));
+
+	return copy;
+}
+
+template <typename T>
+NodePtr<T> BTree<T>::GetWritableRoot()
+{
+	if (IsShared(*m_root)) {
+		m_root = CopyNode(*m_root);
+		m_root_id = m_root->m_id;
+	}
+	return m_root;
+}
+
+template <typename T>
+void BTree<T>::ReleaseSnapshot(uint64_t epoch)
+{
+	m_snapshots.erase(m_snapshots.find(epoch));
+	ReclaimPages();
+}
+
+template <typename T>
+void BTree<T>::ReclaimPages()
+{
+	// a page retired in epoch e is only seen by snapshots taken before e
+	uint64_t oldest = m_snapshots.empty() ? m_epoch : *m_snapshots.begin();
+	auto itr = std::partition(m_retired.begin(), m_retired.end(),
+		[oldest](const std::pair<uint64_t, id_type>& p) { return p.first > oldest; });
+	if (itr == m_retired.end()) {
+		return;
+	}
+	for (auto p = itr; p != m_retired.end(); ++p)
+	{
+		m_storage_mgr->DeleteByteArray(p->second);
+		auto c = m_cache.find(p->second);
+		if (c != m_cache.end())
+		{
+			// retired in an open batch, the page must not be stored again
+			(*c->second)->m_dirty = false;
+			EvictNode(c->second);
+		}
+		m_stats.nodes--;
+	}
+	m_retired.erase(itr, m_retired.end());
+
+	m_dirty.erase(std::remove_if(m_dirty.begin(), m_dirty.end(),
+		[](const NodePtr<T>& node) { return !node->m_dirty; }), m_dirty.end());
+}
+
+template <typename T>
+void BTree<T>::CacheNode(const NodePtr<T>& node)
+{
+	assert(node->m_id >= 0 && m_cache.find(node->m_id) == m_cache.end());
+
+	node->m_referenced = true;
+	auto itr = m_resident.insert(m_clock_hand, node);
+	m_cache.insert(std::make_pair(node->m_id, itr));
+
+	EvictNodes();
+}
+
+template <typename T>
+void BTree<T>::EvictNodes()
+{
+	// clock sweep, nodes still held outside the cache are never dropped so
+	// there is at most one in-memory copy of every page
+	size_t capacity = m_cache_budget ? m_cache_budget->GetShare() : m_cache_capacity;
+	size_t budget = m_resident.size() * 2;
+	while (m_resident.size() > capacity && budget-- > 0)
+	{
+		if (m_clock_hand == m_resident.end()) {
+			m_clock_hand = m_resident.begin();
+		}
+
+		BTreeNode<T>& node = **m_clock_hand;
+		if (m_clock_hand->use_count() > 1 || node.m_referenced || node.m_dirty) {
+			node.m_referenced = false;
+			++m_clock_hand;
+		} else {
+			EvictNode(m_clock_hand);
+		}
+	}
+}
+
+template <typename T>
+void BTree<T>::EvictNode(typename std::list<NodePtr<T>>::iterator itr)
+{
+	BTreeNode<T>& node = **itr;
+
+	// swap the pointers back to page ids on both sides
+	if (node.m_parent) {
+		node.m_parent->UnswizzleChild(&node);
+	}
+	if (!node.m_leaf) {
+		for (size_t i = 0; i < node.m_entry_num + 1; ++i) {
+			if (node.m_child_ptrs[i]) {
+				node.m_child_ptrs[i]->m_parent = nullptr;
+				node.m_child_ptrs[i] = nullptr;
+			}
+		}
+	}
+
+	m_cache.erase(node.m_id);
+	if (m_clock_hand == itr) {
+		m_clock_hand = m_resident.erase(itr);
+	} else {
+		m_resident.erase(itr);
+	}
+}
+
+template <typename T>
+void BTree<T>::BuildFilter(size_t capacity, size_t bits_per_key)
+{
+	// hashes every key in the tree, deleted ones drop out on the way
+	std::vector<uint64_t> hashes;
+	std::queue<NodePtr<T>> st;
+	st.push(m_root);
+	while (!st.empty())
+	{
+		NodePtr<T> n = st.front(); st.pop();
+		for (size_t i = 0; i < n->m_entry_num; ++i) {
+			hashes.push_back(bloom_hash(n->m_entry_key[i]));
+		}
+		if (!n->m_leaf) {
+			for (size_t i = 0; i < n->m_entry_num + 1; ++i) {
+				st.push(n->GetChild(i));
+			}
+		}
+	}
+
+	// room to grow before the next rebuild
+	while (capacity < hashes.size() * 2) {
+		capacity *= 2;
+	}
+
+	m_filter.reset(new BloomFilter(capacity, bits_per_key));
+	for (auto h : hashes) {
+		m_filter->Add(h);
+	}
+	m_filter_dirty = true;
+}
+
+template <typename T>
+void BTree<T>::StoreFilter()
+{
+	if (!m_filter || !m_filter_dirty) {
+		return;
+	}
+
+	size_t len;
+	byte* data = nullptr;
+	m_filter->StoreToByteArray(&data, len);
+	try {
+		m_storage_mgr->StoreByteArray(m_filter_id, len, data);
+	} catch (...) {
+		delete[] data;
+		throw;
+	}
+	delete[] data;
+
+	m_filter_dirty = false;
+}
 
-	storage::pack(m_root_id, &ptr);
-	storage::pack(m_degree, &ptr);
+template <typename T>
+void BTree<T>::LoadFilter()
+{
+	if (m_filter_id < 0) {
+		return;
+	}
 
-	m_storage_mgr->StoreByteArray(m_header_id, sz, data);
+	size_t len;
+	byte* data = nullptr;
+	m_storage_mgr->LoadByteArray(m_filter_id, len, &data);
+
+	m_filter.reset(new BloomFilter());
+	m_filter->LoadFromByteArray(data);
 
 	delete[] data;
 }
 
+template <typename T>
+void BTree<T>::StoreHeader()
+{
+	byte data[HEADER_SIZE];
+	byte* ptr = data;
+
+	uint32_t magic = HEADER_MAGIC, version = HEADER_VERSION;
+	storage::pack(magic, &ptr);
+	storage::pack(version, &ptr);
+	storage::pack(static_cast<int64_t>(m_root_id), &ptr);
+	storage::pack(static_cast<uint64_t>(m_degree), &ptr);
+	storage::pack(static_cast<uint8_t>(m_counted), &ptr);
+	storage::pack(static_cast<int64_t>(m_filter_id), &ptr);
+	storage::pack(static_cast<uint64_t>(m_stats.nodes.Get()), &ptr);
+	storage::pack(static_cast<uint64_t>(m_stats.data.Get()), &ptr);
+	storage::pack(static_cast<uint64_t>(m_stats.tree_height.Get()), &ptr);
+	storage::pack(static_cast<uint8_t>(m_compact_pages), &ptr);
+	assert(static_cast<size_t>(ptr - data) == HEADER_SIZE);
+
+	m_storage_mgr->StoreByteArray(m_header_id, HEADER_SIZE, data);
+}
+
 template <typename T>
 void BTree<T>::LoadHeader()
 {
 	size_t len;
 	byte* data = 0;
 	m_storage_mgr->LoadByteArray(m_header_id, len, &data);
+	std::unique_ptr<byte[]> holder(data);
 
 	byte* ptr = data;
+	uint32_t magic = 0, version = 0;
+	if (len == HEADER_SIZE) {
+		storage::unpack(magic, &ptr);
+		storage::unpack(version, &ptr);
+	}
+	if (magic != HEADER_MAGIC) {
+		LoadLegacyHeader(data, len);
+		return;
+	}
+	if (version != HEADER_VERSION) {
+		throw IllegalStateException("BTree: Unknown header version.");
+	}
+
+	int64_t root_id, filter_id;
+	uint64_t degree, nodes, count, height;
+	uint8_t counted, compact_pages;
+	storage::unpack(root_id, &ptr);
+	storage::unpack(degree, &ptr);
+	storage::unpack(counted, &ptr);
+	storage::unpack(filter_id, &ptr);
+	storage::unpack(nodes, &ptr);
+	storage::unpack(count, &ptr);
+	storage::unpack(height, &ptr);
+	storage::unpack(compact_pages, &ptr);
+
+	if (root_id < 0 || root_id > std::numeric_limits<id_type>::max()
+	 || filter_id < storage::NEW_PAGE || filter_id > std::numeric_limits<id_type>::max()) {
+		throw IllegalStateException("BTree: Page id in the header out of range.");
+	}
+	m_root_id = static_cast<id_type>(root_id);
+	m_degree = static_cast<size_t>(degree);
+	m_counted = counted != 0;
+	m_filter_id = static_cast<id_type>(filter_id);
+	m_stats.nodes = static_cast<size_t>(nodes);
+	m_stats.data = static_cast<size_t>(count);
+	m_stats.tree_height = static_cast<size_t>(height);
+	m_compact_pages = compact_pages != 0;
+}
+
+template <typename T>
+void BTree<T>::LoadLegacyHeader(const byte* data, size_t len)
+{
+	byte* ptr = const_cast<byte*>(data);
 
 	storage::unpack(m_root_id, &ptr);
 	storage::unpack(m_degree, &ptr);
-
-	delete[] data;
+	// older headers end before the optional fields
+	if (static_cast<size_t>(ptr - data) < len) {
+		storage::unpack(m_counted, &ptr);
+	}
+	if (static_cast<size_t>(ptr - data) < len) {
+		storage::unpack(m_filter_id, &ptr);
+	}
+	if (static_cast<size_t>(ptr - data) < len)
+	{
+		size_t nodes, count, height;
+		storage::unpack(nodes, &ptr);
+		storage::unpack(count, &ptr);
+		storage::unpack(height, &ptr);
+		m_stats.nodes = nodes;
+		m_stats.data = count;
+		m_stats.tree_height = height;
+	}
+	if (static_cast<size_t>(ptr - data) < len) {
+		storage::unpack(m_compact_pages, &ptr);
+	}
 }
 
 }
@@ -2,10 +2,12 @@
 #define _PLAYDB_BTREE_BTREE_NODE_H_
 
 #include "playdb/typedef.h"
+#include "playdb.h"
 //#include "playdb/btree/BTree.h"
 
 #include <stack>
 #include <memory>
+#include <type_traits>
 
 namespace playdb
 {
@@ -27,6 +29,7 @@ class BTreeNode : public INode, public std::enable_shared_from_this<BTreeNode<T>
 public:
 	BTreeNode();
 	BTreeNode(BTree<T>* tree, id_type id, bool leaf);
+	~BTreeNode();
 	BTreeNode(const BTreeNode&) = delete;
 	BTreeNode& operator = (const BTreeNode&) = delete;
 
@@ -37,6 +40,10 @@ public:
 	virtual void LoadFromByteArray(const byte* data) override;
 	virtual void StoreToByteArray(byte** data, size_t& len) const override;
 
+	// writes into a caller-owned buffer of GetByteArraySize() bytes,
+	// returns the bytes used, fewer in the compact format
+	size_t StoreToBuffer(byte* data) const;
+
 	//
 	// INode interface
 	//
@@ -45,18 +52,57 @@ public:
 	virtual size_t GetChildrenCount() const override { return m_entry_num; }
 
 	void InsertEntryNonFull(size_t data_len, const byte* const data, const T& key, id_type id);
-	void DeleteEntry(size_t index);
+	bool DeleteEntry(const T& key);
+
+	// entries in the subtree, from the child counts of a counted tree
+	size_t GetCount() const;
 
 private:
-	void SplitChild(size_t idx, NodePtr<T>& node);
+	// right_heavy leaves node ~90% full instead of half, for appends
+	void SplitChild(size_t idx, NodePtr<T>& node, bool right_heavy = false);
+
+	// moves the smallest or largest entry of the subtree into dst's slot
+	void TakeEntry(bool max, BTreeNode<T>& dst, size_t dst_idx);
+
+	// tops child i up to the min degree before a delete descends into it,
+	// i is moved to the left neighbour when the two get merged
+	NodePtr<T> PrepareChild(size_t& i);
+	void RotateLeft(size_t sep, BTreeNode<T>& left, BTreeNode<T>& right);
+	void RotateRight(size_t sep, BTreeNode<T>& left, BTreeNode<T>& right);
+	void Merge(size_t sep, BTreeNode<T>& left, BTreeNode<T>& right);
+
+	// child id, count and resident pointer travel together
+	void MoveChild(size_t dst_idx, BTreeNode<T>& src, size_t src_idx);
+
+	// child i, through the swizzled pointer when it is resident
+	NodePtr<T> GetChild(size_t i);
+	// child i about to be changed, copied first if a snapshot sees it
+	NodePtr<T> GetWritableChild(size_t i);
+	void SwizzleChild(size_t i, BTreeNode<T>* child);
+	void UnswizzleChild(const BTreeNode<T>* child);
 
 	void CopyKey(size_t dst_idx, size_t src_idx, const BTreeNode<T>& src);
 
+	// replaces the value of entry idx, data may point into the old one
+	void SetEntryData(size_t idx, size_t len, const byte* data);
+
+	size_t GetEntryByteArraySize(size_t idx) const;
+	size_t GetChildByteArraySize() const;
+
 	// serialize key
 	size_t GetKeyByteArraySize(const T& key) const;
 	void LoadKeyFromByteArray(T& key, byte** ptr) const;
 	void StoreKeyToByteArray(const T& key, byte** ptr) const;
 
+	// compact format, ids and integer keys frame of reference packed,
+	// lengths and counts as varints
+	void StoreCompact(byte** ptr) const;
+	void LoadCompact(byte** ptr);
+	void StoreKeys(byte** ptr, std::true_type) const;
+	void StoreKeys(byte** ptr, std::false_type) const;
+	void LoadKeys(byte** ptr, std::true_type);
+	void LoadKeys(byte** ptr, std::false_type);
+
 private:
 	BTree<T>* m_tree;
 
@@ -66,6 +112,21 @@ private:
 
 	size_t m_entry_num;
 
+	// serialized size in the plain format, kept up to date by every change
+	// to the entries, compact pages are never larger than it plus
+	// COMPACT_SLACK
+	size_t m_byte_size;
+
+	static const size_t COMPACT_SLACK = 64;
+
+	// plain pages hold fixed width fields: flags, then the entry count,
+	// entry lengths and counts as uint64, ids at the id width of the index
+	static const size_t PLAIN_HEADER_SIZE = sizeof(uint8_t) + sizeof(uint64_t);
+
+	// first byte of a page, older pages hold only the leaf bool
+	static const uint8_t FLAG_LEAF = 0x1;
+	static const uint8_t FLAG_COMPACT = 0x2;
+
 	// n - 1 entry, keys
 	id_type* m_entry_id;
 	T*       m_entry_key;
@@ -74,9 +135,21 @@ private:
 
 	// n child
 	id_type* m_children;
+	// entries under each child, only kept by counted trees
+	size_t*  m_counts;
+
+	// resident children, null when only the page id is known
+	BTreeNode<T>** m_child_ptrs;
+	BTreeNode<T>*  m_parent;
+
+	// clock bit for the node cache
+	bool m_referenced;
+	// changed in a write batch and not stored yet
+	bool m_dirty;
+	// tree epoch the page was written first in, 0 once reloaded
+	uint64_t m_epoch;
 
-	template <typename T>
-	friend class BTree;
+	friend class BTree<T>;
 
 }; // BTreeNode
 
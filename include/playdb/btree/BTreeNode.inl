@@ -3,8 +3,15 @@
 
 #include "playdb.h"
 #include "playdb/storage/tools.h"
+#include "playdb/btree/KeySerializer.h"
+#include "playdb/btree/IntPacking.h"
+#include "playdb/Exception.h"
+#include "playdb/Trace.h"
+
+#include <algorithm>
 
 #include <assert.h>
+#include <string.h>
 
 namespace playdb
 {
@@ -14,14 +21,21 @@ namespace btree
 template <typename T>
 BTreeNode<T>::BTreeNode()
 	: m_tree(nullptr)
-	, m_id(storagemanager::NULL_PAGE)
+	, m_id(storage::NEW_PAGE)
 	, m_leaf(true)
 	, m_entry_num(0)
+	, m_byte_size(0)
 	, m_entry_id(nullptr)
 	, m_entry_key(nullptr)
 	, m_entry_data(nullptr)
 	, m_entry_len(nullptr)
 	, m_children(nullptr)
+	, m_counts(nullptr)
+	, m_child_ptrs(nullptr)
+	, m_parent(nullptr)
+	, m_referenced(false)
+	, m_dirty(false)
+	, m_epoch(0)
 {
 }
 
@@ -31,11 +45,18 @@ BTreeNode<T>::BTreeNode(BTree<T>* tree, id_type id, bool leaf)
 	, m_id(id)
 	, m_leaf(leaf)
 	, m_entry_num(0)
+	, m_byte_size(0)
 	, m_entry_id(nullptr)
 	, m_entry_key(nullptr)
 	, m_entry_data(nullptr)
 	, m_entry_len(nullptr)
 	, m_children(nullptr)
+	, m_counts(nullptr)
+	, m_child_ptrs(nullptr)
+	, m_parent(nullptr)
+	, m_referenced(false)
+	, m_dirty(false)
+	, m_epoch(0)
 {
 	try {
 		size_t cap = tree->MaxKeys();
@@ -44,29 +65,49 @@ BTreeNode<T>::BTreeNode(BTree<T>* tree, id_type id, bool leaf)
 		m_entry_data = new byte*[cap];
 		m_entry_len  = new size_t[cap];
 		m_children   = new id_type[cap + 1];
+		m_counts     = new size_t[cap + 1]();
+		m_child_ptrs = new BTreeNode<T>*[cap + 1]();
 	} catch (...) {
 		delete[] m_entry_id;
 		delete[] m_entry_key;
 		delete[] m_entry_data;
 		delete[] m_entry_len;
 		delete[] m_children;
+		delete[] m_counts;
+		delete[] m_child_ptrs;
+		throw;
 	}
+
+	m_byte_size = PLAIN_HEADER_SIZE + GetChildByteArraySize();
+}
+
+template <typename T>
+BTreeNode<T>::~BTreeNode()
+{
+	// entries past m_entry_num were handed over to other nodes by SplitChild
+	// or Merge
+	if (m_entry_data) {
+		for (size_t i = 0; i < m_entry_num; ++i) {
+			delete[] m_entry_data[i];
+		}
+	}
+
+	delete[] m_entry_id;
+	delete[] m_entry_key;
+	delete[] m_entry_data;
+	delete[] m_entry_len;
+	delete[] m_children;
+	delete[] m_counts;
+	delete[] m_child_ptrs;
 }
 
 template <typename T>
 size_t BTreeNode<T>::GetByteArraySize() const
 {
-	size_t sz = 0;
-	sz += sizeof(m_leaf); // m_leaf
-	sz += sizeof(size_t); // m_entry_num
-	// entries
-	sz += (sizeof(id_type) + sizeof(size_t)) * m_entry_num;
-	for (size_t i = 0; i < m_entry_num; ++i) {
-		sz += GetKeyByteArraySize(m_entry_key[i]);
-		sz += m_entry_len[i];
+	if (m_tree->m_compact_pages) {
+		return m_byte_size + COMPACT_SLACK;
 	}
-	sz += sizeof(id_type) * (m_entry_num + 1); // children
-	return sz;
+	return m_byte_size;
 }
 
 template <typename T>
@@ -74,15 +115,28 @@ void BTreeNode<T>::LoadFromByteArray(const byte* data)
 {
 	byte* ptr = const_cast<byte*>(data);
 
-	storage::unpack(m_leaf, &ptr);     // m_leaf
+	uint8_t flags;
+	storage::unpack(flags, &ptr);
+	m_leaf = (flags & FLAG_LEAF) != 0;
+	if (flags & FLAG_COMPACT) {
+		LoadCompact(&ptr);
+		return;
+	}
 
-	storage::unpack(m_entry_num, &ptr); // m_entry_num
+	uint64_t num;
+	storage::unpack(num, &ptr);
+	if (num > m_tree->MaxKeys()) {
+		throw IllegalStateException("BTreeNode: Corrupted page.");
+	}
+	m_entry_num = static_cast<size_t>(num);
 	// entries
 	for (size_t i = 0; i < m_entry_num; ++i)
 	{
 		storage::unpack(m_entry_id[i], &ptr);
 		LoadKeyFromByteArray(m_entry_key[i], &ptr);
-		storage::unpack(m_entry_len[i], &ptr);
+		uint64_t entry_len;
+		storage::unpack(entry_len, &ptr);
+		m_entry_len[i] = static_cast<size_t>(entry_len);
 
 		size_t len = m_entry_len[i];
 		if (len > 0)
@@ -101,19 +155,41 @@ void BTreeNode<T>::LoadFromByteArray(const byte* data)
 	for (size_t i = 0, n = m_entry_num + 1; i < n; ++i) {
 		storage::unpack(m_children[i], &ptr);
 	}
+	if (m_tree->m_counted) {
+		for (size_t i = 0, n = m_entry_num + 1; i < n; ++i)
+		{
+			uint64_t count;
+			storage::unpack(count, &ptr);
+			m_counts[i] = static_cast<size_t>(count);
+		}
+	}
+
+	m_byte_size = ptr - data;
 }
 
 template <typename T>
 void BTreeNode<T>::StoreToByteArray(byte** data, size_t& len) const
 {
-	len = GetByteArraySize();
+	*data = new byte[GetByteArraySize()];
+	len = StoreToBuffer(*data);
+}
+
+template <typename T>
+size_t BTreeNode<T>::StoreToBuffer(byte* data) const
+{
+	byte* ptr = data;
 
-	*data = new byte[len];
-	byte* ptr = *data;
+	if (m_tree->m_compact_pages)
+	{
+		StoreCompact(&ptr);
+		assert(static_cast<size_t>(ptr - data) <= GetByteArraySize());
+		return ptr - data;
+	}
 
-	storage::pack(m_leaf, &ptr); // m_leaf
+	uint8_t flags = m_leaf ? FLAG_LEAF : 0;
+	storage::pack(flags, &ptr);
 
-	storage::pack(m_entry_num, &ptr); // m_entry_num
+	storage::pack(static_cast<uint64_t>(m_entry_num), &ptr);
 	// entries
 	for (size_t i = 0; i < m_entry_num; ++i)
 	{
@@ -121,7 +197,7 @@ void BTreeNode<T>::StoreToByteArray(byte** data, size_t& len) const
 		StoreKeyToByteArray(m_entry_key[i], &ptr);
 
 		size_t len = m_entry_len[i];
-		storage::pack(len, &ptr);
+		storage::pack(static_cast<uint64_t>(len), &ptr);
 		if (len > 0) {
 			memcpy(ptr, m_entry_data[i], len);
 			ptr += len;
@@ -132,6 +208,14 @@ void BTreeNode<T>::StoreToByteArray(byte** data, size_t& len) const
 	for (size_t i = 0, n = m_entry_num + 1; i < n; ++i) {
 		storage::pack(m_children[i], &ptr);
 	}
+	if (m_tree->m_counted) {
+		for (size_t i = 0, n = m_entry_num + 1; i < n; ++i) {
+			storage::pack(static_cast<uint64_t>(m_counts[i]), &ptr);
+		}
+	}
+
+	assert(static_cast<size_t>(ptr - data) == m_byte_size);
+	return m_byte_size;
 }
 
 template <typename T>
@@ -156,6 +240,7 @@ void BTreeNode<T>::InsertEntryNonFull(size_t data_len, const byte* const data, c
 		m_entry_len[i + 1] = data_len;
 
 		++m_entry_num;
+		m_byte_size += GetEntryByteArraySize(i + 1);
 
 		m_tree->WriteNode(*this);
 	}
@@ -167,74 +252,431 @@ void BTreeNode<T>::InsertEntryNonFull(size_t data_len, const byte* const data, c
 			--i;
 		}
 
-		NodePtr<T> child = m_tree->ReadNode(m_children[i + 1]);
+		size_t c = i + 1;
+		NodePtr<T> child = GetWritableChild(c);
 		if (child->m_entry_num == capacity)
 		{
-			SplitChild(i + 1, child);
-			if (m_entry_key[i + 1] < key) {
-				child = m_tree->ReadNode(m_children[i + 2]);
+			SplitChild(c, child, m_tree->SplitRightHeavy(*this, c, *child, key));
+			if (m_entry_key[c] < key) {
+				child = GetWritableChild(++c);
 			}
 		}
+
+		// every node on the path gains one entry below it
+		if (m_tree->m_counted) {
+			m_counts[c]++;
+			m_tree->WriteNode(*this);
+		}
+
 		child->InsertEntryNonFull(data_len, data, key, id);
 	}
 }
 
 template <typename T>
-void BTreeNode<T>::DeleteEntry(size_t index)
+bool BTreeNode<T>::DeleteEntry(const T& key)
 {
-	//assert(index >= 0 && index < m_entry_num);
+	size_t i = 0;
+	while (i < m_entry_num && key > m_entry_key[i]) {
+		++i;
+	}
+	bool found = i < m_entry_num && m_entry_key[i] == key;
 
-	//m_tot_data_len -= m_entry_data[index];
-	//if (m_entry_data[index]) {
-	//	delete[] m_entry_data[index];
-	//}
+	if (m_leaf)
+	{
+		if (!found) {
+			return false;
+		}
+
+		m_byte_size -= GetEntryByteArraySize(i);
+		delete[] m_entry_data[i];
+		for (size_t j = i; j + 1 < m_entry_num; ++j) {
+			CopyKey(j, j + 1, *this);
+		}
+		--m_entry_num;
+
+		m_tree->WriteNode(*this);
+		return true;
+	}
+
+	size_t t = m_tree->m_degree;
+	if (found)
+	{
+		// replace with the predecessor or successor when a neighbouring
+		// child can spare an entry, else pull the key down into a merge
+		NodePtr<T> left = GetChild(i);
+		NodePtr<T> right;
+		size_t c = i;
+		if (left->m_entry_num >= t) {
+			left = GetWritableChild(i);
+		} else {
+			right = GetWritableChild(i + 1);
+			c = i + 1;
+			if (right->m_entry_num < t) {
+				left = GetWritableChild(i);
+			}
+		}
+		if (left->m_entry_num >= t || right->m_entry_num >= t)
+		{
+			m_byte_size -= GetEntryByteArraySize(i);
+			delete[] m_entry_data[i];
+			if (c == i) {
+				left->TakeEntry(true, *this, i);
+			} else {
+				right->TakeEntry(false, *this, i);
+			}
+			m_byte_size += GetEntryByteArraySize(i);
 
-	//if (m_entry_num > 1 && index != m_entry_num - 1)
-	//{
-	//	m_entry_id[index] =
-	//}
+			if (m_tree->m_counted) {
+				m_counts[c]--;
+			}
+			m_tree->WriteNode(*this);
+			return true;
+		}
+
+		Merge(i, *left, *right);
+		left->DeleteEntry(key);
+		if (m_tree->m_counted) {
+			m_counts[i]--;
+			m_tree->WriteNode(*this);
+		}
+		return true;
+	}
+
+	NodePtr<T> child = PrepareChild(i);
+	if (!child->DeleteEntry(key)) {
+		return false;
+	}
+	if (m_tree->m_counted) {
+		m_counts[i]--;
+		m_tree->WriteNode(*this);
+	}
+	return true;
+}
+
+template <typename T>
+size_t BTreeNode<T>::GetCount() const
+{
+	size_t count = m_entry_num;
+	if (!m_leaf) {
+		for (size_t i = 0; i <= m_entry_num; ++i) {
+			count += m_counts[i];
+		}
+	}
+	return count;
 }
 
 template <typename T>
-void BTreeNode<T>::SplitChild(size_t idx, NodePtr<T>& node)
+void BTreeNode<T>::SplitChild(size_t idx, NodePtr<T>& node, bool right_heavy)
 {
 	auto other = std::make_shared<BTreeNode<T>>(m_tree, storage::NEW_PAGE, node->m_leaf);
 
+	// entry mid moves up, node keeps the ones before it. The small side of
+	// a right-heavy split is below the min keys, deletes top such nodes up
+	// like any other.
+	size_t full = node->m_entry_num;
+	size_t mid = m_tree->m_degree - 1;
+	m_tree->m_stats.splits++;
+	PLAYDB_TRACE_ADD(splits, 1);
+	if (right_heavy && full - 1 - std::max<size_t>(1, (full - 1) / 10) > mid) {
+		mid = full - 1 - std::max<size_t>(1, (full - 1) / 10);
+		m_tree->m_stats.append_splits++;
+	}
+
 	// copy entries
-	size_t t = m_tree->m_degree;
-	other->m_entry_num = t - 1; // min keys
-	for (size_t i = 0; i < t - 1; ++i) {
-		other->CopyKey(i, t + i, *node);
+	other->m_entry_num = full - 1 - mid;
+	for (size_t i = 0; i < other->m_entry_num; ++i) {
+		other->CopyKey(i, mid + 1 + i, *node);
+		size_t sz = other->GetEntryByteArraySize(i);
+		other->m_byte_size += sz;
+		node->m_byte_size -= sz;
 	}
 
 	// copy children
 	if (!node->m_leaf) {
-		for (size_t i = 0; i < t; ++i) {
-			other->m_children[i] = node->m_children[t + i];
+		for (size_t i = 0; i <= other->m_entry_num; ++i) {
+			other->MoveChild(i, *node, mid + 1 + i);
 		}
 	}
 
 	// store other
 	m_tree->WriteNode(*other);
+	m_tree->CacheNode(other);
 
-	node->m_entry_num = t - 1;
+	node->m_byte_size -= node->GetEntryByteArraySize(mid); // median
+	node->m_entry_num = mid;
 	m_tree->WriteNode(*node);
 
 	// insert other
 	for (int i = static_cast<int>(m_entry_num), n = static_cast<int>(idx + 1); i >= n; --i) {
-		m_children[i + 1] = m_children[i];
+		MoveChild(i + 1, *this, i);
 	}
 	m_children[idx + 1] = other->m_id;
+	SwizzleChild(idx + 1, other.get());
+	if (m_tree->m_counted) {
+		m_counts[idx] = node->GetCount();
+		m_counts[idx + 1] = other->GetCount();
+	}
 
 	// add key
 	for (int i = static_cast<int>(m_entry_num - 1), n = static_cast<int>(idx); i >= n; --i) {
 		CopyKey(i + 1, i, *this);
 	}
-	CopyKey(idx, t - 1, *node);
+	CopyKey(idx, mid, *node);
 
 	m_entry_num++;
+	m_byte_size += GetEntryByteArraySize(idx);
+
+	m_tree->WriteNode(*this);
+}
+
+template <typename T>
+void BTreeNode<T>::TakeEntry(bool max, BTreeNode<T>& dst, size_t dst_idx)
+{
+	if (m_leaf)
+	{
+		size_t idx = max ? m_entry_num - 1 : 0;
+		m_byte_size -= GetEntryByteArraySize(idx);
+		dst.CopyKey(dst_idx, idx, *this);
+		for (size_t j = idx; j + 1 < m_entry_num; ++j) {
+			CopyKey(j, j + 1, *this);
+		}
+		--m_entry_num;
+
+		m_tree->WriteNode(*this);
+		return;
+	}
+
+	size_t i = max ? m_entry_num : 0;
+	NodePtr<T> child = PrepareChild(i);
+	child->TakeEntry(max, dst, dst_idx);
+	if (m_tree->m_counted) {
+		m_counts[i]--;
+		m_tree->WriteNode(*this);
+	}
+}
+
+template <typename T>
+NodePtr<T> BTreeNode<T>::PrepareChild(size_t& i)
+{
+	size_t t = m_tree->m_degree;
+	NodePtr<T> child = GetWritableChild(i);
+	if (child->m_entry_num >= t) {
+		return child;
+	}
+
+	NodePtr<T> left, right;
+	if (i > 0) {
+		left = GetChild(i - 1);
+		if (left->m_entry_num >= t) {
+			RotateRight(i - 1, *GetWritableChild(i - 1), *child);
+			return child;
+		}
+	}
+	if (i < m_entry_num) {
+		right = GetChild(i + 1);
+		if (right->m_entry_num >= t) {
+			RotateLeft(i, *child, *GetWritableChild(i + 1));
+			return child;
+		}
+	}
+
+	if (right) {
+		Merge(i, *child, *GetWritableChild(i + 1));
+		return child;
+	} else {
+		left = GetWritableChild(i - 1);
+		Merge(--i, *left, *child);
+		return left;
+	}
+}
+
+template <typename T>
+void BTreeNode<T>::RotateLeft(size_t sep, BTreeNode<T>& left, BTreeNode<T>& right)
+{
+	m_tree->m_stats.adjustments++;
+
+	// separator down to the end of left, first of right up
+	size_t n = left.m_entry_num;
+	left.CopyKey(n, sep, *this);
+	left.m_byte_size += left.GetEntryByteArraySize(n);
+	if (!left.m_leaf) {
+		left.MoveChild(n + 1, right, 0);
+	}
+	++left.m_entry_num;
+
+	m_byte_size -= GetEntryByteArraySize(sep);
+	CopyKey(sep, 0, right);
+	m_byte_size += GetEntryByteArraySize(sep);
+
+	right.m_byte_size -= right.GetEntryByteArraySize(0);
+	for (size_t i = 0; i + 1 < right.m_entry_num; ++i) {
+		right.CopyKey(i, i + 1, right);
+	}
+	if (!right.m_leaf) {
+		for (size_t i = 0; i < right.m_entry_num; ++i) {
+			right.MoveChild(i, right, i + 1);
+		}
+		right.m_child_ptrs[right.m_entry_num] = nullptr;
+	}
+	--right.m_entry_num;
+
+	if (m_tree->m_counted) {
+		m_counts[sep] = left.GetCount();
+		m_counts[sep + 1] = right.GetCount();
+	}
+
+	m_tree->WriteNode(left);
+	m_tree->WriteNode(right);
+	m_tree->WriteNode(*this);
+}
+
+template <typename T>
+void BTreeNode<T>::RotateRight(size_t sep, BTreeNode<T>& left, BTreeNode<T>& right)
+{
+	m_tree->m_stats.adjustments++;
+
+	// separator down to the front of right, last of left up
+	for (size_t i = right.m_entry_num; i > 0; --i) {
+		right.CopyKey(i, i - 1, right);
+	}
+	if (!right.m_leaf) {
+		for (size_t i = right.m_entry_num + 1; i > 0; --i) {
+			right.MoveChild(i, right, i - 1);
+		}
+	}
+	right.CopyKey(0, sep, *this);
+	right.m_byte_size += right.GetEntryByteArraySize(0);
+	++right.m_entry_num;
+
+	size_t n = left.m_entry_num - 1;
+	m_byte_size -= GetEntryByteArraySize(sep);
+	CopyKey(sep, n, left);
+	m_byte_size += GetEntryByteArraySize(sep);
+
+	left.m_byte_size -= left.GetEntryByteArraySize(n);
+	if (!left.m_leaf) {
+		right.MoveChild(0, left, n + 1);
+	}
+	--left.m_entry_num;
+
+	if (m_tree->m_counted) {
+		m_counts[sep] = left.GetCount();
+		m_counts[sep + 1] = right.GetCount();
+	}
+
+	m_tree->WriteNode(left);
+	m_tree->WriteNode(right);
+	m_tree->WriteNode(*this);
+}
+
+template <typename T>
+void BTreeNode<T>::Merge(size_t sep, BTreeNode<T>& left, BTreeNode<T>& right)
+{
+	m_tree->m_stats.adjustments++;
+
+	// left + separator + right into left, right's page is dropped
+	size_t n = left.m_entry_num;
+	left.CopyKey(n, sep, *this);
+	left.m_byte_size += left.GetEntryByteArraySize(n);
+	for (size_t i = 0; i < right.m_entry_num; ++i) {
+		left.CopyKey(n + 1 + i, i, right);
+		left.m_byte_size += left.GetEntryByteArraySize(n + 1 + i);
+	}
+	if (!left.m_leaf) {
+		for (size_t i = 0; i <= right.m_entry_num; ++i) {
+			left.MoveChild(n + 1 + i, right, i);
+		}
+	}
+	left.m_entry_num = n + 1 + right.m_entry_num;
+	right.m_entry_num = 0;
+
+	m_byte_size -= GetEntryByteArraySize(sep);
+	for (size_t i = sep; i + 1 < m_entry_num; ++i) {
+		CopyKey(i, i + 1, *this);
+	}
+	for (size_t i = sep + 1; i < m_entry_num; ++i) {
+		MoveChild(i, *this, i + 1);
+	}
+	m_child_ptrs[m_entry_num] = nullptr;
+	--m_entry_num;
+
+	if (m_tree->m_counted) {
+		m_counts[sep] = left.GetCount();
+	}
+
+	m_tree->WriteNode(left);
+	m_tree->WriteNode(*this);
+	m_tree->DeleteNode(right);
+}
+
+template <typename T>
+void BTreeNode<T>::MoveChild(size_t dst_idx, BTreeNode<T>& src, size_t src_idx)
+{
+	m_children[dst_idx] = src.m_children[src_idx];
+	m_counts[dst_idx] = src.m_counts[src_idx];
+	m_child_ptrs[dst_idx] = src.m_child_ptrs[src_idx];
+	if (&src != this)
+	{
+		src.m_child_ptrs[src_idx] = nullptr;
+		if (BTreeNode<T>* c = m_child_ptrs[dst_idx]) {
+			c->m_parent = this;
+		}
+	}
+}
 
+template <typename T>
+NodePtr<T> BTreeNode<T>::GetWritableChild(size_t i)
+{
+	NodePtr<T> child = GetChild(i);
+	if (!m_tree->IsShared(*child)) {
+		return child;
+	}
+
+	// a snapshot still sees the child, point this node at a fresh copy
+	NodePtr<T> copy = m_tree->CopyNode(*child);
+	m_child_ptrs[i] = nullptr;
+	child->m_parent = nullptr;
+	m_children[i] = copy->m_id;
+	SwizzleChild(i, copy.get());
 	m_tree->WriteNode(*this);
+	return copy;
+}
+
+template <typename T>
+NodePtr<T> BTreeNode<T>::GetChild(size_t i)
+{
+	PLAYDB_TRACE_ADD(nodes, 1);
+
+	if (BTreeNode<T>* c = m_child_ptrs[i]) {
+		c->m_referenced = true;
+		return c->shared_from_this();
+	}
+
+	NodePtr<T> c = m_tree->ReadNode(m_children[i]);
+	SwizzleChild(i, c.get());
+	return c;
+}
+
+template <typename T>
+void BTreeNode<T>::SwizzleChild(size_t i, BTreeNode<T>* child)
+{
+	// a page has one parent, drop a stale link left by a split
+	if (child->m_parent && child->m_parent != this) {
+		child->m_parent->UnswizzleChild(child);
+	}
+	m_child_ptrs[i] = child;
+	child->m_parent = this;
+}
+
+template <typename T>
+void BTreeNode<T>::UnswizzleChild(const BTreeNode<T>* child)
+{
+	for (size_t i = 0; i < m_entry_num + 1; ++i) {
+		if (m_child_ptrs[i] == child) {
+			m_child_ptrs[i] = nullptr;
+			break;
+		}
+	}
 }
 
 template <typename T>
@@ -246,40 +688,188 @@ void BTreeNode<T>::CopyKey(size_t dst_idx, size_t src_idx, const BTreeNode<T>& s
 	m_entry_len[dst_idx]  = src.m_entry_len[src_idx];
 }
 
+template <typename T>
+void BTreeNode<T>::SetEntryData(size_t idx, size_t len, const byte* data)
+{
+	if (len == m_entry_len[idx])
+	{
+		if (len > 0) {
+			memmove(m_entry_data[idx], data, len);
+		}
+		return;
+	}
+
+	byte* buf = nullptr;
+	if (len > 0) {
+		buf = new byte[len];
+		memcpy(buf, data, len);
+	}
+	delete[] m_entry_data[idx];
+	m_entry_data[idx] = buf;
+
+	m_byte_size -= m_entry_len[idx];
+	m_byte_size += len;
+	m_entry_len[idx] = len;
+}
+
+template <typename T>
+size_t BTreeNode<T>::GetEntryByteArraySize(size_t idx) const
+{
+	// id, key, len, data and the child pointer that comes with the entry
+	return sizeof(id_type) + GetKeyByteArraySize(m_entry_key[idx])
+		+ sizeof(uint64_t) + m_entry_len[idx] + GetChildByteArraySize();
+}
+
+template <typename T>
+size_t BTreeNode<T>::GetChildByteArraySize() const
+{
+	return m_tree->m_counted ? sizeof(id_type) + sizeof(uint64_t) : sizeof(id_type);
+}
+
 template <typename T>
 size_t BTreeNode<T>::GetKeyByteArraySize(const T& key) const
 {
-	return sizeof(T);
+	return KeySerializer<T>::Size(key);
 }
 
 template <typename T>
 void BTreeNode<T>::LoadKeyFromByteArray(T& key, byte** ptr) const
 {
-	storage::pack(key, ptr);
+	KeySerializer<T>::Load(key, ptr);
 }
 
 template <typename T>
 void BTreeNode<T>::StoreKeyToByteArray(const T& key, byte** ptr) const
 {
-	storage::unpack(key, ptr);
+	KeySerializer<T>::Store(key, ptr);
 }
 
-template <>
-inline size_t BTreeNode<std::string>::GetKeyByteArraySize(const std::string& key) const
+template <typename T>
+void BTreeNode<T>::StoreCompact(byte** ptr) const
 {
-	return storage::sizeof_pack_str(key);
+	uint8_t flags = FLAG_COMPACT;
+	if (m_leaf) {
+		flags |= FLAG_LEAF;
+	}
+	storage::pack(flags, ptr);
+	pack_varint(m_entry_num, ptr);
+
+	if (m_entry_num > 0)
+	{
+		StoreKeys(ptr, std::is_integral<T>());
+		pack_frame(m_entry_id, m_entry_num, ptr);
+		for (size_t i = 0; i < m_entry_num; ++i) {
+			pack_varint(m_entry_len[i], ptr);
+		}
+		for (size_t i = 0; i < m_entry_num; ++i) {
+			if (m_entry_len[i] > 0) {
+				memcpy(*ptr, m_entry_data[i], m_entry_len[i]);
+				*ptr += m_entry_len[i];
+			}
+		}
+	}
+
+	// leaves have no children to store
+	if (m_leaf) {
+		return;
+	}
+	pack_frame(m_children, m_entry_num + 1, ptr);
+	if (m_tree->m_counted) {
+		for (size_t i = 0, n = m_entry_num + 1; i < n; ++i) {
+			pack_varint(m_counts[i], ptr);
+		}
+	}
 }
 
-template <>
-inline void BTreeNode<std::string>::LoadKeyFromByteArray(std::string& key, byte** ptr) const
+template <typename T>
+void BTreeNode<T>::LoadCompact(byte** ptr)
 {
-	storage::unpack_str(key, ptr);
+	uint64_t num;
+	unpack_varint(num, ptr);
+	m_entry_num = static_cast<size_t>(num);
+	if (m_entry_num > m_tree->MaxKeys()) {
+		throw IllegalStateException("BTreeNode: Corrupted compact page.");
+	}
+
+	if (m_entry_num > 0)
+	{
+		LoadKeys(ptr, std::is_integral<T>());
+		unpack_frame(m_entry_id, m_entry_num, ptr);
+		for (size_t i = 0; i < m_entry_num; ++i)
+		{
+			uint64_t len;
+			unpack_varint(len, ptr);
+			m_entry_len[i] = static_cast<size_t>(len);
+		}
+		for (size_t i = 0; i < m_entry_num; ++i)
+		{
+			size_t len = m_entry_len[i];
+			if (len > 0)
+			{
+				m_entry_data[i] = new byte[len];
+				memcpy(m_entry_data[i], *ptr, len);
+				*ptr += len;
+			}
+			else
+			{
+				m_entry_data[i] = nullptr;
+			}
+		}
+	}
+
+	if (m_leaf)
+	{
+		for (size_t i = 0, n = m_entry_num + 1; i < n; ++i) {
+			m_children[i] = storage::NEW_PAGE;
+		}
+	}
+	else
+	{
+		unpack_frame(m_children, m_entry_num + 1, ptr);
+		if (m_tree->m_counted)
+		{
+			for (size_t i = 0, n = m_entry_num + 1; i < n; ++i)
+			{
+				uint64_t count;
+				unpack_varint(count, ptr);
+				m_counts[i] = static_cast<size_t>(count);
+			}
+		}
+	}
+
+	// sizes are tracked in the plain format
+	m_byte_size = PLAIN_HEADER_SIZE + GetChildByteArraySize();
+	for (size_t i = 0; i < m_entry_num; ++i) {
+		m_byte_size += GetEntryByteArraySize(i);
+	}
 }
 
-template <>
-inline void BTreeNode<std::string>::StoreKeyToByteArray(const std::string& key, byte** ptr) const
+template <typename T>
+void BTreeNode<T>::StoreKeys(byte** ptr, std::true_type) const
 {
-	storage::pack_str(key, ptr);
+	pack_frame(m_entry_key, m_entry_num, ptr);
+}
+
+template <typename T>
+void BTreeNode<T>::StoreKeys(byte** ptr, std::false_type) const
+{
+	for (size_t i = 0; i < m_entry_num; ++i) {
+		StoreKeyToByteArray(m_entry_key[i], ptr);
+	}
+}
+
+template <typename T>
+void BTreeNode<T>::LoadKeys(byte** ptr, std::true_type)
+{
+	unpack_frame(m_entry_key, m_entry_num, ptr);
+}
+
+template <typename T>
+void BTreeNode<T>::LoadKeys(byte** ptr, std::false_type)
+{
+	for (size_t i = 0; i < m_entry_num; ++i) {
+		LoadKeyFromByteArray(m_entry_key[i], ptr);
+	}
 }
 
 }
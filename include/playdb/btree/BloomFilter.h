@@ -0,0 +1,93 @@
+#ifndef _PLAYDB_BTREE_BLOOM_FILTER_H_
+#define _PLAYDB_BTREE_BLOOM_FILTER_H_
+
+#include "playdb.h"
+#include "playdb/typedef.h"
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <type_traits>
+
+namespace playdb
+{
+namespace btree
+{
+
+// Bloom filter over 64-bit key hashes, k probes derived from the two halves
+// of one hash. Sized for a number of keys, the false positive rate grows
+// once more than that were added.
+class BloomFilter : public ISerializable
+{
+public:
+	BloomFilter();
+	BloomFilter(size_t capacity, size_t bits_per_key);
+
+	//
+	// ISerializable interface
+	//
+	// capacity, bits per key, probes, count and word count as uint64, then
+	// the words
+	virtual size_t GetByteArraySize() const override;
+	virtual void LoadFromByteArray(const byte* data) override;
+	virtual void StoreToByteArray(byte** data, size_t& len) const override;
+
+	void Add(uint64_t hash);
+	bool MayContain(uint64_t hash) const;
+
+	size_t GetCount() const { return m_count; }
+	size_t GetCapacity() const { return m_capacity; }
+	size_t GetBitsPerKey() const { return m_bits_per_key; }
+
+	// stable across runs and platforms of the same endianness, the filter
+	// is persisted
+	static uint64_t Hash(const void* data, size_t len);
+
+private:
+	size_t m_capacity;
+	size_t m_bits_per_key;
+	size_t m_probes;
+	size_t m_count;
+
+	std::vector<uint64_t> m_bits;
+
+}; // BloomFilter
+
+// Key hashes for the filter, the value cache and shard routing. Keys that
+// compare equal must hash the same, so only integers and enums hash their
+// bytes as they are. Other key types need an overload of their own, found
+// here or next to the type: padding bytes, or +0.0 and -0.0, would give
+// equal keys different hashes and the filter false negatives.
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint64_t>::type
+bloom_hash(const T& key)
+{
+	return BloomFilter::Hash(&key, sizeof(T));
+}
+
+// float and double, long double has padding on some platforms
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value && sizeof(T) <= sizeof(double), uint64_t>::type
+bloom_hash(const T& key)
+{
+	// -0.0 == 0.0
+	T k = key == 0 ? T(0) : key;
+	return BloomFilter::Hash(&k, sizeof(T));
+}
+
+inline uint64_t bloom_hash(const std::string& key)
+{
+	return BloomFilter::Hash(key.data(), key.size());
+}
+
+template <typename A, typename B>
+uint64_t bloom_hash(const std::pair<A, B>& key)
+{
+	uint64_t h = bloom_hash(key.first);
+	return h ^ (bloom_hash(key.second) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+}
+}
+
+#endif // _PLAYDB_BTREE_BLOOM_FILTER_H_
@@ -0,0 +1,94 @@
+#ifndef _PLAYDB_BTREE_BUFFERED_BTREE_H_
+#define _PLAYDB_BTREE_BUFFERED_BTREE_H_
+
+#include "playdb/typedef.h"
+#include "playdb/btree/BTree.h"
+#include "playdb/btree/tools.h"
+
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+
+namespace playdb
+{
+namespace btree
+{
+
+// Write buffer in front of a BTree. Inserts land in a sorted in-memory
+// memtable, a full memtable is frozen and merged into the tree in key order
+// by a background thread while a fresh one takes new inserts. Lookups go
+// memtable, frozen memtable, tree.
+// Keys are unique: inserting a key again replaces its value, in the
+// memtable and in the tree when merged (see BTree::Upsert).
+// The tree must not be used directly while it is wrapped.
+template <typename T>
+class BufferedBTree
+{
+public:
+	// memtable_size: buffered bytes that start a merge, inserts block once
+	// twice as much is waiting behind a running merge
+	BufferedBTree(BTree<T>* tree, size_t memtable_size = DEFAULT_MEMTABLE_SIZE);
+	~BufferedBTree();
+	BufferedBTree(const BufferedBTree&) = delete;
+	BufferedBTree& operator = (const BufferedBTree&) = delete;
+
+	void InsertData(const T& key, size_t len, const byte* data);
+	// the same as InsertData, every insert replaces here
+	void Upsert(const T& key, size_t len, const byte* data) { InsertData(key, len, data); }
+	bool DeleteData(const T& key);
+
+	bool Query(const T& key, Data<T>& result);
+	// visits the entries with lo <= key <= hi in key order
+	void RangeQuery(const T& lo, const T& hi, IVisitor& visitor);
+
+	// merges everything buffered so far and waits for it
+	void Flush();
+
+private:
+	typedef std::shared_ptr<std::vector<byte>> Value;
+	// newest value per key
+	typedef std::map<T, Value> MemTable;
+
+	void MergeLoop();
+
+	// hands the active memtable to the merger, m_mutex held
+	void Freeze();
+	void WaitMerge(std::unique_lock<std::mutex>& lock);
+
+	static Data<T> MakeData(const T& key, const Value& value);
+
+private:
+	static const size_t DEFAULT_MEMTABLE_SIZE = 4 << 20;
+
+	BTree<T>* m_tree;
+
+	size_t m_memtable_size;
+
+	// guards the memtables, the merger reads m_frozen without it
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+
+	MemTable m_active;
+	size_t   m_active_bytes;
+	MemTable m_frozen;
+
+	// held for every tree access, the merger keeps it for a whole memtable
+	std::mutex m_tree_mutex;
+
+	bool m_stop;
+	std::exception_ptr m_error;
+
+	std::thread m_merger;
+
+}; // BufferedBTree
+
+}
+}
+
+#include "playdb/btree/BufferedBTree.inl"
+
+#endif // _PLAYDB_BTREE_BUFFERED_BTREE_H_
@@ -0,0 +1,254 @@
+#ifndef _PLAYDB_BTREE_BUFFERED_BTREE_INL_
+#define _PLAYDB_BTREE_BUFFERED_BTREE_INL_
+
+#include <algorithm>
+#include <initializer_list>
+
+#include <assert.h>
+
+namespace playdb
+{
+namespace btree
+{
+
+template <typename T>
+BufferedBTree<T>::BufferedBTree(BTree<T>* tree, size_t memtable_size)
+	: m_tree(tree)
+	, m_memtable_size(memtable_size)
+	, m_active_bytes(0)
+	, m_stop(false)
+{
+	m_merger = std::thread(&BufferedBTree<T>::MergeLoop, this);
+}
+
+template <typename T>
+BufferedBTree<T>::~BufferedBTree()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	WaitMerge(lock);
+	Freeze();
+	WaitMerge(lock);
+
+	m_stop = true;
+	lock.unlock();
+	m_cond.notify_all();
+
+	m_merger.join();
+}
+
+template <typename T>
+void BufferedBTree<T>::InsertData(const T& key, size_t len, const byte* data)
+{
+	auto value = std::make_shared<std::vector<byte>>(data, data + len);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_error) {
+		std::rethrow_exception(m_error);
+	}
+
+	auto itr = m_active.find(key);
+	if (itr != m_active.end()) {
+		m_active_bytes -= sizeof(T) + itr->second->size();
+		itr->second = value;
+	} else {
+		m_active.insert(std::make_pair(key, value));
+	}
+	m_active_bytes += sizeof(T) + len;
+
+	if (m_active_bytes >= m_memtable_size)
+	{
+		// back pressure once the merger falls a whole memtable behind
+		if (!m_frozen.empty() && m_active_bytes >= m_memtable_size * 2) {
+			WaitMerge(lock);
+		}
+		if (m_frozen.empty()) {
+			Freeze();
+		}
+	}
+}
+
+template <typename T>
+bool BufferedBTree<T>::DeleteData(const T& key)
+{
+	bool found = false;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		auto itr = m_active.find(key);
+		if (itr != m_active.end()) {
+			m_active_bytes -= sizeof(T) + itr->second->size();
+			m_active.erase(itr);
+			found = true;
+		}
+
+		// older values may be frozen or merged already, a frozen one can
+		// only be removed once it is in the tree
+		WaitMerge(lock);
+	}
+
+	std::lock_guard<std::mutex> lock(m_tree_mutex);
+	return m_tree->DeleteData(key) || found;
+}
+
+template <typename T>
+bool BufferedBTree<T>::Query(const T& key, Data<T>& result)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (const MemTable* table : { &m_active, &m_frozen })
+		{
+			auto itr = table->find(key);
+			if (itr != table->end()) {
+				result = MakeData(itr->first, itr->second);
+				return true;
+			}
+		}
+	}
+
+	// entries reach the tree before they leave m_frozen, so a miss above
+	// can't race past a merge
+	std::lock_guard<std::mutex> lock(m_tree_mutex);
+	return m_tree->Query(key, result);
+}
+
+template <typename T>
+void BufferedBTree<T>::RangeQuery(const T& lo, const T& hi, IVisitor& visitor)
+{
+	if (hi < lo) {
+		return;
+	}
+
+	class Collector : public IVisitor
+	{
+	public:
+		Collector(IVisitor& visitor) : visitor(visitor) {}
+		virtual void VisitNode(const INode& node) override {
+			visitor.VisitNode(node);
+		}
+		virtual void VisitData(const IData& data) override {
+			auto& d = static_cast<const Data<T>&>(data);
+			entries.push_back(std::make_pair(d.key,
+				std::make_shared<std::vector<byte>>(d.data, d.data + d.data_len)));
+		}
+		IVisitor& visitor;
+		std::vector<std::pair<T, Value>> entries;
+	}; // Collector
+
+	// with the tree locked the merger is either not started or done, and
+	// m_frozen is only cleared under this lock, so nothing shows up twice
+	MemTable buffered;
+	Collector tree_entries(visitor);
+	{
+		std::lock_guard<std::mutex> tree_lock(m_tree_mutex);
+		{
+			// active values replace frozen ones
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (const MemTable* table : { &m_frozen, &m_active }) {
+				for (auto itr = table->lower_bound(lo), end = table->upper_bound(hi); itr != end; ++itr) {
+					buffered[itr->first] = itr->second;
+				}
+			}
+		}
+		m_tree->RangeQuery(lo, hi, tree_entries);
+	}
+
+	// buffered values replace stored ones
+	auto& stored = tree_entries.entries;
+	auto a = stored.begin();
+	auto b = buffered.begin();
+	while (a != stored.end() || b != buffered.end())
+	{
+		if (b == buffered.end() || (a != stored.end() && a->first < b->first))
+		{
+			Data<T> data = MakeData(a->first, a->second);
+			visitor.VisitData(data);
+			++a;
+		}
+		else
+		{
+			if (a != stored.end() && !(b->first < a->first)) {
+				++a;
+			}
+			Data<T> data = MakeData(b->first, b->second);
+			visitor.VisitData(data);
+			++b;
+		}
+	}
+}
+
+template <typename T>
+void BufferedBTree<T>::Flush()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	WaitMerge(lock);
+	Freeze();
+	WaitMerge(lock);
+
+	if (m_error) {
+		std::rethrow_exception(m_error);
+	}
+}
+
+template <typename T>
+void BufferedBTree<T>::MergeLoop()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
+	{
+		m_cond.wait(lock, [this] { return m_stop || !m_frozen.empty(); });
+		if (m_frozen.empty()) {
+			break;
+		}
+		lock.unlock();
+
+		// m_frozen is read only until it is cleared below
+		std::lock_guard<std::mutex> tree_lock(m_tree_mutex);
+		try {
+			m_tree->BeginBatch();
+			for (auto& e : m_frozen) {
+				m_tree->Upsert(e.first, e.second->size(), e.second->data());
+			}
+			m_tree->CommitBatch();
+		} catch (...) {
+			lock.lock();
+			m_error = std::current_exception();
+			lock.unlock();
+		}
+
+		lock.lock();
+		m_frozen.clear();
+		m_cond.notify_all();
+	}
+}
+
+template <typename T>
+void BufferedBTree<T>::Freeze()
+{
+	if (m_active.empty()) {
+		return;
+	}
+
+	assert(m_frozen.empty());
+	m_frozen.swap(m_active);
+	m_active_bytes = 0;
+	m_cond.notify_all();
+}
+
+template <typename T>
+void BufferedBTree<T>::WaitMerge(std::unique_lock<std::mutex>& lock)
+{
+	m_cond.wait(lock, [this] { return m_frozen.empty(); });
+}
+
+template <typename T>
+Data<T> BufferedBTree<T>::MakeData(const T& key, const Value& value)
+{
+	Data<T> data(storage::NEW_PAGE, key, value->data(), value->size());
+	data.holder = value;
+	return data;
+}
+
+}
+}
+
+#endif // _PLAYDB_BTREE_BUFFERED_BTREE_INL_
@@ -0,0 +1,45 @@
+#ifndef _PLAYDB_BTREE_FREQUENCY_SKETCH_H_
+#define _PLAYDB_BTREE_FREQUENCY_SKETCH_H_
+
+#include "playdb/typedef.h"
+
+#include <vector>
+
+namespace playdb
+{
+namespace btree
+{
+
+// Count-min sketch of recent access frequencies for TinyLFU admission.
+// Counters are 4 bits, two to a byte, saturate at 15 and are all halved
+// after every width * 10 increments, so old popularity fades out.
+class FrequencySketch
+{
+public:
+	FrequencySketch(size_t width);
+
+	void Increment(uint64_t hash);
+	size_t Frequency(uint64_t hash) const;
+
+private:
+	// counter index, the byte is index / 2, the low half for even ones
+	size_t Index(uint64_t hash, size_t row) const;
+	size_t Get(size_t i) const;
+
+	void Age();
+
+private:
+	static const size_t ROWS = 4;
+
+	size_t m_mask;
+	std::vector<uint8_t> m_table;
+
+	size_t m_additions;
+	size_t m_sample_size;
+
+}; // FrequencySketch
+
+}
+}
+
+#endif // _PLAYDB_BTREE_FREQUENCY_SKETCH_H_
@@ -0,0 +1,182 @@
+#ifndef _PLAYDB_BTREE_INDEXED_BTREE_H_
+#define _PLAYDB_BTREE_INDEXED_BTREE_H_
+
+#include "playdb/typedef.h"
+#include "playdb/btree/KeySerializer.h"
+#include "playdb/btree/BloomFilter.h"
+
+#include <vector>
+#include <memory>
+#include <functional>
+
+namespace playdb
+{
+namespace btree
+{
+
+// Entry key of a secondary index: the index key, then the primary key it
+// points to. bound only marks range limits that sort before (-1) or after
+// (1) every primary key of an index key, stored keys have 0.
+template <typename K, typename T>
+struct IndexKey
+{
+	K   key;
+	T   primary;
+	int bound;
+
+	IndexKey() : key(), primary(), bound(0) {}
+	IndexKey(const K& key, const T& primary, int bound = 0)
+		: key(key), primary(primary), bound(bound) {}
+
+	bool operator < (const IndexKey& k) const {
+		if (key < k.key) return true;
+		if (k.key < key) return false;
+		if (bound != 0 || k.bound != 0) return bound < k.bound;
+		return primary < k.primary;
+	}
+	bool operator > (const IndexKey& k) const {
+		return k < *this;
+	}
+	bool operator == (const IndexKey& k) const {
+		return bound == k.bound && key == k.key && primary == k.primary;
+	}
+};
+
+template <typename K, typename T>
+struct KeySerializer<IndexKey<K, T>>
+{
+	static size_t Size(const IndexKey<K, T>& k) {
+		return KeySerializer<K>::Size(k.key) + KeySerializer<T>::Size(k.primary);
+	}
+	static void Store(const IndexKey<K, T>& k, byte** ptr) {
+		KeySerializer<K>::Store(k.key, ptr);
+		KeySerializer<T>::Store(k.primary, ptr);
+	}
+	static void Load(IndexKey<K, T>& k, byte** ptr) {
+		KeySerializer<K>::Load(k.key, ptr);
+		KeySerializer<T>::Load(k.primary, ptr);
+		k.bound = 0;
+	}
+};
+
+template <typename K, typename T>
+uint64_t bloom_hash(const IndexKey<K, T>& k)
+{
+	uint64_t h = bloom_hash(k.key);
+	return h ^ (bloom_hash(k.primary) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+}
+}
+
+#include "playdb/btree/BTree.h"
+
+namespace playdb
+{
+namespace btree
+{
+
+// A primary BTree with secondary indexes kept in step with it. An index
+// is a BTree<IndexKey<K, T>> of (extract(value), primary key) entries with
+// no value, so lookups by an attribute need neither a scan nor a copy of
+// the payload. Primary keys are unique here, inserting an existing key
+// replaces its value and index entries. Every call runs as one batch over
+// all trees, see BTree::BeginBatch.
+//
+// The batches of the trees are committed one after another, there is no
+// commit spanning them. An exception in the middle of a call, or a crash
+// before the storage is flushed, can leave an index out of step with the
+// primary. Such an index is rebuilt by adding a new tree with build on.
+//
+// The trees are owned by the caller and usually share one storage through
+// a Catalog. Extractors aren't stored, add the indexes again after opening,
+// with build off.
+template <typename T>
+class IndexedBTree
+{
+private:
+	class IIndex
+	{
+	public:
+		virtual void Insert(const T& key, const byte* data, size_t len) = 0;
+		virtual void Delete(const T& key, const byte* data, size_t len) = 0;
+		virtual void BeginBatch() = 0;
+		virtual void CommitBatch() = 0;
+		virtual ~IIndex() {}
+	}; // IIndex
+
+public:
+	template <typename K>
+	class Index : public IIndex
+	{
+	public:
+		typedef std::function<K(const byte* data, size_t len)> Extractor;
+
+		// primary keys of the entries with lo <= index key <= hi, in index
+		// order, from the index alone
+		void Find(const K& lo, const K& hi, std::vector<T>& keys);
+		void Find(const K& key, std::vector<T>& keys) { Find(key, key, keys); }
+
+		// visits the primary entries (VisitData only) in index order
+		void RangeQuery(const K& lo, const K& hi, IVisitor& visitor);
+
+		BTree<IndexKey<K, T>>* GetTree() const { return m_tree; }
+
+	private:
+		Index(IndexedBTree<T>* owner, BTree<IndexKey<K, T>>* tree, const Extractor& extract)
+			: m_owner(owner), m_tree(tree), m_extract(extract) {}
+
+		virtual void Insert(const T& key, const byte* data, size_t len) override;
+		virtual void Delete(const T& key, const byte* data, size_t len) override;
+		virtual void BeginBatch() override { m_tree->BeginBatch(); }
+		virtual void CommitBatch() override { m_tree->CommitBatch(); }
+
+	private:
+		IndexedBTree<T>* m_owner;
+		BTree<IndexKey<K, T>>* m_tree;
+		Extractor m_extract;
+
+		friend class IndexedBTree<T>;
+
+	}; // Index
+
+public:
+	IndexedBTree(BTree<T>* primary);
+
+	// indexes the entries already in the primary if build is set
+	template <typename K>
+	Index<K>* AddIndex(BTree<IndexKey<K, T>>* tree,
+		const typename Index<K>::Extractor& extract, bool build = true);
+
+	void InsertData(const T& key, size_t len, const byte* data);
+	bool DeleteData(const T& key);
+
+	bool Query(const T& key, Data<T>& result) { return m_primary->Query(key, result); }
+	void RangeQuery(const T& lo, const T& hi, IVisitor& visitor) { m_primary->RangeQuery(lo, hi, visitor); }
+
+	// keeps the batch open across calls until CommitBatch
+	void BeginBatch();
+	void CommitBatch();
+
+	BTree<T>* GetPrimary() const { return m_primary; }
+
+private:
+	// a batch of its own unless the caller has one open
+	void Begin();
+	void Commit();
+
+private:
+	BTree<T>* m_primary;
+
+	std::vector<std::unique_ptr<IIndex>> m_indexes;
+
+	bool m_batch;
+
+}; // IndexedBTree
+
+}
+}
+
+#include "playdb/btree/IndexedBTree.inl"
+
+#endif // _PLAYDB_BTREE_INDEXED_BTREE_H_
@@ -0,0 +1,226 @@
+#ifndef _PLAYDB_BTREE_INDEXED_BTREE_INL_
+#define _PLAYDB_BTREE_INDEXED_BTREE_INL_
+
+#include <algorithm>
+
+namespace playdb
+{
+namespace btree
+{
+
+//////////////////////////////////////////////////////////////////////////
+// class IndexedBTree<T>::Index<K>
+//////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+template <typename K>
+void IndexedBTree<T>::Index<K>::
+Find(const K& lo, const K& hi, std::vector<T>& keys)
+{
+	class Collector : public IVisitor
+	{
+	public:
+		Collector(std::vector<T>& keys) : keys(keys) {}
+		virtual void VisitNode(const INode& node) override {}
+		virtual void VisitData(const IData& data) override {
+			keys.push_back(static_cast<const Data<IndexKey<K, T>>&>(data).key.primary);
+		}
+		std::vector<T>& keys;
+	}; // Collector
+
+	if (hi < lo) {
+		return;
+	}
+
+	Collector collector(keys);
+	m_tree->RangeQuery(IndexKey<K, T>(lo, T(), -1), IndexKey<K, T>(hi, T(), 1), collector);
+}
+
+template <typename T>
+template <typename K>
+void IndexedBTree<T>::Index<K>::
+RangeQuery(const K& lo, const K& hi, IVisitor& visitor)
+{
+	std::vector<T> keys;
+	Find(lo, hi, keys);
+
+	for (auto& key : keys)
+	{
+		Data<T> result;
+		if (m_owner->m_primary->Query(key, result)) {
+			visitor.VisitData(result);
+		}
+	}
+}
+
+template <typename T>
+template <typename K>
+void IndexedBTree<T>::Index<K>::
+Insert(const T& key, const byte* data, size_t len)
+{
+	// entries carry no value, only a valid pointer
+	static const byte NO_VALUE = 0;
+	m_tree->InsertData(IndexKey<K, T>(m_extract(data, len), key), 0, &NO_VALUE);
+}
+
+template <typename T>
+template <typename K>
+void IndexedBTree<T>::Index<K>::
+Delete(const T& key, const byte* data, size_t len)
+{
+	m_tree->DeleteData(IndexKey<K, T>(m_extract(data, len), key));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// class IndexedBTree<T>
+//////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+IndexedBTree<T>::IndexedBTree(BTree<T>* primary)
+	: m_primary(primary)
+	, m_batch(false)
+{
+}
+
+template <typename T>
+template <typename K>
+typename IndexedBTree<T>::template Index<K>* IndexedBTree<T>::
+AddIndex(BTree<IndexKey<K, T>>* tree, const typename Index<K>::Extractor& extract, bool build)
+{
+	Index<K>* index = new Index<K>(this, tree, extract);
+	m_indexes.push_back(std::unique_ptr<IIndex>(index));
+
+	if (m_batch) {
+		tree->BeginBatch();
+	}
+
+	if (!build) {
+		return index;
+	}
+
+	class Builder : public IVisitor
+	{
+	public:
+		Builder(const typename Index<K>::Extractor& extract) : extract(extract) {}
+		virtual void VisitNode(const INode& node) override {}
+		virtual void VisitData(const IData& data) override {
+			auto& d = static_cast<const Data<T>&>(data);
+			entries.push_back(IndexKey<K, T>(extract(d.data, d.data_len), d.key));
+		}
+		const typename Index<K>::Extractor& extract;
+		std::vector<IndexKey<K, T>> entries;
+	}; // Builder
+
+	Builder builder(extract);
+	m_primary->LayerTraverse(builder);
+
+	// in index order the inserts stay on the rightmost path
+	std::sort(builder.entries.begin(), builder.entries.end());
+
+	static const byte NO_VALUE = 0;
+	if (!m_batch) {
+		tree->BeginBatch();
+	}
+	for (auto& entry : builder.entries) {
+		tree->InsertData(entry, 0, &NO_VALUE);
+	}
+	if (!m_batch) {
+		tree->CommitBatch();
+	}
+
+	return index;
+}
+
+template <typename T>
+void IndexedBTree<T>::InsertData(const T& key, size_t len, const byte* data)
+{
+	Begin();
+	try {
+		// the old index entries are found through the old value
+		Data<T> old;
+		if (m_primary->Query(key, old))
+		{
+			for (auto& index : m_indexes) {
+				index->Delete(key, old.data, old.data_len);
+			}
+			m_primary->Update(key, len, data);
+		}
+		else
+		{
+			m_primary->InsertData(key, len, data);
+		}
+
+		for (auto& index : m_indexes) {
+			index->Insert(key, data, len);
+		}
+	} catch (...) {
+		Commit();
+		throw;
+	}
+	Commit();
+}
+
+template <typename T>
+bool IndexedBTree<T>::DeleteData(const T& key)
+{
+	Begin();
+	bool found = false;
+	try {
+		Data<T> old;
+		if (m_primary->Query(key, old))
+		{
+			for (auto& index : m_indexes) {
+				index->Delete(key, old.data, old.data_len);
+			}
+			found = m_primary->DeleteData(key);
+		}
+	} catch (...) {
+		Commit();
+		throw;
+	}
+	Commit();
+	return found;
+}
+
+template <typename T>
+void IndexedBTree<T>::BeginBatch()
+{
+	Begin();
+	m_batch = true;
+}
+
+template <typename T>
+void IndexedBTree<T>::CommitBatch()
+{
+	m_batch = false;
+	Commit();
+}
+
+template <typename T>
+void IndexedBTree<T>::Begin()
+{
+	if (m_batch) {
+		return;
+	}
+	m_primary->BeginBatch();
+	for (auto& index : m_indexes) {
+		index->BeginBatch();
+	}
+}
+
+template <typename T>
+void IndexedBTree<T>::Commit()
+{
+	if (m_batch) {
+		return;
+	}
+	m_primary->CommitBatch();
+	for (auto& index : m_indexes) {
+		index->CommitBatch();
+	}
+}
+
+}
+}
+
+#endif // _PLAYDB_BTREE_INDEXED_BTREE_INL_
@@ -0,0 +1,165 @@
+#ifndef _PLAYDB_BTREE_INT_PACKING_H_
+#define _PLAYDB_BTREE_INT_PACKING_H_
+
+#include "playdb/typedef.h"
+
+#include <string.h>
+
+namespace playdb
+{
+namespace btree
+{
+
+//
+// Integer encodings of compact node pages. Multi-byte words are little
+// endian, as on every platform the page files are used on.
+//
+
+// LEB128, 7 bits per byte
+inline size_t varint_size(uint64_t v)
+{
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		++n;
+	}
+	return n;
+}
+
+inline void pack_varint(uint64_t v, byte** ptr)
+{
+	byte* p = *ptr;
+	while (v >= 0x80) {
+		*p++ = static_cast<byte>(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = static_cast<byte>(v);
+	*ptr = p;
+}
+
+inline void unpack_varint(uint64_t& v, byte** ptr)
+{
+	const byte* p = *ptr;
+	v = 0;
+	for (int shift = 0; ; shift += 7)
+	{
+		byte b = *p++;
+		v |= static_cast<uint64_t>(b & 0x7f) << shift;
+		if (!(b & 0x80) || shift >= 63) {
+			break;
+		}
+	}
+	*ptr = const_cast<byte*>(p);
+}
+
+// Frame of reference: the smallest value as a zigzag varint, the bit width
+// of the largest difference to it, then every difference in that many bits.
+// Page ids allocated together or keys of one node differ in the low bits
+// only, so most values shrink to a byte or two and equal ones to nothing.
+template <typename T>
+void pack_frame(const T* values, size_t n, byte** ptr)
+{
+	T lo = values[0], hi = values[0];
+	for (size_t i = 1; i < n; ++i) {
+		if (values[i] < lo) lo = values[i];
+		if (hi < values[i]) hi = values[i];
+	}
+
+	// signed values are sign extended, differences modulo 2^64 are then
+	// exact for any integer type
+	uint64_t base = static_cast<uint64_t>(lo);
+	uint64_t range = static_cast<uint64_t>(hi) - base;
+	int width = 0;
+	while (width < 64 && (range >> width) != 0) {
+		++width;
+	}
+
+	int64_t sbase = static_cast<int64_t>(base);
+	pack_varint((static_cast<uint64_t>(sbase) << 1) ^ static_cast<uint64_t>(sbase >> 63), ptr);
+	**ptr = static_cast<byte>(width);
+	++*ptr;
+	if (width == 0) {
+		return;
+	}
+
+	byte* p = *ptr;
+	uint64_t acc = 0;
+	int bits = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		uint64_t d = static_cast<uint64_t>(values[i]) - base;
+		acc |= d << bits;
+		bits += width;
+		if (bits >= 64)
+		{
+			for (int k = 0; k < 8; ++k) {
+				*p++ = static_cast<byte>(acc >> (k * 8));
+			}
+			bits -= 64;
+			acc = bits == 0 ? 0 : d >> (width - bits);
+		}
+	}
+	for (int k = 0; k * 8 < bits; ++k) {
+		*p++ = static_cast<byte>(acc >> (k * 8));
+	}
+	*ptr = p;
+}
+
+template <typename T>
+void unpack_frame(T* values, size_t n, byte** ptr)
+{
+	uint64_t zz;
+	unpack_varint(zz, ptr);
+	uint64_t base = (zz >> 1) ^ (0 - (zz & 1));
+	int width = **ptr;
+	++*ptr;
+
+	if (width == 0)
+	{
+		for (size_t i = 0; i < n; ++i) {
+			values[i] = static_cast<T>(base);
+		}
+		return;
+	}
+
+	const byte* src = *ptr;
+	size_t bytes = (n * width + 7) / 8;
+	uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+
+	// one unaligned word per value while it stays inside the array, with
+	// no state carried between iterations the compiler may vectorize it
+	size_t fast = 0;
+	if (width <= 56 && bytes >= 8) {
+		fast = ((bytes - 8) * 8 + 7) / width + 1;
+		if (fast > n) {
+			fast = n;
+		}
+	}
+	for (size_t i = 0; i < fast; ++i)
+	{
+		size_t bit = i * width;
+		uint64_t word;
+		memcpy(&word, src + (bit >> 3), sizeof(word));
+		values[i] = static_cast<T>(base + ((word >> (bit & 7)) & mask));
+	}
+
+	// the tail byte by byte
+	for (size_t i = fast; i < n; ++i)
+	{
+		size_t bit = i * width;
+		const byte* p = src + (bit >> 3);
+		int shift = static_cast<int>(bit & 7);
+		uint64_t d = p[0] >> shift;
+		for (int k = 1; k * 8 - shift < width; ++k) {
+			d |= static_cast<uint64_t>(p[k]) << (k * 8 - shift);
+		}
+		values[i] = static_cast<T>(base + (d & mask));
+	}
+
+	*ptr += bytes;
+}
+
+}
+}
+
+#endif // _PLAYDB_BTREE_INT_PACKING_H_
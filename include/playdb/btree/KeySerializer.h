@@ -0,0 +1,66 @@
+#ifndef _PLAYDB_BTREE_KEY_SERIALIZER_H_
+#define _PLAYDB_BTREE_KEY_SERIALIZER_H_
+
+#include "playdb/typedef.h"
+#include "playdb/storage/tools.h"
+
+#include <string>
+#include <utility>
+
+namespace playdb
+{
+namespace btree
+{
+
+// How BTree<T> stores its keys in node pages. Trivially copyable keys are
+// copied as they are, other key types need a specialization.
+template <typename T>
+struct KeySerializer
+{
+	static size_t Size(const T& key) {
+		return sizeof(T);
+	}
+	static void Store(const T& key, byte** ptr) {
+		storage::pack(key, ptr);
+	}
+	static void Load(T& key, byte** ptr) {
+		storage::unpack(key, ptr);
+	}
+};
+
+template <>
+struct KeySerializer<std::string>
+{
+	static size_t Size(const std::string& key) {
+		return storage::sizeof_pack_str(key);
+	}
+	static void Store(const std::string& key, byte** ptr) {
+		storage::pack_str(key, ptr);
+	}
+	static void Load(std::string& key, byte** ptr) {
+		key.clear();
+		storage::unpack_str(key, ptr);
+	}
+};
+
+// composite keys, ordered by first then second
+template <typename A, typename B>
+struct KeySerializer<std::pair<A, B>>
+{
+	static size_t Size(const std::pair<A, B>& key) {
+		return KeySerializer<A>::Size(key.first) + KeySerializer<B>::Size(key.second);
+	}
+	static void Store(const std::pair<A, B>& key, byte** ptr) {
+		KeySerializer<A>::Store(key.first, ptr);
+		KeySerializer<B>::Store(key.second, ptr);
+	}
+	static void Load(std::pair<A, B>& key, byte** ptr) {
+		KeySerializer<A>::Load(key.first, ptr);
+		KeySerializer<B>::Load(key.second, ptr);
+	}
+};
+
+}
+}
+
+#endif // _PLAYDB_BTREE_KEY_SERIALIZER_H_
@@ -0,0 +1,92 @@
+#ifndef _PLAYDB_BTREE_SHARDED_BTREE_H_
+#define _PLAYDB_BTREE_SHARDED_BTREE_H_
+
+#include "playdb/typedef.h"
+#include "playdb/btree/BTree.h"
+#include "playdb/btree/tools.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace playdb
+{
+namespace btree
+{
+
+// Independent trees, one per storage manager, each behind its own lock so
+// writers to different shards never wait on each other. Keys go to a shard
+// by hash, or by range when split keys are given. Results handed out are
+// copies, a shard may change right after its lock is released.
+//
+// The trees are opened again with the storages in the same order and the
+// same split keys, the partitioning isn't stored.
+template <typename T>
+class ShardedBTree
+{
+public:
+	// hash partitioned, a new tree in every storage
+	ShardedBTree(const std::vector<IStorageManager*>& storages, size_t degree, bool counted = false);
+	// hash partitioned, the trees stored first in the storages
+	ShardedBTree(const std::vector<IStorageManager*>& storages);
+	// range partitioned, shard i takes splits[i - 1] <= key < splits[i],
+	// one split key less than storages, ascending
+	ShardedBTree(const std::vector<IStorageManager*>& storages, const std::vector<T>& splits,
+		size_t degree, bool counted = false);
+	ShardedBTree(const std::vector<IStorageManager*>& storages, const std::vector<T>& splits);
+	ShardedBTree(const ShardedBTree&) = delete;
+	ShardedBTree& operator = (const ShardedBTree&) = delete;
+
+	void InsertData(const T& key, size_t len, const byte* data);
+	bool DeleteData(const T& key);
+
+	bool Update(const T& key, size_t len, const byte* data);
+	void Upsert(const T& key, size_t len, const byte* data);
+	// modify runs with the shard locked
+	bool Modify(const T& key, const typename BTree<T>::Modifier& modify);
+
+	bool Query(const T& key, Data<T>& result);
+	// visits the entries with lo <= key <= hi in key order (VisitData
+	// only), hash shards are scanned one after another and merged
+	void RangeQuery(const T& lo, const T& hi, IVisitor& visitor);
+
+	// stores shard i, or all of them, see BTree::Flush
+	void Flush(size_t shard);
+	void Flush();
+
+	size_t GetShardCount() const { return m_shards.size(); }
+	size_t GetShard(const T& key) const;
+
+	typename BTree<T>::Statistics GetStatistics(size_t shard) const;
+	// entries in all shards
+	size_t GetDataCount() const;
+
+private:
+	struct Shard
+	{
+		std::unique_ptr<BTree<T>> tree;
+		mutable std::mutex mutex;
+	};
+
+	typedef std::shared_ptr<std::vector<byte>> Value;
+
+	void CheckSplits(size_t shards) const;
+
+	Shard& Locate(const T& key) { return *m_shards[GetShard(key)]; }
+
+	static Data<T> MakeData(const T& key, const byte* data, size_t len);
+
+private:
+	std::vector<std::unique_ptr<Shard>> m_shards;
+
+	// empty for hash partitioning
+	std::vector<T> m_splits;
+
+}; // ShardedBTree
+
+}
+}
+
+#include "playdb/btree/ShardedBTree.inl"
+
+#endif // _PLAYDB_BTREE_SHARDED_BTREE_H_
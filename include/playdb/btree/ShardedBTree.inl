@@ -0,0 +1,251 @@
+#ifndef _PLAYDB_BTREE_SHARDED_BTREE_INL_
+#define _PLAYDB_BTREE_SHARDED_BTREE_INL_
+
+#include "playdb/Exception.h"
+
+#include <algorithm>
+#include <queue>
+
+namespace playdb
+{
+namespace btree
+{
+
+template <typename T>
+ShardedBTree<T>::ShardedBTree(const std::vector<IStorageManager*>& storages, size_t degree, bool counted)
+	: ShardedBTree(storages, std::vector<T>(), degree, counted)
+{
+}
+
+template <typename T>
+ShardedBTree<T>::ShardedBTree(const std::vector<IStorageManager*>& storages)
+	: ShardedBTree(storages, std::vector<T>())
+{
+}
+
+template <typename T>
+ShardedBTree<T>::ShardedBTree(const std::vector<IStorageManager*>& storages, const std::vector<T>& splits,
+	                          size_t degree, bool counted)
+	: m_splits(splits)
+{
+	CheckSplits(storages.size());
+	for (auto storage : storages)
+	{
+		std::unique_ptr<Shard> shard(new Shard);
+		shard->tree.reset(new BTree<T>(storage, degree, counted));
+		m_shards.push_back(std::move(shard));
+	}
+}
+
+template <typename T>
+ShardedBTree<T>::ShardedBTree(const std::vector<IStorageManager*>& storages, const std::vector<T>& splits)
+	: m_splits(splits)
+{
+	CheckSplits(storages.size());
+	for (auto storage : storages)
+	{
+		std::unique_ptr<Shard> shard(new Shard);
+		shard->tree.reset(new BTree<T>(storage));
+		m_shards.push_back(std::move(shard));
+	}
+}
+
+template <typename T>
+void ShardedBTree<T>::InsertData(const T& key, size_t len, const byte* data)
+{
+	Shard& shard = Locate(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.tree->InsertData(key, len, data);
+}
+
+template <typename T>
+bool ShardedBTree<T>::DeleteData(const T& key)
+{
+	Shard& shard = Locate(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	return shard.tree->DeleteData(key);
+}
+
+template <typename T>
+bool ShardedBTree<T>::Update(const T& key, size_t len, const byte* data)
+{
+	Shard& shard = Locate(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	return shard.tree->Update(key, len, data);
+}
+
+template <typename T>
+void ShardedBTree<T>::Upsert(const T& key, size_t len, const byte* data)
+{
+	Shard& shard = Locate(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.tree->Upsert(key, len, data);
+}
+
+template <typename T>
+bool ShardedBTree<T>::Modify(const T& key, const typename BTree<T>::Modifier& modify)
+{
+	Shard& shard = Locate(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	return shard.tree->Modify(key, modify);
+}
+
+template <typename T>
+bool ShardedBTree<T>::Query(const T& key, Data<T>& result)
+{
+	Shard& shard = Locate(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	Data<T> found;
+	if (!shard.tree->Query(key, found)) {
+		return false;
+	}
+	result = MakeData(found.key, found.data, found.data_len);
+	return true;
+}
+
+template <typename T>
+void ShardedBTree<T>::RangeQuery(const T& lo, const T& hi, IVisitor& visitor)
+{
+	if (hi < lo) {
+		return;
+	}
+
+	class Collector : public IVisitor
+	{
+	public:
+		virtual void VisitNode(const INode& node) override {}
+		virtual void VisitData(const IData& data) override {
+			auto& d = static_cast<const Data<T>&>(data);
+			entries.push_back(MakeData(d.key, d.data, d.data_len));
+		}
+		std::vector<Data<T>> entries;
+	}; // Collector
+
+	// ranges are ordered already, one shard after another
+	if (!m_splits.empty())
+	{
+		for (size_t i = GetShard(lo), last = GetShard(hi); i <= last; ++i)
+		{
+			Collector collector;
+			{
+				std::lock_guard<std::mutex> lock(m_shards[i]->mutex);
+				m_shards[i]->tree->RangeQuery(lo, hi, collector);
+			}
+			for (auto& data : collector.entries) {
+				visitor.VisitData(data);
+			}
+		}
+		return;
+	}
+
+	std::vector<Collector> shards(m_shards.size());
+	for (size_t i = 0, n = m_shards.size(); i < n; ++i)
+	{
+		std::lock_guard<std::mutex> lock(m_shards[i]->mutex);
+		m_shards[i]->tree->RangeQuery(lo, hi, shards[i]);
+	}
+
+	// k-way merge, smallest head first
+	typedef std::pair<size_t, size_t> Cursor;
+	auto greater = [&shards](const Cursor& a, const Cursor& b) {
+		return shards[b.first].entries[b.second].key < shards[a.first].entries[a.second].key;
+	};
+	std::priority_queue<Cursor, std::vector<Cursor>, decltype(greater)> heads(greater);
+	for (size_t i = 0, n = shards.size(); i < n; ++i) {
+		if (!shards[i].entries.empty()) {
+			heads.push(Cursor(i, 0));
+		}
+	}
+	while (!heads.empty())
+	{
+		Cursor c = heads.top();
+		heads.pop();
+		visitor.VisitData(shards[c.first].entries[c.second]);
+		if (++c.second < shards[c.first].entries.size()) {
+			heads.push(c);
+		}
+	}
+}
+
+template <typename T>
+void ShardedBTree<T>::Flush(size_t shard)
+{
+	if (shard >= m_shards.size()) {
+		throw IndexOutOfBoundsException(shard);
+	}
+	std::lock_guard<std::mutex> lock(m_shards[shard]->mutex);
+	m_shards[shard]->tree->Flush();
+}
+
+template <typename T>
+void ShardedBTree<T>::Flush()
+{
+	for (size_t i = 0, n = m_shards.size(); i < n; ++i) {
+		Flush(i);
+	}
+}
+
+template <typename T>
+size_t ShardedBTree<T>::GetShard(const T& key) const
+{
+	if (!m_splits.empty()) {
+		return std::upper_bound(m_splits.begin(), m_splits.end(), key) - m_splits.begin();
+	}
+
+	// remixed, a shard's own filter probes with the plain hash
+	uint64_t h = bloom_hash(key);
+	h ^= h >> 31;
+	h *= 0x7fb5d329728ea185ULL;
+	h ^= h >> 27;
+	return static_cast<size_t>(h % m_shards.size());
+}
+
+template <typename T>
+typename BTree<T>::Statistics ShardedBTree<T>::GetStatistics(size_t shard) const
+{
+	if (shard >= m_shards.size()) {
+		throw IndexOutOfBoundsException(shard);
+	}
+	return m_shards[shard]->tree->GetStatistics();
+}
+
+template <typename T>
+size_t ShardedBTree<T>::GetDataCount() const
+{
+	size_t count = 0;
+	for (auto& shard : m_shards) {
+		count += shard->tree->GetStatistics().data;
+	}
+	return count;
+}
+
+template <typename T>
+void ShardedBTree<T>::CheckSplits(size_t shards) const
+{
+	if (shards == 0) {
+		throw IllegalArgumentException("ShardedBTree: No storage.");
+	}
+	if (!m_splits.empty() && m_splits.size() + 1 != shards) {
+		throw IllegalArgumentException("ShardedBTree: Need one split key less than storages.");
+	}
+	for (size_t i = 1; i < m_splits.size(); ++i) {
+		if (!(m_splits[i - 1] < m_splits[i])) {
+			throw IllegalArgumentException("ShardedBTree: Split keys must be ascending.");
+		}
+	}
+}
+
+template <typename T>
+Data<T> ShardedBTree<T>::MakeData(const T& key, const byte* data, size_t len)
+{
+	Value value = std::make_shared<std::vector<byte>>(data, data + len);
+	Data<T> result(storage::NEW_PAGE, key, value->data(), value->size());
+	result.holder = value;
+	return result;
+}
+
+}
+}
+
+#endif // _PLAYDB_BTREE_SHARDED_BTREE_INL_
@@ -0,0 +1,86 @@
+#ifndef _PLAYDB_BTREE_VALUE_CACHE_H_
+#define _PLAYDB_BTREE_VALUE_CACHE_H_
+
+#include "playdb/typedef.h"
+#include "playdb/btree/tools.h"
+#include "playdb/btree/FrequencySketch.h"
+#include "playdb/btree/BloomFilter.h"
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+
+namespace playdb
+{
+namespace btree
+{
+
+// Key to value cache of Query results, bounded in bytes. LRU order with
+// TinyLFU admission: once full, a new key only gets in when the sketch has
+// seen it more often than the entry it would push out, so one-off scans
+// don't flush the hot set.
+template <typename T>
+class ValueCache
+{
+public:
+	ValueCache(size_t capacity);
+
+	// counts the access, hit or miss
+	bool Find(const T& key, Data<T>& result);
+
+	// offers a value read from the tree
+	void Admit(const Data<T>& data);
+
+	void Erase(const T& key);
+
+	size_t GetCapacity() const { return m_capacity; }
+	size_t GetSize() const { return m_size; }
+
+private:
+	struct Value
+	{
+		id_type id;
+		std::vector<byte> data;
+	};
+
+	struct Entry
+	{
+		std::shared_ptr<Value> value;
+		typename std::list<T>::iterator lru;
+		size_t size;
+	};
+
+	// the sketch's hash, so any key type bloom_hash knows will do
+	struct KeyHash
+	{
+		size_t operator () (const T& key) const {
+			return static_cast<size_t>(bloom_hash(key));
+		}
+	};
+
+	static size_t GetEntrySize(const T& key, size_t data_len);
+
+	void Evict();
+
+private:
+	// map node, list node and value header that come with every entry
+	static const size_t ENTRY_OVERHEAD = 96;
+
+	size_t m_capacity;
+	size_t m_size;
+
+	// most recent at front
+	std::list<T> m_lru;
+	std::unordered_map<T, Entry, KeyHash> m_map;
+
+	FrequencySketch m_sketch;
+
+}; // ValueCache
+
+}
+}
+
+#include "playdb/btree/ValueCache.inl"
+
+#endif // _PLAYDB_BTREE_VALUE_CACHE_H_
@@ -0,0 +1,112 @@
+#ifndef _PLAYDB_BTREE_VALUE_CACHE_INL_
+#define _PLAYDB_BTREE_VALUE_CACHE_INL_
+
+#include "playdb/btree/BloomFilter.h"
+
+namespace playdb
+{
+namespace btree
+{
+
+template <typename T>
+ValueCache<T>::ValueCache(size_t capacity)
+	: m_capacity(capacity)
+	, m_size(0)
+	, m_sketch(capacity / 64)
+{
+}
+
+template <typename T>
+bool ValueCache<T>::Find(const T& key, Data<T>& result)
+{
+	m_sketch.Increment(bloom_hash(key));
+
+	auto itr = m_map.find(key);
+	if (itr == m_map.end()) {
+		return false;
+	}
+
+	Entry& e = itr->second;
+	m_lru.splice(m_lru.begin(), m_lru, e.lru);
+
+	result = Data<T>(e.value->id, key, e.value->data.data(), e.value->data.size());
+	result.holder = e.value;
+	return true;
+}
+
+template <typename T>
+void ValueCache<T>::Admit(const Data<T>& data)
+{
+	size_t size = GetEntrySize(data.key, data.data_len);
+	if (size > m_capacity || m_map.find(data.key) != m_map.end()) {
+		return;
+	}
+
+	// the candidate has to beat every entry it would replace
+	if (m_size + size > m_capacity)
+	{
+		size_t freq = m_sketch.Frequency(bloom_hash(data.key));
+		size_t freed = 0;
+		for (auto itr = m_lru.rbegin(); itr != m_lru.rend() && m_size - freed + size > m_capacity; ++itr)
+		{
+			if (m_sketch.Frequency(bloom_hash(*itr)) >= freq) {
+				return;
+			}
+			freed += m_map.find(*itr)->second.size;
+		}
+		while (m_size + size > m_capacity) {
+			Evict();
+		}
+	}
+
+	auto value = std::make_shared<Value>();
+	value->id = data.id;
+	value->data.assign(data.data, data.data + data.data_len);
+
+	m_lru.push_front(data.key);
+
+	Entry e;
+	e.value = value;
+	e.lru = m_lru.begin();
+	e.size = size;
+	m_map.insert(std::make_pair(data.key, e));
+
+	m_size += size;
+}
+
+template <typename T>
+void ValueCache<T>::Erase(const T& key)
+{
+	auto itr = m_map.find(key);
+	if (itr == m_map.end()) {
+		return;
+	}
+
+	m_size -= itr->second.size;
+	m_lru.erase(itr->second.lru);
+	m_map.erase(itr);
+}
+
+template <typename T>
+size_t ValueCache<T>::GetEntrySize(const T& key, size_t data_len)
+{
+	return sizeof(T) + data_len + ENTRY_OVERHEAD;
+}
+
+template <>
+inline size_t ValueCache<std::string>::GetEntrySize(const std::string& key, size_t data_len)
+{
+	return sizeof(std::string) + key.size() + data_len + ENTRY_OVERHEAD;
+}
+
+template <typename T>
+void ValueCache<T>::Evict()
+{
+	T key = m_lru.back();
+	Erase(key);
+}
+
+}
+}
+
+#endif // _PLAYDB_BTREE_VALUE_CACHE_INL_
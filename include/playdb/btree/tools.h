@@ -3,6 +3,8 @@
 
 #include "playdb.h"
 
+#include <memory>
+
 namespace playdb
 {
 namespace btree
@@ -25,6 +27,9 @@ public:
 	byte*   data;
 	size_t  data_len;
 
+	// keeps the memory behind data alive, set by BTree::Query
+	std::shared_ptr<const void> holder;
+
 }; // Data
 
 }
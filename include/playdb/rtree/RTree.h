@@ -0,0 +1,101 @@
+#ifndef _PLAYDB_RTREE_RTREE_H_
+#define _PLAYDB_RTREE_RTREE_H_
+
+#include "playdb/typedef.h"
+#include "playdb/rtree/RTreeNode.h"
+#include "playdb/rtree/tools.h"
+
+#include <vector>
+
+namespace playdb
+{
+namespace rtree
+{
+
+// R*-tree over Dim dimensional boxes, records are (mbr, id, bytes).
+template <size_t Dim>
+class RTree
+{
+public:
+	// capacity: max entries of a node, fill_factor: min entries = capacity * fill_factor
+	RTree(IStorageManager* storage_mgr, size_t capacity, double fill_factor = 0.4);
+	RTree(IStorageManager* storage_mgr);
+	~RTree();
+
+	void InsertData(const Region<Dim>& mbr, id_type id, size_t len, const byte* data);
+	bool DeleteData(const Region<Dim>& mbr, id_type id);
+
+	// Sort-Tile-Recursive packing of an empty tree, nodes are filled to
+	// capacity * fill_factor. Leaves the entries moved from.
+	void BulkLoad(std::vector<Entry<Dim>>& entries, double fill_factor = 1.0);
+
+	void IntersectsWithQuery(const Region<Dim>& query, IVisitor& visitor);
+	void RadiusQuery(const double* center, double radius, IVisitor& visitor);
+	// visits the k records closest to point, nearest first
+	void NearestNeighborQuery(size_t k, const double* point, IVisitor& visitor);
+
+	size_t GetDataCount() const { return m_stats.data; }
+
+private:
+	void InsertEntry(Entry<Dim>&& e, size_t level);
+	void Insert(const NodePtr<Dim>& node, Entry<Dim>&& e, size_t level, NodePtr<Dim>& sibling);
+
+	size_t ChooseSubtree(const RTreeNode<Dim>& node, const Region<Dim>& mbr) const;
+
+	void OverflowTreatment(const NodePtr<Dim>& node, NodePtr<Dim>& sibling);
+	void Reinsert(RTreeNode<Dim>& node);
+	NodePtr<Dim> Split(RTreeNode<Dim>& node);
+
+	bool Delete(const NodePtr<Dim>& node, const Region<Dim>& mbr, id_type id,
+		std::vector<std::pair<Entry<Dim>, size_t>>& orphans);
+	void CollectData(id_type id, std::vector<Entry<Dim>>& data);
+
+	void Tile(std::vector<Entry<Dim>>& entries, size_t begin, size_t end, size_t dim,
+		size_t per_node, std::vector<size_t>& cuts) const;
+
+	id_type WriteNode(RTreeNode<Dim>& node);
+	NodePtr<Dim> ReadNode(id_type id);
+	void DeleteNode(const RTreeNode<Dim>& node);
+
+	void StoreHeader();
+	void LoadHeader();
+
+private:
+	struct Statistics
+	{
+		size_t reads;
+		size_t writes;
+		size_t splits;
+		size_t adjustments;
+
+		size_t nodes;
+		size_t data;
+	};
+
+private:
+	IStorageManager* m_storage_mgr;
+
+	id_type m_root_id;
+	id_type m_header_id;
+
+	size_t m_capacity;
+	size_t m_min_entries;
+
+	mutable Statistics m_stats;
+
+	std::vector<byte> m_write_buf;
+
+	// R* forced reinsert runs once per level for every inserted record
+	std::vector<bool> m_reinserted;
+	std::vector<std::pair<Entry<Dim>, size_t>> m_pending;
+
+	friend class RTreeNode<Dim>;
+
+}; // RTree
+
+}
+}
+
+#include "playdb/rtree/RTree.inl"
+
+#endif // _PLAYDB_RTREE_RTREE_H_
@@ -0,0 +1,742 @@
+#ifndef _PLAYDB_RTREE_RTREE_INL_
+#define _PLAYDB_RTREE_RTREE_INL_
+
+#include "playdb.h"
+#include "playdb/rtree/RTree.h"
+#include "playdb/storage/tools.h"
+#include "playdb/Exception.h"
+
+#include <iostream>
+#include <algorithm>
+#include <queue>
+#include <stack>
+
+#include <math.h>
+
+namespace playdb
+{
+namespace rtree
+{
+
+template <size_t Dim>
+RTree<Dim>::RTree(IStorageManager* storage_mgr, size_t capacity, double fill_factor)
+	: m_storage_mgr(storage_mgr)
+	, m_root_id(storage::NEW_PAGE)
+	, m_header_id(storage::NEW_PAGE)
+	, m_capacity(capacity)
+	, m_min_entries(static_cast<size_t>(capacity * fill_factor))
+	, m_stats()
+{
+	if (m_capacity < 4) {
+		throw IllegalArgumentException("RTree: capacity must be at least 4.");
+	}
+	if (m_min_entries < 2 || m_min_entries > m_capacity / 2) {
+		throw IllegalArgumentException("RTree: fill factor must leave 2 to capacity / 2 entries.");
+	}
+
+	StoreHeader();
+
+	RTreeNode<Dim> root(this, storage::NEW_PAGE, 0);
+	m_root_id = WriteNode(root);
+}
+
+template <size_t Dim>
+RTree<Dim>::RTree(IStorageManager* storage_mgr)
+	: m_storage_mgr(storage_mgr)
+	, m_root_id(storage::NEW_PAGE)
+	, m_header_id(0)
+	, m_capacity(0)
+	, m_min_entries(0)
+	, m_stats()
+{
+	LoadHeader();
+}
+
+template <size_t Dim>
+RTree<Dim>::~RTree()
+{
+	StoreHeader();
+}
+
+template <size_t Dim>
+void RTree<Dim>::InsertData(const Region<Dim>& mbr, id_type id, size_t len, const byte* data)
+{
+	m_reinserted.assign(ReadNode(m_root_id)->m_level + 1, false);
+
+	InsertEntry(Entry<Dim>(mbr, id, len, data), 0);
+	while (!m_pending.empty())
+	{
+		auto p = std::move(m_pending.back());
+		m_pending.pop_back();
+		InsertEntry(std::move(p.first), p.second);
+	}
+
+	m_stats.data++;
+}
+
+template <size_t Dim>
+bool RTree<Dim>::DeleteData(const Region<Dim>& mbr, id_type id)
+{
+	NodePtr<Dim> root = ReadNode(m_root_id);
+
+	std::vector<std::pair<Entry<Dim>, size_t>> orphans;
+	if (!Delete(root, mbr, id, orphans)) {
+		return false;
+	}
+	m_stats.data--;
+
+	// every child underflowed, start over from a leaf
+	if (!root->IsLeaf() && root->m_entries.empty()) {
+		root->m_level = 0;
+		WriteNode(*root);
+	}
+
+	// condense, orphans from levels above the current root are flattened
+	std::sort(orphans.begin(), orphans.end(),
+		[](const std::pair<Entry<Dim>, size_t>& a, const std::pair<Entry<Dim>, size_t>& b) {
+			return a.second > b.second;
+		});
+	for (auto& o : orphans)
+	{
+		size_t root_level = ReadNode(m_root_id)->m_level;
+		m_reinserted.assign(root_level + 1, false);
+
+		if (o.second <= root_level)
+		{
+			InsertEntry(std::move(o.first), o.second);
+		}
+		else
+		{
+			std::vector<Entry<Dim>> data;
+			CollectData(o.first.id, data);
+			for (auto& e : data) {
+				InsertEntry(std::move(e), 0);
+			}
+		}
+
+		while (!m_pending.empty())
+		{
+			auto p = std::move(m_pending.back());
+			m_pending.pop_back();
+			InsertEntry(std::move(p.first), p.second);
+		}
+	}
+
+	// shorten the tree
+	root = ReadNode(m_root_id);
+	while (!root->IsLeaf() && root->m_entries.size() == 1)
+	{
+		id_type child = root->m_entries[0].id;
+		DeleteNode(*root);
+		m_root_id = child;
+		root = ReadNode(child);
+	}
+
+	return true;
+}
+
+template <size_t Dim>
+void RTree<Dim>::BulkLoad(std::vector<Entry<Dim>>& entries, double fill_factor)
+{
+	NodePtr<Dim> root = ReadNode(m_root_id);
+	if (!root->IsLeaf() || !root->m_entries.empty()) {
+		throw IllegalStateException("RTree::BulkLoad: tree is not empty.");
+	}
+	if (entries.empty()) {
+		return;
+	}
+
+	size_t per_node = static_cast<size_t>(m_capacity * fill_factor);
+	if (per_node < 2) {
+		per_node = 2;
+	} else if (per_node > m_capacity) {
+		per_node = m_capacity;
+	}
+
+	m_stats.data += entries.size();
+
+	DeleteNode(*root);
+
+	// pack one level at a time, the nodes of a level are the entries of the next
+	std::vector<Entry<Dim>> level_entries = std::move(entries);
+	entries.clear();
+	for (size_t level = 0; ; ++level)
+	{
+		std::vector<size_t> cuts;
+		Tile(level_entries, 0, level_entries.size(), 0, per_node, cuts);
+
+		std::vector<Entry<Dim>> parents;
+		size_t begin = 0;
+		for (auto end : cuts)
+		{
+			RTreeNode<Dim> node(this, storage::NEW_PAGE, level);
+			for (size_t i = begin; i < end; ++i) {
+				node.AddEntry(std::move(level_entries[i]));
+			}
+			WriteNode(node);
+			parents.push_back(Entry<Dim>(node.GetMBR(), node.m_id));
+			begin = end;
+		}
+
+		if (parents.size() == 1) {
+			m_root_id = parents[0].id;
+			break;
+		}
+		level_entries = std::move(parents);
+	}
+}
+
+template <size_t Dim>
+void RTree<Dim>::IntersectsWithQuery(const Region<Dim>& query, IVisitor& visitor)
+{
+	std::stack<id_type> st;
+	st.push(m_root_id);
+	while (!st.empty())
+	{
+		NodePtr<Dim> n = ReadNode(st.top()); st.pop();
+		visitor.VisitNode(*n);
+		for (auto& e : n->m_entries)
+		{
+			if (!e.mbr.Intersects(query)) {
+				continue;
+			}
+			if (n->IsLeaf()) {
+				Data<Dim> d(e.id, e.mbr, e.data.data(), e.data.size());
+				d.holder = n;
+				visitor.VisitData(d);
+			} else {
+				st.push(e.id);
+			}
+		}
+	}
+}
+
+template <size_t Dim>
+void RTree<Dim>::RadiusQuery(const double* center, double radius, IVisitor& visitor)
+{
+	double r2 = radius * radius;
+
+	std::stack<id_type> st;
+	st.push(m_root_id);
+	while (!st.empty())
+	{
+		NodePtr<Dim> n = ReadNode(st.top()); st.pop();
+		visitor.VisitNode(*n);
+		for (auto& e : n->m_entries)
+		{
+			if (e.mbr.MinDist2(center) > r2) {
+				continue;
+			}
+			if (n->IsLeaf()) {
+				Data<Dim> d(e.id, e.mbr, e.data.data(), e.data.size());
+				d.holder = n;
+				visitor.VisitData(d);
+			} else {
+				st.push(e.id);
+			}
+		}
+	}
+}
+
+template <size_t Dim>
+void RTree<Dim>::NearestNeighborQuery(size_t k, const double* point, IVisitor& visitor)
+{
+	// best first, a subtree is opened only when nothing closer is left
+	struct Candidate
+	{
+		double dist;
+		id_type id;
+		NodePtr<Dim> leaf; // set for records
+		size_t idx;
+
+		bool operator < (const Candidate& c) const {
+			if (dist != c.dist) {
+				return dist > c.dist;
+			}
+			return !leaf && c.leaf;
+		}
+	};
+
+	std::priority_queue<Candidate> queue;
+	queue.push(Candidate{ 0, m_root_id, nullptr, 0 });
+
+	size_t found = 0;
+	while (!queue.empty() && found < k)
+	{
+		Candidate c = queue.top(); queue.pop();
+		if (c.leaf)
+		{
+			auto& e = c.leaf->m_entries[c.idx];
+			Data<Dim> d(e.id, e.mbr, e.data.data(), e.data.size());
+			d.holder = c.leaf;
+			visitor.VisitData(d);
+			++found;
+			continue;
+		}
+
+		NodePtr<Dim> n = ReadNode(c.id);
+		visitor.VisitNode(*n);
+		for (size_t i = 0, m = n->m_entries.size(); i < m; ++i)
+		{
+			auto& e = n->m_entries[i];
+			double dist = e.mbr.MinDist2(point);
+			if (n->IsLeaf()) {
+				queue.push(Candidate{ dist, e.id, n, i });
+			} else {
+				queue.push(Candidate{ dist, e.id, nullptr, 0 });
+			}
+		}
+	}
+}
+
+template <size_t Dim>
+void RTree<Dim>::InsertEntry(Entry<Dim>&& e, size_t level)
+{
+	NodePtr<Dim> root = ReadNode(m_root_id);
+
+	NodePtr<Dim> sibling;
+	Insert(root, std::move(e), level, sibling);
+	if (!sibling) {
+		return;
+	}
+
+	// root split, grow the tree
+	RTreeNode<Dim> new_root(this, storage::NEW_PAGE, root->m_level + 1);
+	new_root.AddEntry(Entry<Dim>(root->GetMBR(), root->m_id));
+	new_root.AddEntry(Entry<Dim>(sibling->GetMBR(), sibling->m_id));
+	m_root_id = WriteNode(new_root);
+}
+
+template <size_t Dim>
+void RTree<Dim>::Insert(const NodePtr<Dim>& node, Entry<Dim>&& e, size_t level, NodePtr<Dim>& sibling)
+{
+	if (node->m_level == level)
+	{
+		node->AddEntry(std::move(e));
+	}
+	else
+	{
+		size_t i = ChooseSubtree(*node, e.mbr);
+		NodePtr<Dim> child = ReadNode(node->m_entries[i].id);
+
+		NodePtr<Dim> child_sibling;
+		Insert(child, std::move(e), level, child_sibling);
+
+		node->m_entries[i].mbr = child->GetMBR();
+		if (child_sibling) {
+			node->AddEntry(Entry<Dim>(child_sibling->GetMBR(), child_sibling->m_id));
+		}
+	}
+
+	if (node->m_entries.size() > m_capacity) {
+		OverflowTreatment(node, sibling);
+	}
+
+	WriteNode(*node);
+}
+
+template <size_t Dim>
+size_t RTree<Dim>::ChooseSubtree(const RTreeNode<Dim>& node, const Region<Dim>& mbr) const
+{
+	auto& entries = node.m_entries;
+
+	size_t best = 0;
+	double best_overlap = 0, best_enlarge = 0, best_area = 0;
+	for (size_t i = 0, n = entries.size(); i < n; ++i)
+	{
+		Region<Dim> enlarged = entries[i].mbr.Union(mbr);
+		double area = entries[i].mbr.Area();
+		double enlarge = enlarged.Area() - area;
+
+		// children are leaves: least overlap enlargement first
+		double overlap = 0;
+		if (node.m_level == 1)
+		{
+			for (size_t j = 0; j < n; ++j) {
+				if (j != i) {
+					overlap += enlarged.OverlapArea(entries[j].mbr)
+					         - entries[i].mbr.OverlapArea(entries[j].mbr);
+				}
+			}
+		}
+
+		if (i == 0
+		 || overlap < best_overlap
+		 || (overlap == best_overlap && enlarge < best_enlarge)
+		 || (overlap == best_overlap && enlarge == best_enlarge && area < best_area)) {
+			best = i;
+			best_overlap = overlap;
+			best_enlarge = enlarge;
+			best_area = area;
+		}
+	}
+	return best;
+}
+
+template <size_t Dim>
+void RTree<Dim>::OverflowTreatment(const NodePtr<Dim>& node, NodePtr<Dim>& sibling)
+{
+	size_t level = node->m_level;
+	if (node->m_id != m_root_id && level < m_reinserted.size() && !m_reinserted[level]) {
+		m_reinserted[level] = true;
+		Reinsert(*node);
+	} else {
+		sibling = Split(*node);
+	}
+}
+
+template <size_t Dim>
+void RTree<Dim>::Reinsert(RTreeNode<Dim>& node)
+{
+	Region<Dim> mbr = node.GetMBR();
+
+	auto& entries = node.m_entries;
+	std::vector<std::pair<double, size_t>> dist;
+	dist.reserve(entries.size());
+	for (size_t i = 0, n = entries.size(); i < n; ++i)
+	{
+		double d2 = 0;
+		for (size_t d = 0; d < Dim; ++d) {
+			double diff = entries[i].mbr.Center(d) - mbr.Center(d);
+			d2 += diff * diff;
+		}
+		dist.push_back(std::make_pair(d2, i));
+	}
+	std::sort(dist.begin(), dist.end(),
+		[](const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) {
+			return a.first > b.first;
+		});
+
+	// the 30% farthest from the center go back through the top,
+	// m_pending is popped from the back so the closest is reinserted first
+	size_t p = entries.size() * 3 / 10;
+	if (p == 0) {
+		p = 1;
+	}
+
+	std::vector<bool> out(entries.size(), false);
+	for (size_t i = 0; i < p; ++i) {
+		out[dist[i].second] = true;
+	}
+
+	std::vector<Entry<Dim>> all = std::move(entries);
+	node.ClearEntries();
+	for (size_t i = 0, n = all.size(); i < n; ++i) {
+		if (!out[i]) {
+			node.AddEntry(std::move(all[i]));
+		}
+	}
+	for (size_t i = 0; i < p; ++i) {
+		m_pending.push_back(std::make_pair(std::move(all[dist[i].second]), node.m_level));
+	}
+
+	m_stats.adjustments++;
+}
+
+template <size_t Dim>
+NodePtr<Dim> RTree<Dim>::Split(RTreeNode<Dim>& node)
+{
+	std::vector<Entry<Dim>> entries = std::move(node.m_entries);
+	node.ClearEntries();
+
+	const size_t total = entries.size();
+	const size_t m = m_min_entries;
+
+	// R*: on every axis sort by lower then upper bound and try all the
+	// distributions, pick the axis with the least margin sum, then the
+	// distribution on it with the least overlap, then the least area
+	std::vector<size_t> order(total);
+	std::vector<Region<Dim>> prefix(total), suffix(total);
+	auto sweep = [&](size_t axis, bool by_high) {
+		for (size_t i = 0; i < total; ++i) {
+			order[i] = i;
+		}
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			const Region<Dim>& ra = entries[a].mbr;
+			const Region<Dim>& rb = entries[b].mbr;
+			return by_high ? ra.m_high[axis] < rb.m_high[axis] : ra.m_low[axis] < rb.m_low[axis];
+		});
+		Region<Dim> acc;
+		for (size_t i = 0; i < total; ++i) {
+			acc.Combine(entries[order[i]].mbr);
+			prefix[i] = acc;
+		}
+		acc = Region<Dim>();
+		for (size_t i = total; i > 0; --i) {
+			acc.Combine(entries[order[i - 1]].mbr);
+			suffix[i - 1] = acc;
+		}
+	};
+
+	size_t best_axis = 0;
+	double best_margin = 0;
+	for (size_t axis = 0; axis < Dim; ++axis)
+	{
+		double margin = 0;
+		for (int by_high = 0; by_high < 2; ++by_high)
+		{
+			sweep(axis, by_high != 0);
+			for (size_t k = m; k <= total - m; ++k) {
+				margin += prefix[k - 1].Margin() + suffix[k].Margin();
+			}
+		}
+		if (axis == 0 || margin < best_margin) {
+			best_axis = axis;
+			best_margin = margin;
+		}
+	}
+
+	bool best_by_high = false;
+	size_t best_k = m;
+	double best_overlap = 0, best_area = 0;
+	bool first = true;
+	for (int by_high = 0; by_high < 2; ++by_high)
+	{
+		sweep(best_axis, by_high != 0);
+		for (size_t k = m; k <= total - m; ++k)
+		{
+			double overlap = prefix[k - 1].OverlapArea(suffix[k]);
+			double area = prefix[k - 1].Area() + suffix[k].Area();
+			if (first || overlap < best_overlap || (overlap == best_overlap && area < best_area)) {
+				first = false;
+				best_by_high = by_high != 0;
+				best_k = k;
+				best_overlap = overlap;
+				best_area = area;
+			}
+		}
+	}
+
+	sweep(best_axis, best_by_high);
+
+	auto sibling = std::make_shared<RTreeNode<Dim>>(this, storage::NEW_PAGE, node.m_level);
+	for (size_t i = 0; i < total; ++i) {
+		if (i < best_k) {
+			node.AddEntry(std::move(entries[order[i]]));
+		} else {
+			sibling->AddEntry(std::move(entries[order[i]]));
+		}
+	}
+	WriteNode(*sibling);
+
+	m_stats.splits++;
+
+	return sibling;
+}
+
+template <size_t Dim>
+bool RTree<Dim>::Delete(const NodePtr<Dim>& node, const Region<Dim>& mbr, id_type id,
+	                    std::vector<std::pair<Entry<Dim>, size_t>>& orphans)
+{
+	auto& entries = node->m_entries;
+	if (node->IsLeaf())
+	{
+		for (size_t i = 0, n = entries.size(); i < n; ++i) {
+			if (entries[i].id == id && entries[i].mbr == mbr) {
+				node->RemoveEntry(i);
+				WriteNode(*node);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	for (size_t i = 0, n = entries.size(); i < n; ++i)
+	{
+		if (!entries[i].mbr.Contains(mbr)) {
+			continue;
+		}
+
+		NodePtr<Dim> child = ReadNode(entries[i].id);
+		if (!Delete(child, mbr, id, orphans)) {
+			continue;
+		}
+
+		if (child->m_entries.size() < m_min_entries)
+		{
+			for (auto& e : child->m_entries) {
+				orphans.push_back(std::make_pair(std::move(e), child->m_level));
+			}
+			DeleteNode(*child);
+			node->RemoveEntry(i);
+		}
+		else
+		{
+			entries[i].mbr = child->GetMBR();
+		}
+		WriteNode(*node);
+		return true;
+	}
+	return false;
+}
+
+template <size_t Dim>
+void RTree<Dim>::CollectData(id_type id, std::vector<Entry<Dim>>& data)
+{
+	NodePtr<Dim> node = ReadNode(id);
+	for (auto& e : node->m_entries) {
+		if (node->IsLeaf()) {
+			data.push_back(std::move(e));
+		} else {
+			CollectData(e.id, data);
+		}
+	}
+	DeleteNode(*node);
+}
+
+template <size_t Dim>
+void RTree<Dim>::Tile(std::vector<Entry<Dim>>& entries, size_t begin, size_t end, size_t dim,
+	                  size_t per_node, std::vector<size_t>& cuts) const
+{
+	std::sort(entries.begin() + begin, entries.begin() + end,
+		[dim](const Entry<Dim>& a, const Entry<Dim>& b) {
+			return a.mbr.Center(dim) < b.mbr.Center(dim);
+		});
+
+	size_t n = end - begin;
+	if (dim == Dim - 1)
+	{
+		for (size_t i = begin; i < end; i += per_node) {
+			cuts.push_back(std::min(i + per_node, end));
+		}
+		return;
+	}
+
+	// S = ceil(P ^ (1 / remaining dims)) slabs along this dimension
+	size_t pages = (n + per_node - 1) / per_node;
+	size_t slices = static_cast<size_t>(ceil(pow(static_cast<double>(pages), 1.0 / (Dim - dim))));
+	size_t slab = per_node * ((pages + slices - 1) / slices);
+	for (size_t i = begin; i < end; i += slab) {
+		Tile(entries, i, std::min(i + slab, end), dim + 1, per_node, cuts);
+	}
+}
+
+template <size_t Dim>
+id_type RTree<Dim>::WriteNode(RTreeNode<Dim>& node)
+{
+	size_t len = node.GetByteArraySize();
+	if (m_write_buf.size() < len) {
+		m_write_buf.resize(len);
+	}
+	byte* buf = m_write_buf.data();
+	node.StoreToBuffer(buf);
+
+	id_type page;
+	if (node.m_id < 0) {
+		page = storage::NEW_PAGE;
+	} else {
+		page = node.m_id;
+	}
+
+	try {
+		m_storage_mgr->StoreByteArray(page, len, buf);
+	} catch (InvalidPageException& e) {
+		std::cerr << e.what() << std::endl;
+		throw IllegalStateException("WriteNode: failed with InvalidPageException");
+	}
+
+	if (node.m_id < 0)
+	{
+		node.m_id = page;
+		m_stats.nodes++;
+	}
+
+	m_stats.writes++;
+
+	return page;
+}
+
+template <size_t Dim>
+NodePtr<Dim> RTree<Dim>::ReadNode(id_type id)
+{
+	size_t len;
+	byte* buf = nullptr;
+	const byte* borrowed = nullptr;
+
+	try {
+		borrowed = m_storage_mgr->BorrowByteArray(id, len);
+		if (!borrowed) {
+			m_storage_mgr->LoadByteArray(id, len, &buf);
+		}
+	} catch (InvalidPageException& e) {
+		std::cerr << e.what() << std::endl;
+		throw playdb::IllegalStateException("ReadNode: failed with InvalidPageException");
+	}
+
+	auto node = std::make_shared<RTreeNode<Dim>>(this, id, 0);
+	node->LoadFromByteArray(borrowed ? borrowed : buf);
+
+	m_stats.reads++;
+
+	delete[] buf;
+	return node;
+}
+
+template <size_t Dim>
+void RTree<Dim>::DeleteNode(const RTreeNode<Dim>& node)
+{
+	try {
+		m_storage_mgr->DeleteByteArray(node.m_id);
+	} catch (InvalidPageException& e) {
+		std::cerr << e.what() << std::endl;
+		throw IllegalStateException("DeleteNode: failed with InvalidPageException");
+	}
+
+	m_stats.nodes--;
+}
+
+template <size_t Dim>
+void RTree<Dim>::StoreHeader()
+{
+	size_t sz = 0;
+	sz += sizeof(id_type);		// m_root_id
+	sz += sizeof(uint64_t);		// Dim
+	sz += sizeof(uint64_t);		// m_capacity
+	sz += sizeof(uint64_t);		// m_min_entries
+	sz += sizeof(uint64_t);		// m_stats.data
+
+	byte* data = new byte[sz];
+	byte* ptr = data;
+
+	storage::pack(m_root_id, &ptr);
+	storage::pack(static_cast<uint64_t>(Dim), &ptr);
+	storage::pack(static_cast<uint64_t>(m_capacity), &ptr);
+	storage::pack(static_cast<uint64_t>(m_min_entries), &ptr);
+	storage::pack(static_cast<uint64_t>(m_stats.data), &ptr);
+
+	m_storage_mgr->StoreByteArray(m_header_id, sz, data);
+
+	delete[] data;
+}
+
+template <size_t Dim>
+void RTree<Dim>::LoadHeader()
+{
+	size_t len;
+	byte* data = 0;
+	m_storage_mgr->LoadByteArray(m_header_id, len, &data);
+
+	byte* ptr = data;
+
+	uint64_t dim, capacity, min_entries, count;
+	storage::unpack(m_root_id, &ptr);
+	storage::unpack(dim, &ptr);
+	storage::unpack(capacity, &ptr);
+	storage::unpack(min_entries, &ptr);
+	storage::unpack(count, &ptr);
+
+	delete[] data;
+
+	m_capacity = static_cast<size_t>(capacity);
+	m_min_entries = static_cast<size_t>(min_entries);
+	m_stats.data = static_cast<size_t>(count);
+
+	if (dim != Dim) {
+		throw IllegalStateException("RTree: dimension of the stored tree doesn't match.");
+	}
+}
+
+}
+}
+
+#endif // _PLAYDB_RTREE_RTREE_INL_
@@ -0,0 +1,98 @@
+#ifndef _PLAYDB_RTREE_RTREE_NODE_H_
+#define _PLAYDB_RTREE_RTREE_NODE_H_
+
+#include "playdb.h"
+#include "playdb/typedef.h"
+#include "playdb/rtree/tools.h"
+
+#include <vector>
+#include <memory>
+
+namespace playdb
+{
+namespace rtree
+{
+
+template <size_t Dim>
+class RTreeNode;
+
+template <size_t Dim>
+using NodePtr = std::shared_ptr<RTreeNode<Dim>>;
+
+template <size_t Dim>
+class RTree;
+
+// A child pointer in internal nodes, a data record in leaves.
+template <size_t Dim>
+struct Entry
+{
+	Region<Dim> mbr;
+	id_type id;
+	std::vector<byte> data;
+
+	Entry() : id(storage::NEW_PAGE) {}
+	Entry(const Region<Dim>& mbr, id_type id)
+		: mbr(mbr), id(id) {}
+	Entry(const Region<Dim>& mbr, id_type id, size_t len, const byte* data)
+		: mbr(mbr), id(id), data(data, data + len) {}
+
+}; // Entry
+
+template <size_t Dim>
+class RTreeNode : public INode
+{
+public:
+	RTreeNode(RTree<Dim>* tree, id_type id, size_t level);
+	RTreeNode(const RTreeNode&) = delete;
+	RTreeNode& operator = (const RTreeNode&) = delete;
+
+	//
+	// ISerializable interface
+	//
+	virtual size_t GetByteArraySize() const override;
+	virtual void LoadFromByteArray(const byte* data) override;
+	virtual void StoreToByteArray(byte** data, size_t& len) const override;
+
+	// writes GetByteArraySize() bytes into a caller-owned buffer
+	void StoreToBuffer(byte* data) const;
+
+	//
+	// INode interface
+	//
+	virtual id_type GetID() const override { return m_id; }
+	virtual bool IsLeaf() const override { return m_level == 0; }
+	virtual size_t GetChildrenCount() const override { return m_entries.size(); }
+
+	size_t GetLevel() const { return m_level; }
+
+	Region<Dim> GetMBR() const;
+
+private:
+	void AddEntry(Entry<Dim>&& e);
+	Entry<Dim> RemoveEntry(size_t idx);
+	void ClearEntries();
+
+	static size_t GetEntryByteArraySize(const Entry<Dim>& e);
+
+private:
+	RTree<Dim>* m_tree;
+
+	id_type m_id;
+
+	// 0 for leaves
+	size_t m_level;
+
+	std::vector<Entry<Dim>> m_entries;
+
+	size_t m_byte_size;
+
+	friend class RTree<Dim>;
+
+}; // RTreeNode
+
+}
+}
+
+#include "playdb/rtree/RTreeNode.inl"
+
+#endif // _PLAYDB_RTREE_RTREE_NODE_H_
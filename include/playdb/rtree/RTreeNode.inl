@@ -0,0 +1,137 @@
+#ifndef _PLAYDB_RTREE_RTREE_NODE_INL_
+#define _PLAYDB_RTREE_RTREE_NODE_INL_
+
+#include "playdb.h"
+#include "playdb/storage/tools.h"
+
+#include <assert.h>
+#include <string.h>
+
+namespace playdb
+{
+namespace rtree
+{
+
+template <size_t Dim>
+RTreeNode<Dim>::RTreeNode(RTree<Dim>* tree, id_type id, size_t level)
+	: m_tree(tree)
+	, m_id(id)
+	, m_level(level)
+	, m_byte_size(0)
+{
+	ClearEntries();
+}
+
+template <size_t Dim>
+size_t RTreeNode<Dim>::GetByteArraySize() const
+{
+	return m_byte_size;
+}
+
+template <size_t Dim>
+void RTreeNode<Dim>::LoadFromByteArray(const byte* data)
+{
+	byte* ptr = const_cast<byte*>(data);
+
+	uint64_t level, n;
+	storage::unpack(level, &ptr);
+	storage::unpack(n, &ptr);
+	m_level = static_cast<size_t>(level);
+	m_entries.resize(static_cast<size_t>(n));
+	for (auto& e : m_entries)
+	{
+		storage::unpack(e.id, &ptr);
+		for (size_t d = 0; d < Dim; ++d) {
+			storage::unpack(e.mbr.m_low[d], &ptr);
+			storage::unpack(e.mbr.m_high[d], &ptr);
+		}
+
+		uint64_t len;
+		storage::unpack(len, &ptr);
+		e.data.assign(ptr, ptr + static_cast<size_t>(len));
+		ptr += len;
+	}
+
+	m_byte_size = ptr - data;
+}
+
+template <size_t Dim>
+void RTreeNode<Dim>::StoreToByteArray(byte** data, size_t& len) const
+{
+	len = GetByteArraySize();
+	*data = new byte[len];
+	StoreToBuffer(*data);
+}
+
+template <size_t Dim>
+void RTreeNode<Dim>::StoreToBuffer(byte* data) const
+{
+	byte* ptr = data;
+
+	storage::pack(static_cast<uint64_t>(m_level), &ptr);
+	storage::pack(static_cast<uint64_t>(m_entries.size()), &ptr);
+	for (auto& e : m_entries)
+	{
+		storage::pack(e.id, &ptr);
+		for (size_t d = 0; d < Dim; ++d) {
+			storage::pack(e.mbr.m_low[d], &ptr);
+			storage::pack(e.mbr.m_high[d], &ptr);
+		}
+
+		size_t len = e.data.size();
+		storage::pack(static_cast<uint64_t>(len), &ptr);
+		if (len > 0) {
+			memcpy(ptr, e.data.data(), len);
+			ptr += len;
+		}
+	}
+
+	assert(static_cast<size_t>(ptr - data) == m_byte_size);
+}
+
+template <size_t Dim>
+Region<Dim> RTreeNode<Dim>::GetMBR() const
+{
+	Region<Dim> mbr;
+	for (auto& e : m_entries) {
+		mbr.Combine(e.mbr);
+	}
+	return mbr;
+}
+
+template <size_t Dim>
+void RTreeNode<Dim>::AddEntry(Entry<Dim>&& e)
+{
+	m_byte_size += GetEntryByteArraySize(e);
+	m_entries.push_back(std::move(e));
+}
+
+template <size_t Dim>
+Entry<Dim> RTreeNode<Dim>::RemoveEntry(size_t idx)
+{
+	Entry<Dim> e = std::move(m_entries[idx]);
+	m_byte_size -= GetEntryByteArraySize(e);
+	if (idx != m_entries.size() - 1) {
+		m_entries[idx] = std::move(m_entries.back());
+	}
+	m_entries.pop_back();
+	return e;
+}
+
+template <size_t Dim>
+void RTreeNode<Dim>::ClearEntries()
+{
+	m_entries.clear();
+	m_byte_size = 2 * sizeof(uint64_t);
+}
+
+template <size_t Dim>
+size_t RTreeNode<Dim>::GetEntryByteArraySize(const Entry<Dim>& e)
+{
+	return sizeof(id_type) + sizeof(double) * 2 * Dim + sizeof(uint64_t) + e.data.size();
+}
+
+}
+}
+
+#endif // _PLAYDB_RTREE_RTREE_NODE_INL_
@@ -0,0 +1,210 @@
+#ifndef _PLAYDB_RTREE_TOOLS_H_
+#define _PLAYDB_RTREE_TOOLS_H_
+
+#include "playdb.h"
+
+#include <limits>
+#include <memory>
+
+namespace playdb
+{
+namespace rtree
+{
+
+template <size_t Dim>
+class Region
+{
+public:
+	// empty, combining with anything gives the other region
+	Region();
+	Region(const double* low, const double* high);
+
+	static Region Point(const double* p);
+
+	bool IsEmpty() const { return m_low[0] > m_high[0]; }
+
+	bool Intersects(const Region& r) const;
+	bool Contains(const Region& r) const;
+	bool operator == (const Region& r) const;
+
+	double Area() const;
+	double Margin() const;
+	double OverlapArea(const Region& r) const;
+
+	void Combine(const Region& r);
+	Region Union(const Region& r) const;
+
+	double Center(size_t d) const { return (m_low[d] + m_high[d]) * 0.5; }
+
+	// squared distance from p to the closest point of the region
+	double MinDist2(const double* p) const;
+
+public:
+	double m_low[Dim];
+	double m_high[Dim];
+
+}; // Region
+
+template <size_t Dim>
+class Data : public IData
+{
+public:
+	Data()
+		: id(storage::NEW_PAGE), data(nullptr), data_len(0)
+	{}
+	Data(id_type id, const Region<Dim>& region, byte* data, size_t data_len)
+		: id(id), region(region), data(data), data_len(data_len)
+	{}
+
+public:
+	id_type     id;
+	Region<Dim> region;
+	byte*       data;
+	size_t      data_len;
+
+	// keeps the memory behind data alive
+	std::shared_ptr<const void> holder;
+
+}; // Data
+
+template <size_t Dim>
+Region<Dim>::Region()
+{
+	for (size_t d = 0; d < Dim; ++d) {
+		m_low[d]  =  std::numeric_limits<double>::max();
+		m_high[d] = -std::numeric_limits<double>::max();
+	}
+}
+
+template <size_t Dim>
+Region<Dim>::Region(const double* low, const double* high)
+{
+	for (size_t d = 0; d < Dim; ++d) {
+		m_low[d]  = low[d];
+		m_high[d] = high[d];
+	}
+}
+
+template <size_t Dim>
+Region<Dim> Region<Dim>::Point(const double* p)
+{
+	return Region<Dim>(p, p);
+}
+
+template <size_t Dim>
+bool Region<Dim>::Intersects(const Region& r) const
+{
+	for (size_t d = 0; d < Dim; ++d) {
+		if (m_low[d] > r.m_high[d] || m_high[d] < r.m_low[d]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template <size_t Dim>
+bool Region<Dim>::Contains(const Region& r) const
+{
+	for (size_t d = 0; d < Dim; ++d) {
+		if (m_low[d] > r.m_low[d] || m_high[d] < r.m_high[d]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template <size_t Dim>
+bool Region<Dim>::operator == (const Region& r) const
+{
+	for (size_t d = 0; d < Dim; ++d) {
+		if (m_low[d] != r.m_low[d] || m_high[d] != r.m_high[d]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template <size_t Dim>
+double Region<Dim>::Area() const
+{
+	if (IsEmpty()) {
+		return 0;
+	}
+	double a = 1;
+	for (size_t d = 0; d < Dim; ++d) {
+		a *= m_high[d] - m_low[d];
+	}
+	return a;
+}
+
+template <size_t Dim>
+double Region<Dim>::Margin() const
+{
+	if (IsEmpty()) {
+		return 0;
+	}
+	double m = 0;
+	for (size_t d = 0; d < Dim; ++d) {
+		m += m_high[d] - m_low[d];
+	}
+	return m;
+}
+
+template <size_t Dim>
+double Region<Dim>::OverlapArea(const Region& r) const
+{
+	double a = 1;
+	for (size_t d = 0; d < Dim; ++d)
+	{
+		double lo = m_low[d] > r.m_low[d] ? m_low[d] : r.m_low[d];
+		double hi = m_high[d] < r.m_high[d] ? m_high[d] : r.m_high[d];
+		if (lo > hi) {
+			return 0;
+		}
+		a *= hi - lo;
+	}
+	return a;
+}
+
+template <size_t Dim>
+void Region<Dim>::Combine(const Region& r)
+{
+	for (size_t d = 0; d < Dim; ++d) {
+		if (r.m_low[d] < m_low[d]) {
+			m_low[d] = r.m_low[d];
+		}
+		if (r.m_high[d] > m_high[d]) {
+			m_high[d] = r.m_high[d];
+		}
+	}
+}
+
+template <size_t Dim>
+Region<Dim> Region<Dim>::Union(const Region& r) const
+{
+	Region<Dim> ret(*this);
+	ret.Combine(r);
+	return ret;
+}
+
+template <size_t Dim>
+double Region<Dim>::MinDist2(const double* p) const
+{
+	double dist = 0;
+	for (size_t d = 0; d < Dim; ++d)
+	{
+		double diff = 0;
+		if (p[d] < m_low[d]) {
+			diff = m_low[d] - p[d];
+		} else if (p[d] > m_high[d]) {
+			diff = p[d] - m_high[d];
+		}
+		dist += diff * diff;
+	}
+	return dist;
+}
+
+}
+}
+
+#endif // _PLAYDB_RTREE_TOOLS_H_
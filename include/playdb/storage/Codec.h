@@ -0,0 +1,36 @@
+#ifndef _PLAYDB_STORAGE_CODEC_H_
+#define _PLAYDB_STORAGE_CODEC_H_
+
+#include "playdb/typedef.h"
+
+namespace playdb
+{
+namespace storage
+{
+
+// Per-file compression of stored entries. LZ is built in, LZ4 and ZSTD
+// need PLAYDB_WITH_LZ4 / PLAYDB_WITH_ZSTD and the matching library.
+enum class Codec : uint8_t
+{
+	NONE = 0,
+	LZ   = 1,
+	LZ4  = 2,
+	ZSTD = 3,
+};
+
+bool codec_available(Codec codec);
+
+// Largest compressed size of len bytes, compress never fails with this cap.
+size_t compress_bound(Codec codec, size_t len);
+
+// Returns the compressed size, or 0 when the output would not fit in cap,
+// in which case the caller keeps the raw bytes.
+size_t compress(Codec codec, const byte* src, size_t len, byte* dst, size_t cap);
+
+// Fills exactly raw_len bytes of dst, throws on corrupted input.
+void decompress(Codec codec, const byte* src, size_t len, byte* dst, size_t raw_len);
+
+}
+}
+
+#endif // _PLAYDB_STORAGE_CODEC_H_
@@ -2,52 +2,240 @@
 #define _PLAYDB_DISK_STORAGE_MANAGER_H_
 
 #include "playdb.h"
+#include "playdb/storage/Codec.h"
+#include "playdb/storage/PageFile.h"
+#include "playdb/storage/PageCache.h"
 
 #include <vector>
 #include <map>
-#include <queue>
-#include <functional>
+#include <set>
+#include <deque>
 #include <fstream>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 namespace playdb
 {
 namespace storage
 {
 
+// cache_size is the byte budget of the in-process page cache, 0 disables
+// it. direct_io bypasses the kernel page cache and needs a page size that
+// is a multiple of PageFile::DIRECT_IO_ALIGNMENT, pair it with a cache.
+// Calls are serialized internally so a background compactor can run
+// alongside the owner.
 class DiskStorageManager : public IStorageManager
 {
 public:
 	DiskStorageManager(const std::string& index_filepath,
-		const std::string& data_filepath, bool overwrite = false, size_t page_size = 0);
+		const std::string& data_filepath, bool overwrite = false, size_t page_size = 0,
+		Codec codec = Codec::NONE, size_t cache_size = 0, bool direct_io = false);
 	virtual ~DiskStorageManager();
 
 	virtual void LoadByteArray(const id_type id, size_t& len, byte** data) override;
 	virtual void StoreByteArray(id_type& id, const size_t len, const byte* const data) override;
 	virtual void DeleteByteArray(const id_type id) override;
 
-	void Flush();
+	// decompresses into a pooled buffer, valid until the next call
+	virtual const byte* BorrowByteArray(const id_type id, size_t& len) override;
+
+	virtual void Prefetch(const id_type* ids, size_t count) override;
+
+	virtual StorageStatistics GetStatistics() const override;
+
+	// Pages read ahead once entries are read in file order, also the bound
+	// on queued prefetches, 0 (the default) turns both off. With a cache a
+	// background thread loads the pages into it, without one the kernel is
+	// asked to.
+	void SetReadAhead(size_t pages);
+
+	virtual void Flush() override;
+
+	// Opening reads a directory of the page index, the index blocks and the
+	// free list are loaded by a background thread, or first by whoever
+	// needs an entry of a block or a free page not loaded yet. This loads
+	// the rest right away.
+	void LoadIndex();
+	bool IsIndexLoaded() const;
+
+	// Compaction moves entries to other pages and keeps their ids, so trees
+	// stored here need no update. Entries listed in order are laid out back
+	// to back from the start of the file in that order, the rest are packed
+	// after them and the free tail is cut off the file. Each step writes
+	// the index before a page it moved away from is reused, so a crash
+	// leaves the file as of the last step.
+	void BeginCompaction(const std::vector<id_type>& order = std::vector<id_type>());
+	// moves at most max_pages pages, 0 once the compaction is done
+	size_t CompactStep(size_t max_pages);
+	bool IsCompacting() const;
+
+	// runs the compaction on a background thread, moving at most
+	// pages_per_second pages
+	void StartCompactor(const std::vector<id_type>& order, size_t pages_per_second);
+	void StopCompactor();
+
+	size_t GetPageCount() const;
+	size_t GetEmptyPageCount() const;
+
+	Codec GetCodec() const { return m_codec; }
 
 private:
 	class Entry
 	{
 	public:
-		size_t m_length;
+		size_t m_length;     // bytes on disk
+		size_t m_raw_length; // bytes before compression
 		std::vector<id_type> m_pages;
 	};
 
+	const Entry& GetEntry(id_type id);
+
+	// Index file. Legacy files, from before the block layout, hold native
+	// size_t fields and 32-bit ids and no codec or raw lengths. They are
+	// read whole and written in the block layout on the next flush. Those
+	// files were written with the two paths swapped, which is undone on
+	// disk when the index turns up in the data file.
+	void ReadLegacyIndex(const std::string& index_filepath,
+		const std::string& data_filepath, bool direct_io);
+	// false if file doesn't hold a legacy index whose pages fit in
+	// pages_size bytes, nothing is changed then
+	bool ParseLegacyIndex(std::fstream& file, uint64_t pages_size);
+	void ReadIndexDirectory();
+	void LoadIndexBlock(size_t block);
+	// makes sure the entry with id is in m_page_index if it exists
+	void EnsureIndex(id_type id);
+	void EnsureFullIndex();
+	void LoadFreeList();
+	void EnsureFreeList();
+	// also counts the free pages not loaded yet
+	size_t FreePageCount() const;
+	void IndexLoaderLoop();
+
+	void ReadEntry(const Entry& entry, byte* dst);
+
+	// queues the pages past a sequential read
+	void ReadAhead(const Entry& entry);
+	void QueuePages(id_type first, id_type end);
+	void PrefetchLoop();
+
+	const byte* Compress(const byte* data, size_t len, size_t& stored_len);
+
+	void ReadPage(id_type page, byte* dst, size_t len);
+	void WritePage(id_type page, const byte* src, size_t len);
+	// an entry's id is its first page unless compaction has left that
+	// taken by a moved entry
+	id_type NewID(id_type first_page);
+
+	id_type AllocPage();
+	void FreePage(id_type page);
+	void SetOwner(id_type page, id_type id);
+	id_type GetOwner(id_type page) const;
+
+	// writes the index to a temporary file and renames it over the old
+	// one, the caller holds the lock
+	void WriteIndex();
+
+	size_t CompactPages(size_t max_pages);
+	// copies page index of entry id to dst, dst must be free or the next
+	// page, the source goes to m_compact_freed
+	void MovePage(id_type id, size_t index, id_type dst);
+	// lowest free page at or above from
+	id_type AllocPageFrom(id_type from);
+	void TruncateTail();
+
+	void CompactorLoop(size_t pages_per_second);
+
 private:
+	std::string  m_index_path;
 	std::fstream m_index_file;
-	std::fstream m_data_file;
+	std::unique_ptr<PageFile> m_data_file;
+
+	std::unique_ptr<PageCache> m_cache;
 
 	size_t  m_page_size;
 	id_type m_next_page;
 
-	std::priority_queue<id_type, std::vector<id_type>, std::greater<id_type>> m_empty_pages;
+	Codec m_codec;
+
+	std::set<id_type> m_empty_pages;
 	std::map<id_type, std::unique_ptr<Entry>> m_page_index;
 
+	// entry id of each page, NEW_PAGE if free or its index block isn't
+	// loaded yet. Kept in chunks allocated on first use, so a file whose
+	// pages start far from 0 costs no memory below them
+	static const size_t OWNER_CHUNK_PAGES = 65536;
+	std::vector<std::unique_ptr<id_type[]>> m_page_owner;
+
+	// index layout: header, free list, block directory, then blocks of
+	// up to INDEX_BLOCK_ENTRIES entries in id order, fixed width fields
+	static const uint32_t INDEX_MAGIC = 0x49424450; // "PDBI"
+	static const uint32_t INDEX_VERSION = 3;
+	static const size_t INDEX_BLOCK_ENTRIES = 4096;
+
+	struct IndexBlock
+	{
+		id_type  first_id;
+		uint64_t offset;
+		uint64_t size;
+		uint64_t count;
+		bool     loaded;
+	};
+	std::vector<IndexBlock> m_index_blocks;
+	size_t m_index_pending;
+
+	// where the free list is in the index file until it is loaded
+	uint64_t m_free_offset;
+	uint64_t m_free_count;
+	bool     m_free_loaded;
+
+	std::thread m_index_loader;
+	bool m_index_loader_stop;
+
+	mutable std::mutex m_mutex;
+
+	StorageStatistics m_stats;
+
+	// compaction state, the ordered entries go to [0, m_compact_region)
+	bool    m_compacting;
+	std::vector<id_type> m_compact_order;
+	size_t  m_compact_cursor;
+	size_t  m_compact_page;
+	id_type m_compact_target;
+	id_type m_compact_region;
+	// moved away from in the current step, free once the index is written
+	std::set<id_type> m_compact_freed;
+
+	std::thread m_compactor;
+	std::condition_variable m_compactor_cond;
+	bool m_compactor_stop;
+
+	// read-ahead, pages are loaded by the prefetcher in runs of up to
+	// PREFETCH_RUN, a write in the meantime drops the run
+	static const size_t PREFETCH_RUN = 32;
+	size_t  m_read_ahead;
+	id_type m_last_read;
+	id_type m_ahead_end;
+	uint64_t m_write_seq;
+	std::deque<id_type> m_prefetch_queue;
+
+	std::thread m_prefetcher;
+	std::condition_variable m_prefetch_cond;
+	bool m_prefetch_stop;
+
+	// page sized, aligned for direct I/O
 	byte* m_buffer;
 
+	// pooled, grow only
+	std::vector<byte> m_zbuf;
+	std::vector<byte> m_read_buf;
+
+	// page sized and aligned, used by the compactor
+	byte* m_move_buf;
+	// PREFETCH_RUN pages, aligned, used by the prefetcher
+	byte* m_prefetch_buf;
+
 }; // DiskStorageManager
 
 }
@@ -5,7 +5,7 @@
 #include "playdb/typedef.h"
 
 #include <vector>
-#include <stack>
+#include <memory>
 
 #include <string.h>
 
@@ -14,46 +14,53 @@ namespace playdb
 namespace storage
 {
 
+// Entries live in fixed page-sized slots carved out of large contiguous
+// slabs, slot id == entry id. Entries bigger than a page spill into their
+// own overflow buffer, which is kept for in-place overwrites.
 class MemoryStorageManager : public IStorageManager
 {
 public:
-	MemoryStorageManager();
+	MemoryStorageManager(size_t page_size = 4096, size_t slab_pages = 256);
 	virtual ~MemoryStorageManager();
 
 	virtual void LoadByteArray(const id_type id, size_t& len, byte** data) override;
 	virtual void StoreByteArray(id_type& id, const size_t len, const byte* const data) override;
 	virtual void DeleteByteArray(const id_type id) override;
 
+	virtual const byte* BorrowByteArray(const id_type id, size_t& len) override;
+
+	virtual StorageStatistics GetStatistics() const override { return m_stats; }
+
 private:
-	class Entry
+	struct Slot
 	{
-	public:
-		byte*  m_data;
-		size_t m_len;
+		byte*  data;     // slab page or overflow buffer
+		size_t len;
+		size_t capacity;
+		bool   used;
+		bool   overflow;
+	};
 
-		Entry(size_t len, const byte* data)
-			: m_data(nullptr)
-			, m_len(len)
-		{
-			m_data = new byte[m_len];
-			memcpy(m_data, data, len);
-		}
+	Slot& GetSlot(id_type id);
 
-		~Entry()
-		{
-			delete[] m_data;
-		}
+	id_type AllocSlot();
 
-	}; // Entry
+	void Write(Slot& slot, size_t len, const byte* data);
 
 private:
-	std::vector<Entry*> m_buffer;
+	size_t m_page_size;
+	size_t m_slab_pages;
+
+	std::vector<std::unique_ptr<byte[]>> m_slabs;
+	std::vector<Slot> m_slots;
+
+	std::vector<id_type> m_freelist;
 
-	std::stack<id_type> m_freelist;
+	StorageStatistics m_stats;
 
 }; // MemoryStorageManager
 
 }
 }
 
-#endif // _PLAYDB_MEMORY_STORAGE_MANAGER_H_
\ No newline at end of file
+#endif // _PLAYDB_MEMORY_STORAGE_MANAGER_H_
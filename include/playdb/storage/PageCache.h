@@ -0,0 +1,60 @@
+#ifndef _PLAYDB_STORAGE_PAGE_CACHE_H_
+#define _PLAYDB_STORAGE_PAGE_CACHE_H_
+
+#include "playdb/typedef.h"
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+
+namespace playdb
+{
+namespace storage
+{
+
+// LRU cache of data file pages, bounded in bytes. Frames are aligned for
+// direct I/O and recycled, nothing is allocated once the cache is full.
+class PageCache
+{
+public:
+	PageCache(size_t page_size, size_t capacity);
+	~PageCache();
+
+	// nullptr on miss
+	byte* Find(id_type page);
+
+	// frame for a page that is not cached yet, evicts the coldest one
+	byte* Insert(id_type page);
+
+	void Erase(id_type page);
+
+	size_t GetPageSize() const { return m_page_size; }
+	size_t GetCapacity() const { return m_max_frames * m_page_size; }
+	size_t GetSize() const { return m_lru.size() * m_page_size; }
+
+private:
+	struct Frame
+	{
+		id_type page;
+		byte*   data;
+	};
+
+	byte* AllocFrame();
+
+private:
+	size_t m_page_size;
+	size_t m_max_frames;
+
+	// most recent at front
+	std::list<Frame> m_lru;
+	std::unordered_map<id_type, std::list<Frame>::iterator> m_map;
+
+	std::vector<byte*> m_chunks;
+	std::vector<byte*> m_free_frames;
+
+}; // PageCache
+
+}
+}
+
+#endif // _PLAYDB_STORAGE_PAGE_CACHE_H_
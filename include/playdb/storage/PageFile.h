@@ -0,0 +1,68 @@
+#ifndef _PLAYDB_STORAGE_PAGE_FILE_H_
+#define _PLAYDB_STORAGE_PAGE_FILE_H_
+
+#include "playdb/typedef.h"
+
+#include <string>
+#ifdef _WIN32
+#include <fstream>
+#include <mutex>
+#endif // _WIN32
+
+namespace playdb
+{
+namespace storage
+{
+
+// Positional reads and writes of whole pages. With direct I/O the kernel
+// page cache is bypassed (O_DIRECT / F_NOCACHE), so buffers, offsets and
+// lengths must all be multiples of DIRECT_IO_ALIGNMENT.
+// Reads and writes may come from several threads.
+class PageFile
+{
+public:
+	PageFile(const std::string& filepath, bool truncate, bool direct_io);
+	~PageFile();
+
+	void Read(uint64_t offset, byte* buf, size_t len);
+	void Write(uint64_t offset, const byte* buf, size_t len);
+	void Flush();
+	// waits until the writes are on the device, Flush only hands them to
+	// the system
+	void Sync();
+
+	// drops everything past size bytes
+	void Truncate(uint64_t size);
+
+	// asks the kernel to start reading the range in the background
+	void Advise(uint64_t offset, size_t len);
+
+	bool IsDirect() const { return m_direct; }
+
+	// renames src to dst, replacing dst in one step, and syncs the
+	// directory so the rename survives a crash
+	static void Replace(const std::string& src, const std::string& dst);
+
+	static byte* AllocAligned(size_t len);
+	static void FreeAligned(byte* buf);
+
+	static const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+private:
+#ifdef _WIN32
+	std::string  m_path;
+	std::fstream m_file;
+	// seek and read are two calls
+	std::mutex m_mutex;
+#else
+	int m_fd;
+#endif // _WIN32
+
+	bool m_direct;
+
+}; // PageFile
+
+}
+}
+
+#endif // _PLAYDB_STORAGE_PAGE_FILE_H_
@@ -3,6 +3,8 @@
 
 #include "playdb/Exception.h"
 
+#include <string.h>
+
 namespace playdb
 {
 namespace storage
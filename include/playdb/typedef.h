@@ -2,11 +2,18 @@
 #define _PLAYDB_BTREE_TYPEDEF_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 namespace playdb
 {
 
+// page ids, 64 bits for files past 2^31 pages. Node pages store them in
+// this width, files open only in builds with the same one
+#ifdef PLAYDB_64BIT_PAGE_ID
+using id_type = int64_t;
+#else
 using id_type = int32_t;
+#endif // PLAYDB_64BIT_PAGE_ID
 
 using byte = uint8_t;
 
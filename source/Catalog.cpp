@@ -0,0 +1,162 @@
+#include "playdb/Catalog.h"
+#include "playdb/storage/tools.h"
+#include "playdb/Exception.h"
+
+namespace playdb
+{
+
+//////////////////////////////////////////////////////////////////////////
+// class CacheBudget
+//////////////////////////////////////////////////////////////////////////
+
+size_t CacheBudget::GetShare() const
+{
+	size_t trees = m_trees;
+	if (trees == 0) {
+		trees = 1;
+	}
+	return m_capacity / trees;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// class Catalog
+//////////////////////////////////////////////////////////////////////////
+
+Catalog::Catalog(IStorageManager* storage_mgr, size_t cache_nodes)
+	: m_storage_mgr(storage_mgr)
+	, m_cache_budget(std::make_shared<CacheBudget>(cache_nodes))
+{
+	bool exists = true;
+	try {
+		Load();
+	} catch (InvalidPageException&) {
+		exists = false;
+	}
+
+	if (!exists) {
+		Store(true);
+	}
+}
+
+bool Catalog::Find(const std::string& name, id_type& header_id) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto itr = m_trees.find(name);
+	if (itr == m_trees.end()) {
+		return false;
+	}
+	header_id = itr->second;
+	return true;
+}
+
+void Catalog::Insert(const std::string& name, id_type header_id)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (name.empty() || name.size() >= 0xffff) {
+		throw IllegalArgumentException("Catalog: Invalid tree name.");
+	}
+	if (!m_trees.insert(std::make_pair(name, header_id)).second) {
+		throw IllegalArgumentException("Catalog: Tree " + name + " exists already.");
+	}
+	Store();
+}
+
+bool Catalog::Erase(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_trees.erase(name) == 0) {
+		return false;
+	}
+	Store();
+	return true;
+}
+
+std::vector<std::string> Catalog::GetNames() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::vector<std::string> names;
+	names.reserve(m_trees.size());
+	for (auto& tree : m_trees) {
+		names.push_back(tree.first);
+	}
+	return names;
+}
+
+size_t Catalog::GetSize() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_trees.size();
+}
+
+void Catalog::Store(bool create)
+{
+	size_t sz = 0;
+	sz += sizeof(uint32_t);		// MAGIC
+	sz += sizeof(uint64_t);		// count
+	for (auto& tree : m_trees) {
+		sz += storage::sizeof_pack_str(tree.first);
+		sz += sizeof(id_type);
+	}
+
+	byte* data = new byte[sz];
+	byte* ptr = data;
+
+	uint32_t magic = MAGIC;
+	storage::pack(magic, &ptr);
+	storage::pack(static_cast<uint64_t>(m_trees.size()), &ptr);
+	for (auto& tree : m_trees) {
+		storage::pack_str(tree.first, &ptr);
+		storage::pack(tree.second, &ptr);
+	}
+
+	id_type id = CATALOG_ID;
+	if (create) {
+		id = storage::NEW_PAGE;
+	}
+	m_storage_mgr->StoreByteArray(id, sz, data);
+
+	delete[] data;
+
+	// a new catalog must get the first id, or it can't be found again
+	if (id != CATALOG_ID) {
+		m_storage_mgr->DeleteByteArray(id);
+		throw IllegalStateException("Catalog: The storage is not empty.");
+	}
+}
+
+void Catalog::Load()
+{
+	size_t len;
+	byte* data = nullptr;
+	m_storage_mgr->LoadByteArray(CATALOG_ID, len, &data);
+
+	byte* ptr = data;
+
+	uint32_t magic = 0;
+	if (len >= sizeof(uint32_t) + sizeof(uint64_t)) {
+		storage::unpack(magic, &ptr);
+	}
+	if (magic != MAGIC) {
+		delete[] data;
+		throw IllegalStateException("Catalog: The first entry is not a catalog.");
+	}
+
+	uint64_t count;
+	storage::unpack(count, &ptr);
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		std::string name;
+		id_type id;
+		storage::unpack_str(name, &ptr);
+		storage::unpack(id, &ptr);
+		m_trees.insert(std::make_pair(name, id));
+	}
+
+	delete[] data;
+}
+
+}
@@ -0,0 +1,98 @@
+#include "playdb/Metrics.h"
+
+namespace playdb
+{
+
+LatencyHistogram::LatencyHistogram()
+	: m_count(0)
+	, m_sum(0)
+	, m_max(0)
+{
+	for (auto& b : m_buckets) {
+		b.store(0, std::memory_order_relaxed);
+	}
+}
+
+LatencyHistogram::LatencyHistogram(const LatencyHistogram& h)
+{
+	*this = h;
+}
+
+LatencyHistogram& LatencyHistogram::operator = (const LatencyHistogram& h)
+{
+	for (size_t i = 0; i < BUCKETS; ++i) {
+		m_buckets[i].store(h.m_buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	m_count.store(h.GetCount(), std::memory_order_relaxed);
+	m_sum.store(h.GetSum(), std::memory_order_relaxed);
+	m_max.store(h.GetMax(), std::memory_order_relaxed);
+	return *this;
+}
+
+void LatencyHistogram::Record(uint64_t ns)
+{
+	auto& b = m_buckets[Index(ns)];
+	b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	m_count.store(GetCount() + 1, std::memory_order_relaxed);
+	m_sum.store(GetSum() + ns, std::memory_order_relaxed);
+	if (ns > GetMax()) {
+		m_max.store(ns, std::memory_order_relaxed);
+	}
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const
+{
+	// the buckets may be ahead of m_count while the owner records
+	uint64_t count = 0;
+	for (auto& b : m_buckets) {
+		count += b.load(std::memory_order_relaxed);
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	uint64_t max = GetMax();
+	uint64_t rank = static_cast<uint64_t>(p * (count - 1)) + 1;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BUCKETS; ++i)
+	{
+		seen += m_buckets[i].load(std::memory_order_relaxed);
+		if (seen >= rank) {
+			uint64_t v = Value(i);
+			return v < max ? v : max;
+		}
+	}
+	return max;
+}
+
+double LatencyHistogram::GetMean() const
+{
+	uint64_t count = GetCount();
+	return count ? static_cast<double>(GetSum()) / count : 0;
+}
+
+size_t LatencyHistogram::Index(uint64_t ns)
+{
+	if (ns < 2 * SUB) {
+		return static_cast<size_t>(ns);
+	}
+	int msb = SUB_BITS + 1;
+	while (ns >> (msb + 1)) {
+		++msb;
+	}
+	int shift = msb - SUB_BITS;
+	return 2 * SUB + (shift - 1) * SUB + static_cast<size_t>((ns >> shift) - SUB);
+}
+
+// middle of the bucket
+uint64_t LatencyHistogram::Value(size_t idx)
+{
+	if (idx < 2 * SUB) {
+		return idx;
+	}
+	int shift = static_cast<int>((idx - 2 * SUB) / SUB) + 1;
+	uint64_t top = (idx - 2 * SUB) % SUB + SUB;
+	return (top << shift) + (uint64_t(1) << (shift - 1));
+}
+
+}
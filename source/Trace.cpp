@@ -0,0 +1,169 @@
+#include "playdb/Trace.h"
+
+#ifdef PLAYDB_TRACE
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+
+#include <string.h>
+
+namespace playdb
+{
+namespace trace
+{
+
+namespace
+{
+
+thread_local Record* t_current = nullptr;
+
+std::atomic<uint64_t> g_threshold(1000000);
+
+// ring buffer of slow records, only touched by slow spans
+std::mutex g_mutex;
+size_t g_capacity = 256;
+std::vector<Record> g_slow;
+size_t g_next = 0;
+
+uint64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// oldest first, g_mutex held
+std::vector<Record> ordered_slow()
+{
+	std::vector<Record> records;
+	size_t n = g_slow.size();
+	size_t first = n < g_capacity ? 0 : g_next;
+	for (size_t i = 0; i < n; ++i) {
+		records.push_back(g_slow[(first + i) % n]);
+	}
+	return records;
+}
+
+void push_slow(const Record& r)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	if (g_capacity == 0) {
+		return;
+	}
+	if (g_slow.size() < g_capacity) {
+		g_slow.push_back(r);
+	} else {
+		g_slow[g_next] = r;
+	}
+	g_next = (g_next + 1) % g_capacity;
+}
+
+}
+
+Record* Current()
+{
+	return t_current;
+}
+
+void SetSlowThreshold(uint64_t ns)
+{
+	g_threshold.store(ns, std::memory_order_relaxed);
+}
+
+uint64_t GetSlowThreshold()
+{
+	return g_threshold.load(std::memory_order_relaxed);
+}
+
+void SetSlowOpCapacity(size_t capacity)
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+
+	// keep the newest ones that still fit
+	std::vector<Record> records = ordered_slow();
+	if (records.size() > capacity) {
+		records.erase(records.begin(), records.end() - capacity);
+	}
+
+	g_slow.swap(records);
+	g_capacity = capacity;
+	g_next = capacity > 0 ? g_slow.size() % capacity : 0;
+}
+
+std::vector<Record> GetSlowOps()
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	return ordered_slow();
+}
+
+void ClearSlowOps()
+{
+	std::lock_guard<std::mutex> lock(g_mutex);
+	g_slow.clear();
+	g_next = 0;
+}
+
+void DumpSlowOps(std::ostream& os)
+{
+	for (auto& r : GetSlowOps())
+	{
+		os << r.op
+		   << " total_us " << r.total_ns / 1000
+		   << " serialize_us " << r.serialize_ns / 1000
+		   << " storage_us " << r.storage_ns / 1000
+		   << " io_us " << r.io_ns / 1000
+		   << " nodes " << r.nodes
+		   << " node_loads " << r.node_loads
+		   << " node_stores " << r.node_stores
+		   << " splits " << r.splits
+		   << " pages_read " << r.pages_read
+		   << " pages_written " << r.pages_written
+		   << " bytes_copied " << r.bytes_copied
+		   << "\n";
+	}
+}
+
+Span::Span(const char* op)
+	: m_active(t_current == nullptr)
+{
+	if (m_active)
+	{
+		memset(&m_record, 0, sizeof(m_record));
+		m_record.op = op;
+		m_record.start_ns = now_ns();
+		t_current = &m_record;
+	}
+}
+
+Span::~Span()
+{
+	if (!m_active) {
+		return;
+	}
+
+	t_current = nullptr;
+	m_record.total_ns = now_ns() - m_record.start_ns;
+	if (m_record.total_ns >= GetSlowThreshold()) {
+		push_slow(m_record);
+	}
+}
+
+Timer::Timer(uint64_t Record::*field)
+	: m_record(t_current)
+	, m_field(field)
+	, m_start(m_record ? now_ns() : 0)
+{
+}
+
+Timer::~Timer()
+{
+	if (m_record) {
+		m_record->*m_field += now_ns() - m_start;
+	}
+}
+
+}
+}
+
+#endif // PLAYDB_TRACE
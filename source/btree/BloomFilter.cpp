@@ -0,0 +1,135 @@
+#include "playdb/btree/BloomFilter.h"
+#include "playdb/storage/tools.h"
+#include "playdb/Exception.h"
+
+#include <string.h>
+
+namespace playdb
+{
+namespace btree
+{
+
+BloomFilter::BloomFilter()
+	: m_capacity(0)
+	, m_bits_per_key(0)
+	, m_probes(0)
+	, m_count(0)
+{
+}
+
+BloomFilter::BloomFilter(size_t capacity, size_t bits_per_key)
+	: m_capacity(capacity)
+	, m_bits_per_key(bits_per_key)
+	, m_count(0)
+{
+	if (bits_per_key == 0) {
+		throw IllegalArgumentException("BloomFilter: bits_per_key must be positive.");
+	}
+
+	// k = ln2 * m / n minimizes the false positive rate
+	m_probes = static_cast<size_t>(bits_per_key * 0.69 + 0.5);
+	if (m_probes < 1) {
+		m_probes = 1;
+	} else if (m_probes > 30) {
+		m_probes = 30;
+	}
+
+	size_t bits = capacity * bits_per_key;
+	if (bits < 64) {
+		bits = 64;
+	}
+	m_bits.resize((bits + 63) / 64, 0);
+}
+
+size_t BloomFilter::GetByteArraySize() const
+{
+	return sizeof(uint64_t) * 5 + m_bits.size() * sizeof(uint64_t);
+}
+
+void BloomFilter::LoadFromByteArray(const byte* data)
+{
+	byte* ptr = const_cast<byte*>(data);
+
+	uint64_t capacity, bits_per_key, probes, count, words;
+	storage::unpack(capacity, &ptr);
+	storage::unpack(bits_per_key, &ptr);
+	storage::unpack(probes, &ptr);
+	storage::unpack(count, &ptr);
+	storage::unpack(words, &ptr);
+
+	m_capacity = static_cast<size_t>(capacity);
+	m_bits_per_key = static_cast<size_t>(bits_per_key);
+	m_probes = static_cast<size_t>(probes);
+	m_count = static_cast<size_t>(count);
+	m_bits.resize(static_cast<size_t>(words));
+	if (words > 0) {
+		memcpy(m_bits.data(), ptr, m_bits.size() * sizeof(uint64_t));
+	}
+}
+
+void BloomFilter::StoreToByteArray(byte** data, size_t& len) const
+{
+	len = GetByteArraySize();
+	*data = new byte[len];
+
+	byte* ptr = *data;
+
+	storage::pack(static_cast<uint64_t>(m_capacity), &ptr);
+	storage::pack(static_cast<uint64_t>(m_bits_per_key), &ptr);
+	storage::pack(static_cast<uint64_t>(m_probes), &ptr);
+	storage::pack(static_cast<uint64_t>(m_count), &ptr);
+	storage::pack(static_cast<uint64_t>(m_bits.size()), &ptr);
+	if (!m_bits.empty()) {
+		memcpy(ptr, m_bits.data(), m_bits.size() * sizeof(uint64_t));
+	}
+}
+
+void BloomFilter::Add(uint64_t hash)
+{
+	uint64_t n = m_bits.size() * 64;
+	uint64_t h = hash, delta = (hash >> 33) | (hash << 31);
+	for (size_t i = 0; i < m_probes; ++i) {
+		uint64_t bit = h % n;
+		m_bits[bit / 64] |= uint64_t(1) << (bit % 64);
+		h += delta;
+	}
+	++m_count;
+}
+
+bool BloomFilter::MayContain(uint64_t hash) const
+{
+	if (m_bits.empty()) {
+		return true;
+	}
+
+	uint64_t n = m_bits.size() * 64;
+	uint64_t h = hash, delta = (hash >> 33) | (hash << 31);
+	for (size_t i = 0; i < m_probes; ++i) {
+		uint64_t bit = h % n;
+		if ((m_bits[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+			return false;
+		}
+		h += delta;
+	}
+	return true;
+}
+
+uint64_t BloomFilter::Hash(const void* data, size_t len)
+{
+	// FNV-1a, then a murmur3 finalizer to spread the low bits
+	const byte* p = static_cast<const byte*>(data);
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+}
+}
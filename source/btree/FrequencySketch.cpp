@@ -0,0 +1,90 @@
+#include "playdb/btree/FrequencySketch.h"
+
+namespace
+{
+
+const uint8_t MAX_COUNT = 15;
+
+const uint64_t SEEDS[] = {
+	0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+	0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL,
+};
+
+}
+
+namespace playdb
+{
+namespace btree
+{
+
+FrequencySketch::FrequencySketch(size_t width)
+	: m_additions(0)
+{
+	size_t w = 64;
+	while (w < width) {
+		w *= 2;
+	}
+	m_mask = w - 1;
+	// two counters per byte
+	m_table.resize(w * ROWS / 2, 0);
+	m_sample_size = w * 10;
+}
+
+void FrequencySketch::Increment(uint64_t hash)
+{
+	// conservative update, only the smallest counters grow
+	size_t freq = Frequency(hash);
+	if (freq >= MAX_COUNT) {
+		return;
+	}
+	for (size_t r = 0; r < ROWS; ++r)
+	{
+		size_t i = Index(hash, r);
+		if (Get(i) == freq) {
+			// the counter is below 15, so this never carries into the
+			// other half of the byte
+			m_table[i / 2] += static_cast<uint8_t>(1 << (i % 2 * 4));
+		}
+	}
+
+	if (++m_additions >= m_sample_size) {
+		Age();
+	}
+}
+
+size_t FrequencySketch::Frequency(uint64_t hash) const
+{
+	size_t freq = MAX_COUNT;
+	for (size_t r = 0; r < ROWS; ++r) {
+		size_t c = Get(Index(hash, r));
+		if (c < freq) {
+			freq = c;
+		}
+	}
+	return freq;
+}
+
+size_t FrequencySketch::Index(uint64_t hash, size_t row) const
+{
+	uint64_t h = (hash ^ SEEDS[row]) * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 32;
+	return row * (m_mask + 1) + static_cast<size_t>(h & m_mask);
+}
+
+size_t FrequencySketch::Get(size_t i) const
+{
+	return (m_table[i / 2] >> (i % 2 * 4)) & 0x0f;
+}
+
+void FrequencySketch::Age()
+{
+	// halves both counters of a byte, the bit shifted into the low one
+	// from the high one is masked off
+	for (auto& c : m_table) {
+		c = (c >> 1) & 0x77;
+	}
+	m_additions /= 2;
+}
+
+}
+}
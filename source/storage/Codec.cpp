@@ -0,0 +1,299 @@
+#include "playdb/storage/Codec.h"
+#include "playdb/Exception.h"
+
+#ifdef PLAYDB_WITH_LZ4
+#include <lz4.h>
+#endif // PLAYDB_WITH_LZ4
+#ifdef PLAYDB_WITH_ZSTD
+#include <zstd.h>
+#endif // PLAYDB_WITH_ZSTD
+
+#include <string.h>
+
+namespace
+{
+
+using playdb::byte;
+
+// LZ: byte oriented LZ77 in the spirit of the LZ4 block format.
+// Each sequence is a token (literal run in the high nibble, match length
+// minus MIN_MATCH in the low one, 15 means extra length bytes follow),
+// the literals, then a 2-byte little endian offset and the extra match
+// length bytes. The last sequence carries literals only.
+
+const int    HASH_LOG      = 12;
+const size_t MIN_MATCH     = 4;
+const size_t LAST_LITERALS = 5;
+const size_t MAX_OFFSET    = 0xffff;
+
+inline uint32_t read32(const byte* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+inline bool put_length(size_t len, byte** op, const byte* end)
+{
+	while (len >= 255)
+	{
+		if (*op >= end) {
+			return false;
+		}
+		*(*op)++ = 255;
+		len -= 255;
+	}
+	if (*op >= end) {
+		return false;
+	}
+	*(*op)++ = static_cast<byte>(len);
+	return true;
+}
+
+inline bool put_sequence(const byte* lit, size_t lit_len, size_t offset,
+	                     size_t match_len, byte** op, const byte* end)
+{
+	byte* token = *op;
+	if (token >= end) {
+		return false;
+	}
+	++*op;
+
+	*token = static_cast<byte>((lit_len < 15 ? lit_len : 15) << 4);
+	if (lit_len >= 15 && !put_length(lit_len - 15, op, end)) {
+		return false;
+	}
+	if (static_cast<size_t>(end - *op) < lit_len) {
+		return false;
+	}
+	memcpy(*op, lit, lit_len);
+	*op += lit_len;
+
+	if (match_len == 0) {
+		return true;
+	}
+
+	if (end - *op < 2) {
+		return false;
+	}
+	*(*op)++ = static_cast<byte>(offset & 0xff);
+	*(*op)++ = static_cast<byte>(offset >> 8);
+
+	size_t m = match_len - MIN_MATCH;
+	*token |= static_cast<byte>(m < 15 ? m : 15);
+	if (m >= 15 && !put_length(m - 15, op, end)) {
+		return false;
+	}
+	return true;
+}
+
+size_t lz_compress(const byte* src, size_t len, byte* dst, size_t cap)
+{
+	uint32_t table[1 << HASH_LOG];
+	memset(table, 0, sizeof(table));
+
+	byte* op = dst;
+	const byte* end = dst + cap;
+
+	size_t ip = 0, anchor = 0;
+	if (len > MIN_MATCH + LAST_LITERALS)
+	{
+		size_t limit = len - LAST_LITERALS - MIN_MATCH;
+		while (ip <= limit)
+		{
+			uint32_t seq = read32(src + ip);
+			uint32_t h = hash32(seq);
+			// table holds position + 1, 0 is empty
+			size_t ref = table[h];
+			table[h] = static_cast<uint32_t>(ip + 1);
+			if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != seq) {
+				++ip;
+				continue;
+			}
+			--ref;
+
+			size_t match = MIN_MATCH;
+			while (ip + match < len - LAST_LITERALS && src[ref + match] == src[ip + match]) {
+				++match;
+			}
+
+			if (!put_sequence(src + anchor, ip - anchor, ip - ref, match, &op, end)) {
+				return 0;
+			}
+			ip += match;
+			anchor = ip;
+		}
+	}
+
+	if (!put_sequence(src + anchor, len - anchor, 0, 0, &op, end)) {
+		return 0;
+	}
+	return op - dst;
+}
+
+inline size_t get_length(size_t len, const byte** ip, const byte* end)
+{
+	if (len != 15) {
+		return len;
+	}
+	byte b;
+	do {
+		if (*ip >= end) {
+			throw playdb::IllegalStateException("decompress: truncated input.");
+		}
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+void lz_decompress(const byte* src, size_t len, byte* dst, size_t raw_len)
+{
+	const byte* ip = src;
+	const byte* ip_end = src + len;
+	byte* op = dst;
+	byte* op_end = dst + raw_len;
+
+	while (ip < ip_end)
+	{
+		byte token = *ip++;
+
+		size_t lit_len = get_length(token >> 4, &ip, ip_end);
+		if (static_cast<size_t>(ip_end - ip) < lit_len || static_cast<size_t>(op_end - op) < lit_len) {
+			throw playdb::IllegalStateException("decompress: literal run out of range.");
+		}
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		if (ip == ip_end) {
+			break;
+		}
+
+		if (ip_end - ip < 2) {
+			throw playdb::IllegalStateException("decompress: truncated input.");
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t match_len = get_length(token & 0x0f, &ip, ip_end) + MIN_MATCH;
+		if (offset == 0 || offset > static_cast<size_t>(op - dst)
+		 || static_cast<size_t>(op_end - op) < match_len) {
+			throw playdb::IllegalStateException("decompress: match out of range.");
+		}
+		// may overlap, copy forward byte by byte
+		const byte* ref = op - offset;
+		for (size_t i = 0; i < match_len; ++i) {
+			op[i] = ref[i];
+		}
+		op += match_len;
+	}
+
+	if (op != op_end) {
+		throw playdb::IllegalStateException("decompress: size mismatch.");
+	}
+}
+
+}
+
+namespace playdb
+{
+namespace storage
+{
+
+bool codec_available(Codec codec)
+{
+	switch (codec)
+	{
+	case Codec::NONE:
+	case Codec::LZ:
+		return true;
+#ifdef PLAYDB_WITH_LZ4
+	case Codec::LZ4:
+		return true;
+#endif // PLAYDB_WITH_LZ4
+#ifdef PLAYDB_WITH_ZSTD
+	case Codec::ZSTD:
+		return true;
+#endif // PLAYDB_WITH_ZSTD
+	default:
+		return false;
+	}
+}
+
+size_t compress_bound(Codec codec, size_t len)
+{
+	switch (codec)
+	{
+	case Codec::LZ:
+		return len + len / 255 + 16;
+#ifdef PLAYDB_WITH_LZ4
+	case Codec::LZ4:
+		return LZ4_compressBound(static_cast<int>(len));
+#endif // PLAYDB_WITH_LZ4
+#ifdef PLAYDB_WITH_ZSTD
+	case Codec::ZSTD:
+		return ZSTD_compressBound(len);
+#endif // PLAYDB_WITH_ZSTD
+	default:
+		return len;
+	}
+}
+
+size_t compress(Codec codec, const byte* src, size_t len, byte* dst, size_t cap)
+{
+	switch (codec)
+	{
+	case Codec::LZ:
+		return lz_compress(src, len, dst, cap);
+#ifdef PLAYDB_WITH_LZ4
+	case Codec::LZ4:
+		return LZ4_compress_default(reinterpret_cast<const char*>(src),
+			reinterpret_cast<char*>(dst), static_cast<int>(len), static_cast<int>(cap));
+#endif // PLAYDB_WITH_LZ4
+#ifdef PLAYDB_WITH_ZSTD
+	case Codec::ZSTD:
+	{
+		size_t ret = ZSTD_compress(dst, cap, src, len, 3);
+		return ZSTD_isError(ret) ? 0 : ret;
+	}
+#endif // PLAYDB_WITH_ZSTD
+	default:
+		throw IllegalArgumentException("compress: codec not available.");
+	}
+}
+
+void decompress(Codec codec, const byte* src, size_t len, byte* dst, size_t raw_len)
+{
+	switch (codec)
+	{
+	case Codec::LZ:
+		lz_decompress(src, len, dst, raw_len);
+		break;
+#ifdef PLAYDB_WITH_LZ4
+	case Codec::LZ4:
+		if (LZ4_decompress_safe(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(dst),
+			    static_cast<int>(len), static_cast<int>(raw_len)) != static_cast<int>(raw_len)) {
+			throw IllegalStateException("decompress: corrupted LZ4 block.");
+		}
+		break;
+#endif // PLAYDB_WITH_LZ4
+#ifdef PLAYDB_WITH_ZSTD
+	case Codec::ZSTD:
+		if (ZSTD_decompress(dst, raw_len, src, len) != raw_len) {
+			throw IllegalStateException("decompress: corrupted ZSTD frame.");
+		}
+		break;
+#endif // PLAYDB_WITH_ZSTD
+	default:
+		throw IllegalArgumentException("decompress: codec not available.");
+	}
+}
+
+}
+}
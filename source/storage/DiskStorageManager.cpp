@@ -1,19 +1,86 @@
 #include "playdb/storage/DiskStorageManager.h"
 #include "playdb/Exception.h"
+#include "playdb/Trace.h"
+#include "playdb/storage/tools.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
 
 #include <assert.h>
+#include <string.h>
 
 namespace playdb
 {
 namespace storage
 {
 
+namespace
+{
+
+// magic, version, page size, next page, codec, three counts and the
+// page id width, version 2 ends before the width
+const size_t INDEX_HEADER_SIZE = 2 * sizeof(uint32_t) + 7 * sizeof(uint64_t);
+// first id, offset, size and count of a block
+const size_t INDEX_DIR_ENTRY_SIZE = 4 * sizeof(uint64_t);
+// id, length, raw length and page count, the pages follow
+const size_t INDEX_ENTRY_SIZE = 4 * sizeof(uint64_t);
+
+void read_index(std::fstream& file, std::vector<byte>& buf, uint64_t len)
+{
+	buf.resize(static_cast<size_t>(len));
+	file.read(reinterpret_cast<char*>(buf.data()), buf.size());
+	if (file.fail()) {
+		throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
+	}
+}
+
+uint64_t file_size(std::fstream& file)
+{
+	file.clear();
+	file.seekg(0, std::ios_base::end);
+	std::streamoff size = file.tellg();
+	file.seekg(0, std::ios_base::beg);
+	return size < 0 || file.fail() ? 0 : static_cast<uint64_t>(size);
+}
+
+id_type to_id(int64_t v)
+{
+	if (v < NEW_PAGE || v > std::numeric_limits<id_type>::max()) {
+		throw IllegalStateException("DiskStorageManager: Page id out of range.");
+	}
+	return static_cast<id_type>(v);
+}
+
+}
+
 DiskStorageManager::DiskStorageManager(const std::string& index_filepath,
 	                                   const std::string& data_filepath,
-	                                   bool overwrite, size_t page_size)
-	: m_page_size(0)
+	                                   bool overwrite, size_t page_size, Codec codec,
+	                                   size_t cache_size, bool direct_io)
+	: m_index_path(index_filepath)
+	, m_page_size(0)
 	, m_next_page(NEW_PAGE)
+	, m_codec(codec)
+	, m_index_pending(0)
+	, m_free_offset(0)
+	, m_free_count(0)
+	, m_free_loaded(true)
+	, m_index_loader_stop(false)
+	, m_compacting(false)
+	, m_compact_cursor(0)
+	, m_compact_page(0)
+	, m_compact_target(0)
+	, m_compact_region(0)
+	, m_compactor_stop(false)
+	, m_read_ahead(0)
+	, m_last_read(NEW_PAGE)
+	, m_ahead_end(0)
+	, m_write_seq(0)
+	, m_prefetch_stop(false)
 	, m_buffer(nullptr)
+	, m_move_buf(nullptr)
+	, m_prefetch_buf(nullptr)
 {
 	// check if file exists.
 	bool exists = true;
@@ -27,21 +94,19 @@ DiskStorageManager::DiskStorageManager(const std::string& index_filepath,
 	// check if file can be read/written.
 	if (exists == true && overwrite == false)
 	{
-		m_data_file.open(index_filepath.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-		m_index_file.open(data_filepath.c_str(), std::ios::in | std::ios::out | std::ios::binary);
-
-		if (m_index_file.fail() || m_index_file.fail()) {
+		m_index_file.open(index_filepath.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+		if (m_index_file.fail()) {
 			throw IllegalArgumentException("DiskStorageManager: Index/Data file cannot be read/writen.");
 		}
+		m_data_file = std::make_unique<PageFile>(data_filepath, false, direct_io);
 	}
 	else
 	{
-		m_data_file.open(index_filepath.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
-		m_index_file.open(data_filepath.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
-
-		if (m_index_file.fail() || m_index_file.fail()) {
+		m_index_file.open(index_filepath.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+		if (m_index_file.fail()) {
 			throw IllegalArgumentException("DiskStorageManager: Index/Data file cannot be created.");
 		}
+		m_data_file = std::make_unique<PageFile>(data_filepath, true, direct_io);
 	}
 
 	// find page size.
@@ -53,303 +118,1269 @@ DiskStorageManager::DiskStorageManager(const std::string& index_filepath,
 	}
 	else
 	{
-		m_index_file.read(reinterpret_cast<char*>(&m_page_size), sizeof(size_t));
-		if (m_index_file.fail()) {
-			throw IllegalStateException("DiskStorageManager: Failed reading page size.");
+		uint32_t magic = 0;
+		m_index_file.read(reinterpret_cast<char*>(&magic), sizeof(uint32_t));
+		if (!m_index_file.fail() && magic == INDEX_MAGIC)
+		{
+			ReadIndexDirectory();
 		}
-
-		m_index_file.read(reinterpret_cast<char*>(&m_next_page), sizeof(id_type));
-		if (m_index_file.fail()) {
-			throw IllegalStateException("DiskStorageManager: Failed reading next page.");
+		else
+		{
+			ReadLegacyIndex(index_filepath, data_filepath, direct_io);
 		}
 	}
 
+	if (!codec_available(m_codec)) {
+		throw IllegalArgumentException("DiskStorageManager: Codec is not built in.");
+	}
+
+	// direct I/O needs sector aligned offsets and lengths
+	if (direct_io && m_page_size % PageFile::DIRECT_IO_ALIGNMENT != 0) {
+		throw IllegalArgumentException("DiskStorageManager: Page size must be sector aligned for direct I/O.");
+	}
+
 	// create buffer.
-	m_buffer = new byte[m_page_size];
+	m_buffer = PageFile::AllocAligned(m_page_size);
 	memset(m_buffer, 0, m_page_size);
+	m_move_buf = PageFile::AllocAligned(m_page_size);
+
+	if (cache_size > 0) {
+		m_cache = std::make_unique<PageCache>(m_page_size, cache_size);
+	}
+
+	if (m_index_pending > 0 || !m_free_loaded) {
+		m_index_loader = std::thread(&DiskStorageManager::IndexLoaderLoop, this);
+	}
+}
+
+DiskStorageManager::~DiskStorageManager()
+{
+	StopCompactor();
 
-	if (!overwrite)
 	{
-		// load empty pages in memory.
-		size_t count;
-		m_index_file.read(reinterpret_cast<char*>(&count), sizeof(size_t));
-		if (m_index_file.fail()) {
-			throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_index_loader_stop = true;
+	}
+	if (m_index_loader.joinable()) {
+		m_index_loader.join();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_prefetch_stop = true;
+	}
+	m_prefetch_cond.notify_all();
+	if (m_prefetcher.joinable()) {
+		m_prefetcher.join();
+	}
+
+	Flush();
+
+	m_index_file.close();
+	m_data_file.reset();
+
+	if (m_buffer) {
+		PageFile::FreeAligned(m_buffer);
+	}
+	if (m_move_buf) {
+		PageFile::FreeAligned(m_move_buf);
+	}
+	if (m_prefetch_buf) {
+		PageFile::FreeAligned(m_prefetch_buf);
+	}
+}
+
+void DiskStorageManager::LoadByteArray(const id_type id, size_t& len, byte** data)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const Entry& entry = GetEntry(id);
+
+	len = entry.m_raw_length;
+	*data = new byte[len];
+	ReadEntry(entry, *data);
+
+	m_stats.loads++;
+}
+
+void DiskStorageManager::StoreByteArray(id_type& id, const size_t len, const byte* const data)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::unique_ptr<Entry> old_entry;
+	if (id != NEW_PAGE)
+	{
+		EnsureIndex(id);
+		auto entry = m_page_index.find(id);
+		if (entry == m_page_index.end()) {
+			throw IndexOutOfBoundsException(id);
 		}
-		for (size_t i = 0; i < count; ++i)
-		{
-			id_type page;
-			m_index_file.read(reinterpret_cast<char*>(&page), sizeof(id_type));
-			if (m_index_file.fail()) {
-				throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
-			}
-			m_empty_pages.push(page);
+
+		old_entry = std::move(entry->second);
+
+		m_page_index.erase(entry);
+	}
+
+	auto new_entry = std::make_unique<Entry>();
+	new_entry->m_raw_length = len;
+
+	// pages are allocated by the stored (compressed) size
+	const byte* ptr = Compress(data, len, new_entry->m_length);
+	size_t rem = new_entry->m_length;
+	size_t next = 0;
+	do {
+		id_type page;
+		if (old_entry && next < old_entry->m_pages.size()) {
+			page = old_entry->m_pages[next++];
+		} else {
+			page = AllocPage();
 		}
 
-		// load index table in memory.
-		m_index_file.read(reinterpret_cast<char*>(&count), sizeof(size_t));
-		if (m_index_file.fail()) {
-			throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
+		size_t _len = (rem > m_page_size) ? m_page_size : rem;
+		WritePage(page, ptr, _len);
+
+		ptr += _len;
+		rem -= _len;
+		new_entry->m_pages.push_back(page);
+	} while (rem > 0);
+
+	if (old_entry) {
+		while (next < old_entry->m_pages.size()) {
+			FreePage(old_entry->m_pages[next++]);
 		}
-		for (size_t i = 0; i < count; ++i)
-		{
-			auto e = std::make_unique<Entry>();
+	} else {
+		id = NewID(new_entry->m_pages[0]);
+	}
+	for (auto page : new_entry->m_pages) {
+		SetOwner(page, id);
+	}
 
-			id_type id;
-			m_index_file.read(reinterpret_cast<char*>(&id), sizeof(id_type));
-			if (m_index_file.fail()) {
-				throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
-			}
+	m_page_index.insert(std::make_pair(id, std::move(new_entry)));
 
-			m_index_file.read(reinterpret_cast<char*>(&(e->m_length)), sizeof(size_t));
-			if (m_index_file.fail()) {
-				throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
-			}
+	m_stats.stores++;
+}
 
-			size_t count2;
-			m_index_file.read(reinterpret_cast<char*>(&count2), sizeof(size_t));
-			if (m_index_file.fail()) {
-				throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
-			}
-			for (size_t j = 0; j < count2; ++j)
-			{
-				id_type page;
-				m_index_file.read(reinterpret_cast<char*>(&page), sizeof(id_type));
-				if (m_index_file.fail()) {
-					throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
-				}
-				e->m_pages.push_back(page);
-			}
+void DiskStorageManager::DeleteByteArray(const id_type id)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	EnsureIndex(id);
+	auto entry = m_page_index.find(id);
+	if (entry == m_page_index.end()) {
+		throw InvalidPageException(id);
+	}
+
+	for (auto page : entry->second->m_pages) {
+		FreePage(page);
+	}
+
+	m_page_index.erase(entry);
+
+	m_stats.deletes++;
+}
+
+const byte* DiskStorageManager::BorrowByteArray(const id_type id, size_t& len)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const Entry& entry = GetEntry(id);
+
+	len = entry.m_raw_length;
+	if (m_read_buf.size() < len) {
+		m_read_buf.resize(len);
+	}
+	ReadEntry(entry, m_read_buf.data());
 
-			m_page_index.insert(std::make_pair(id, std::move(e)));
+	m_stats.loads++;
+
+	return m_read_buf.data();
+}
+
+void DiskStorageManager::Prefetch(const id_type* ids, size_t count)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_read_ahead == 0) {
+		return;
+	}
+
+	// a hint, entries of index blocks not loaded yet are skipped
+	for (size_t i = 0; i < count; ++i)
+	{
+		auto entry = m_page_index.find(ids[i]);
+		if (entry == m_page_index.end()) {
+			continue;
+		}
+		for (auto page : entry->second->m_pages) {
+			QueuePages(page, page + 1);
 		}
 	}
 }
 
-DiskStorageManager::~DiskStorageManager()
+StorageStatistics DiskStorageManager::GetStatistics() const
 {
-	Flush();
+	std::lock_guard<std::mutex> lock(m_mutex);
 
-	m_index_file.close();
-	m_data_file.close();
+	StorageStatistics stats = m_stats;
+	stats.pages = m_next_page;
+	stats.free_pages = FreePageCount();
+	return stats;
+}
 
-	if (m_buffer) {
-		delete[] m_buffer;
+void DiskStorageManager::SetReadAhead(size_t pages)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_read_ahead = pages;
+	if (pages == 0) {
+		m_prefetch_queue.clear();
+	}
+
+	if (pages > 0 && m_cache && !m_prefetcher.joinable())
+	{
+		m_prefetch_buf = PageFile::AllocAligned(m_page_size * PREFETCH_RUN);
+		m_prefetcher = std::thread(&DiskStorageManager::PrefetchLoop, this);
 	}
 }
 
-void DiskStorageManager::LoadByteArray(const id_type id, size_t& len, byte** data)
+const DiskStorageManager::Entry& DiskStorageManager::GetEntry(id_type id)
 {
+	EnsureIndex(id);
 	auto entry = m_page_index.find(id);
 	if (entry == m_page_index.end()) {
 		throw InvalidPageException(id);
 	}
+	return *entry->second;
+}
 
-	auto& pages = entry->second->m_pages;
-	size_t next = 0;
-	size_t totle = pages.size();
-
-	len = entry->second->m_length;
-	*data = new byte[len];
-
-	byte* ptr = *data;
-	size_t rem = len;
-	do {
-		m_data_file.seekg(pages[next] * m_page_size, std::ios_base::beg);
-		if (m_data_file.fail()) {
-			throw IllegalStateException("DiskStorageManager: Corrupted data file.");
-		}
+void DiskStorageManager::ReadEntry(const Entry& entry, byte* dst)
+{
+	if (m_read_ahead > 0) {
+		ReadAhead(entry);
+	}
 
-		m_data_file.read(reinterpret_cast<char*>(m_buffer), m_page_size);
-		if (m_data_file.fail()) {
-			throw IllegalStateException("DiskStorageManager: Corrupted data file.");
-		}
+	bool compressed = entry.m_length != entry.m_raw_length;
+	if (compressed && m_zbuf.size() < entry.m_length) {
+		m_zbuf.resize(entry.m_length);
+	}
 
+	byte* ptr = compressed ? m_zbuf.data() : dst;
+	size_t rem = entry.m_length;
+	for (auto page : entry.m_pages)
+	{
 		size_t _len = (rem > m_page_size) ? m_page_size : rem;
-		memcpy(ptr, m_buffer, _len);
+		ReadPage(page, ptr, _len);
 
 		ptr += _len;
 		rem -= _len;
-		++next;
-	} while (next < totle);
+	}
+
+	if (compressed) {
+		decompress(m_codec, m_zbuf.data(), entry.m_length, dst, entry.m_raw_length);
+	}
 }
 
-void DiskStorageManager::StoreByteArray(id_type& id, const size_t len, const byte* const data)
+void DiskStorageManager::ReadAhead(const Entry& entry)
+{
+	id_type first = entry.m_pages.front();
+	id_type last = entry.m_pages.back();
+
+	bool sequential = first == m_last_read + 1;
+	m_last_read = last;
+	if (!sequential) {
+		return;
+	}
+
+	// keep the window ahead of the reader, topped up once half of it is used
+	id_type next = last + 1;
+	id_type window = static_cast<id_type>(m_read_ahead);
+	if (m_ahead_end < next || m_ahead_end > next + window) {
+		m_ahead_end = next;
+	}
+	if (m_ahead_end - next > window / 2) {
+		return;
+	}
+
+	id_type end = std::min(next + window, m_next_page);
+	if (m_ahead_end < end) {
+		QueuePages(m_ahead_end, end);
+		m_ahead_end = end;
+	}
+}
+
+void DiskStorageManager::QueuePages(id_type first, id_type end)
 {
-	if (id == NEW_PAGE)
+	if (!m_cache) {
+		m_data_file->Advise(static_cast<uint64_t>(first) * m_page_size,
+			static_cast<size_t>(end - first) * m_page_size);
+		return;
+	}
+
+	// the reader has moved on from the oldest ones
+	for (id_type page = first; page < end; ++page) {
+		m_prefetch_queue.push_back(page);
+	}
+	size_t limit = PREFETCH_RUN;
+	limit = std::max(limit, m_read_ahead);
+	while (m_prefetch_queue.size() > limit) {
+		m_prefetch_queue.pop_front();
+	}
+	m_prefetch_cond.notify_one();
+}
+
+void DiskStorageManager::PrefetchLoop()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true)
 	{
-		auto entry = std::make_unique<Entry>();
-		entry->m_length = len;
+		m_prefetch_cond.wait(lock, [this] { return m_prefetch_stop || !m_prefetch_queue.empty(); });
+		if (m_prefetch_stop) {
+			break;
+		}
 
-		const byte* ptr = data;
-		size_t rem = len;
-		while (rem > 0)
+		// the longest run of consecutive live pages not cached yet, read
+		// with one call
+		id_type first = NEW_PAGE;
+		size_t n = 0;
+		while (!m_prefetch_queue.empty() && n < PREFETCH_RUN)
 		{
-			id_type page;
-			if (!m_empty_pages.empty()) {
-				page = m_empty_pages.top(); m_empty_pages.pop();
-			} else {
-				page = m_next_page++;
+			id_type page = m_prefetch_queue.front();
+			bool wanted = GetOwner(page) != NEW_PAGE && !m_cache->Find(page);
+			if (n > 0 && (!wanted || page != first + static_cast<id_type>(n))) {
+				break;
 			}
-
-			size_t _len = (rem > m_page_size) ? m_page_size : rem;
-			memcpy(m_buffer, ptr, _len);
-			m_data_file.seekp(page * m_page_size, std::ios_base::beg);
-			if (m_data_file.fail()) {
-				throw IllegalStateException("DiskStorageManager: Corrupted data file.");
+			m_prefetch_queue.pop_front();
+			if (wanted) {
+				if (n == 0) {
+					first = page;
+				}
+				++n;
 			}
-			m_data_file.write(reinterpret_cast<const char*>(m_buffer), m_page_size);
-			if (m_data_file.fail()) {
-				throw IllegalStateException("DiskStorageManager: Corrupted data file.");
+		}
+		if (n == 0) {
+			continue;
+		}
+
+		uint64_t seq = m_write_seq;
+		lock.unlock();
+		bool loaded = true;
+		try {
+			m_data_file->Read(static_cast<uint64_t>(first) * m_page_size, m_prefetch_buf, n * m_page_size);
+		} catch (...) {
+			loaded = false;
+		}
+		lock.lock();
+
+		// a write may have changed a page after it was read
+		if (!loaded) {
+			continue;
+		}
+		m_stats.bytes_read += n * m_page_size;
+		if (seq != m_write_seq) {
+			continue;
+		}
+		for (size_t i = 0; i < n; ++i)
+		{
+			id_type page = first + static_cast<id_type>(i);
+			if (!m_cache->Find(page)) {
+				memcpy(m_cache->Insert(page), m_prefetch_buf + i * m_page_size, m_page_size);
 			}
+		}
+	}
+}
+
+const byte* DiskStorageManager::Compress(const byte* data, size_t len, size_t& stored_len)
+{
+	stored_len = len;
+	if (m_codec == Codec::NONE || len == 0) {
+		return data;
+	}
+
+	// room for the worst case, LZ4 and ZSTD take their unchecked fast path
+	size_t bound = compress_bound(m_codec, len);
+	if (m_zbuf.size() < bound) {
+		m_zbuf.resize(bound);
+	}
+	// keep the raw bytes unless compression actually saves space
+	size_t zlen = compress(m_codec, data, len, m_zbuf.data(), bound);
+	if (zlen == 0 || zlen >= len) {
+		return data;
+	}
+
+	stored_len = zlen;
+	return m_zbuf.data();
+}
+
+void DiskStorageManager::ReadPage(id_type page, byte* dst, size_t len)
+{
+	uint64_t offset = static_cast<uint64_t>(page) * m_page_size;
 
-			ptr += _len;
-			rem -= _len;
-			entry->m_pages.push_back(page);
+	if (m_cache)
+	{
+		byte* frame = m_cache->Find(page);
+		if (frame)
+		{
+			m_stats.cache_hits++;
+		}
+		else
+		{
+			m_stats.cache_misses++;
+			frame = m_cache->Insert(page);
+			try {
+				PLAYDB_TRACE_TIME(io_ns);
+				m_data_file->Read(offset, frame, m_page_size);
+			} catch (...) {
+				m_cache->Erase(page);
+				throw;
+			}
+			m_stats.bytes_read += m_page_size;
+			PLAYDB_TRACE_ADD(pages_read, 1);
 		}
+		memcpy(dst, frame, len);
+		PLAYDB_TRACE_ADD(bytes_copied, len);
+		return;
+	}
+
+	m_stats.bytes_read += m_page_size;
+	PLAYDB_TRACE_ADD(pages_read, 1);
+	PLAYDB_TRACE_TIME(io_ns);
 
-		id = entry->m_pages[0];
-		m_page_index.insert(std::make_pair(id, std::move(entry)));
+	// full pages go straight to the destination unless it must be aligned
+	if (len == m_page_size && !m_data_file->IsDirect()) {
+		m_data_file->Read(offset, dst, m_page_size);
+	} else {
+		m_data_file->Read(offset, m_buffer, m_page_size);
+		memcpy(dst, m_buffer, len);
+	}
+}
+
+void DiskStorageManager::WritePage(id_type page, const byte* src, size_t len)
+{
+	uint64_t offset = static_cast<uint64_t>(page) * m_page_size;
+	++m_write_seq;
+	m_stats.bytes_written += m_page_size;
+	PLAYDB_TRACE_ADD(pages_written, 1);
+	PLAYDB_TRACE_ADD(bytes_copied, len);
+
+	// write through, the cached frame doubles as the aligned staging buffer
+	byte* buf = nullptr;
+	if (m_cache)
+	{
+		buf = m_cache->Find(page);
+		if (!buf) {
+			buf = m_cache->Insert(page);
+		}
+	}
+	else if (len == m_page_size && !m_data_file->IsDirect())
+	{
+		PLAYDB_TRACE_TIME(io_ns);
+		m_data_file->Write(offset, src, m_page_size);
+		return;
 	}
 	else
+	{
+		buf = m_buffer;
+	}
+
+	// short tail, pad with zeros instead of leftovers of the last page
+	memcpy(buf, src, len);
+	memset(buf + len, 0, m_page_size - len);
+	try {
+		PLAYDB_TRACE_TIME(io_ns);
+		m_data_file->Write(offset, buf, m_page_size);
+	} catch (...) {
+		if (m_cache) {
+			m_cache->Erase(page);
+		}
+		throw;
+	}
+}
+
+id_type DiskStorageManager::NewID(id_type first_page)
+{
+	EnsureIndex(first_page);
+	if (m_page_index.find(first_page) == m_page_index.end()) {
+		return first_page;
+	}
+
+	// the page was an entry's first one before compaction moved it
+	EnsureFullIndex();
+	id_type last = m_page_index.rbegin()->first;
+	if (last < std::numeric_limits<id_type>::max()) {
+		return last + 1;
+	}
+
+	id_type id = 0;
+	while (m_page_index.find(id) != m_page_index.end()) {
+		++id;
+	}
+	return id;
+}
+
+id_type DiskStorageManager::AllocPage()
+{
+	EnsureFreeList();
+
+	// lowest first, new entries fill the holes near the front
+	if (m_empty_pages.empty())
+	{
+		// see PLAYDB_64BIT_PAGE_ID
+		if (m_next_page == std::numeric_limits<id_type>::max()) {
+			throw IllegalStateException("DiskStorageManager: Out of page ids.");
+		}
+		m_stats.pages_allocated++;
+		return m_next_page++;
+	}
+	m_stats.pages_allocated++;
+	id_type page = *m_empty_pages.begin();
+	m_empty_pages.erase(m_empty_pages.begin());
+	return page;
+}
+
+void DiskStorageManager::FreePage(id_type page)
+{
+	EnsureFreeList();
+
+	if (m_cache) {
+		m_cache->Erase(page);
+	}
+	m_empty_pages.insert(page);
+	SetOwner(page, NEW_PAGE);
+	++m_write_seq;
+	m_stats.pages_freed++;
+}
+
+void DiskStorageManager::SetOwner(id_type page, id_type id)
+{
+	uint64_t chunk = static_cast<uint64_t>(page) / OWNER_CHUNK_PAGES;
+	if (chunk >= m_page_owner.size() || !m_page_owner[chunk])
+	{
+		if (id == NEW_PAGE) {
+			return;
+		}
+		if (chunk >= m_page_owner.size()) {
+			m_page_owner.resize(static_cast<size_t>(chunk + 1));
+		}
+		m_page_owner[chunk].reset(new id_type[OWNER_CHUNK_PAGES]);
+		std::fill(m_page_owner[chunk].get(), m_page_owner[chunk].get() + OWNER_CHUNK_PAGES, NEW_PAGE);
+	}
+	m_page_owner[chunk][static_cast<uint64_t>(page) % OWNER_CHUNK_PAGES] = id;
+}
+
+id_type DiskStorageManager::GetOwner(id_type page) const
+{
+	uint64_t chunk = static_cast<uint64_t>(page) / OWNER_CHUNK_PAGES;
+	if (chunk >= m_page_owner.size() || !m_page_owner[chunk]) {
+		return NEW_PAGE;
+	}
+	return m_page_owner[chunk][static_cast<uint64_t>(page) % OWNER_CHUNK_PAGES];
+}
+
+void DiskStorageManager::BeginCompaction(const std::vector<id_type>& order)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// moves need the owner of every page
+	EnsureFullIndex();
+
+	m_compact_order = order;
+	m_compact_cursor = 0;
+	m_compact_page = 0;
+	m_compact_target = 0;
+
+	m_compact_region = 0;
+	for (auto id : m_compact_order)
 	{
 		auto entry = m_page_index.find(id);
-		if (entry == m_page_index.end()) {
-			throw IndexOutOfBoundsException(id);
+		if (entry != m_page_index.end()) {
+			m_compact_region += static_cast<id_type>(entry->second->m_pages.size());
 		}
+	}
 
-		auto old_entry = std::move(entry->second);
+	m_compacting = true;
+}
 
-		m_page_index.erase(entry);
+size_t DiskStorageManager::CompactStep(size_t max_pages)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
 
-		auto new_entry = std::make_unique<Entry>();
-		new_entry->m_length = len;
+	size_t moved = m_compacting ? CompactPages(max_pages) : 0;
 
-		const byte* ptr = data;
-		size_t rem = len;
-		size_t next = 0;
-		while (rem > 0)
-		{
-			id_type page;
-			if (next < old_entry->m_pages.size()) {
-				page = old_entry->m_pages[next++];
-			} else if (!m_empty_pages.empty()) {
-				page = m_empty_pages.top(); m_empty_pages.pop();
-			} else {
-				page = m_next_page++;
-			}
+	// the index on disk points to the old places until it is written, only
+	// then the pages moved away from can be reused
+	if (!m_compact_freed.empty())
+	{
+		WriteIndex();
+		for (auto page : m_compact_freed) {
+			m_empty_pages.insert(page);
+		}
+		m_compact_freed.clear();
+	}
+
+	return moved;
+}
 
-			size_t _len = (rem > m_page_size) ? m_page_size : rem;
-			memcpy(m_buffer, ptr, _len);
+size_t DiskStorageManager::CompactPages(size_t max_pages)
+{
+	size_t moved = 0;
+
+	// first the listed entries, each page to its slot in the ordered region,
+	// whatever sits there is pushed out behind the region
+	while (m_compact_cursor < m_compact_order.size())
+	{
+		id_type id = m_compact_order[m_compact_cursor];
+		auto entry = m_page_index.find(id);
+		if (entry == m_page_index.end()) {
+			++m_compact_cursor;
+			m_compact_page = 0;
+			continue;
+		}
 
-			m_data_file.seekp(page * m_page_size, std::ios_base::beg);
-			if (m_data_file.fail()) {
-				throw IllegalStateException("DiskStorageManager: Corrupted data file.");
+		auto& pages = entry->second->m_pages;
+		id_type entry_end = m_compact_target + static_cast<id_type>(pages.size());
+		for ( ; m_compact_page < pages.size(); ++m_compact_page)
+		{
+			id_type target = m_compact_target + static_cast<id_type>(m_compact_page);
+			if (pages[m_compact_page] == target) {
+				continue;
+			}
+			// moved away from in this step, taken in the next one
+			if (m_compact_freed.count(target) > 0) {
+				return moved;
+			}
+			if (moved >= max_pages && moved > 0) {
+				return moved;
 			}
 
-			m_data_file.write(reinterpret_cast<const char*>(m_buffer), m_page_size);
-			if (m_data_file.fail()) {
-				throw IllegalStateException("DiskStorageManager: Corrupted data file.");
+			// the page taken there is pushed out first, the slot is free
+			// for the entry once the index points away from it
+			id_type owner = GetOwner(target);
+			if (owner != NEW_PAGE)
+			{
+				auto& owner_pages = m_page_index.find(owner)->second->m_pages;
+				size_t idx = std::find(owner_pages.begin(), owner_pages.end(), target) - owner_pages.begin();
+				MovePage(owner, idx, AllocPageFrom(std::max(m_compact_region, entry_end)));
+				++moved;
+				return moved;
 			}
+			MovePage(id, m_compact_page, target);
+			++moved;
+		}
 
-			ptr += _len;
-			rem -= _len;
-			new_entry->m_pages.push_back(page);
+		m_compact_target = entry_end;
+		++m_compact_cursor;
+		m_compact_page = 0;
+	}
+
+	// then the rest, the last page goes to the first hole until none is left
+	// below it
+	while (true)
+	{
+		TruncateTail();
+		if (m_next_page == 0) {
+			break;
 		}
 
-		while (next < old_entry->m_pages.size()) {
-			m_empty_pages.push(old_entry->m_pages[next++]);
+		// pages freed in this step are cut off or filled in the next one
+		id_type last = m_next_page - 1;
+		if (m_compact_freed.count(last) > 0) {
+			return moved;
+		}
+		auto hole = m_empty_pages.lower_bound(m_compact_target);
+		if (hole == m_empty_pages.end() || *hole >= last)
+		{
+			if (!m_compact_freed.empty()) {
+				return moved;
+			}
+			break;
+		}
+		if (moved >= max_pages) {
+			return moved;
 		}
 
-		m_page_index.insert(std::make_pair(id, std::move(new_entry)));
+		id_type owner = GetOwner(last);
+		auto& owner_pages = m_page_index.find(owner)->second->m_pages;
+		size_t idx = std::find(owner_pages.begin(), owner_pages.end(), last) - owner_pages.begin();
+		MovePage(owner, idx, *hole);
+		++moved;
 	}
+
+	m_compacting = false;
+	m_compact_order.clear();
+	return moved;
 }
 
-void DiskStorageManager::DeleteByteArray(const id_type id)
+bool DiskStorageManager::IsCompacting() const
 {
-	auto entry = m_page_index.find(id);
-	if (entry == m_page_index.end()) {
-		throw InvalidPageException(id);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_compacting;
+}
+
+void DiskStorageManager::StartCompactor(const std::vector<id_type>& order, size_t pages_per_second)
+{
+	StopCompactor();
+	BeginCompaction(order);
+
+	m_compactor_stop = false;
+	m_compactor = std::thread(&DiskStorageManager::CompactorLoop, this, pages_per_second);
+}
+
+void DiskStorageManager::StopCompactor()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_compactor_stop = true;
 	}
+	m_compactor_cond.notify_all();
 
-	for (auto page : entry->second->m_pages) {
-		m_empty_pages.push(page);
+	if (m_compactor.joinable()) {
+		m_compactor.join();
 	}
+}
 
-	m_page_index.erase(entry);
+size_t DiskStorageManager::GetPageCount() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_next_page;
+}
+
+size_t DiskStorageManager::GetEmptyPageCount() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return FreePageCount();
+}
+
+void DiskStorageManager::MovePage(id_type id, size_t index, id_type dst)
+{
+	auto& entry = *m_page_index.find(id)->second;
+	id_type src = entry.m_pages[index];
+
+	// claim dst
+	if (dst >= m_next_page) {
+		for (id_type page = m_next_page; page < dst; ++page) {
+			m_empty_pages.insert(page);
+		}
+		m_next_page = dst + 1;
+	} else {
+		m_empty_pages.erase(dst);
+	}
+	if (m_cache) {
+		m_cache->Erase(dst);
+	}
+	++m_write_seq;
+	m_stats.pages_allocated++;
+
+	byte* frame = m_cache ? m_cache->Find(src) : nullptr;
+	if (frame) {
+		memcpy(m_move_buf, frame, m_page_size);
+	} else {
+		m_data_file->Read(static_cast<uint64_t>(src) * m_page_size, m_move_buf, m_page_size);
+		m_stats.bytes_read += m_page_size;
+	}
+	m_data_file->Write(static_cast<uint64_t>(dst) * m_page_size, m_move_buf, m_page_size);
+	m_stats.bytes_written += m_page_size;
+
+	entry.m_pages[index] = dst;
+	SetOwner(dst, id);
+	if (m_cache) {
+		m_cache->Erase(src);
+	}
+	m_compact_freed.insert(src);
+	SetOwner(src, NEW_PAGE);
+	++m_write_seq;
+	m_stats.pages_freed++;
+
+	// a hot page stays hot at its new place
+	if (frame) {
+		memcpy(m_cache->Insert(dst), m_move_buf, m_page_size);
+	}
+}
+
+id_type DiskStorageManager::AllocPageFrom(id_type from)
+{
+	auto itr = m_empty_pages.lower_bound(from);
+	if (itr == m_empty_pages.end()) {
+		return std::max(m_next_page, from);
+	}
+	id_type page = *itr;
+	m_empty_pages.erase(itr);
+	return page;
+}
+
+void DiskStorageManager::TruncateTail()
+{
+	id_type end = m_next_page;
+	while (!m_empty_pages.empty() && *m_empty_pages.rbegin() == m_next_page - 1)
+	{
+		m_empty_pages.erase(std::prev(m_empty_pages.end()));
+		--m_next_page;
+	}
+
+	if (m_next_page != end)
+	{
+		uint64_t chunks = (static_cast<uint64_t>(m_next_page) + OWNER_CHUNK_PAGES - 1) / OWNER_CHUNK_PAGES;
+		if (m_page_owner.size() > chunks) {
+			m_page_owner.resize(static_cast<size_t>(chunks));
+		}
+		m_data_file->Truncate(static_cast<uint64_t>(m_next_page) * m_page_size);
+	}
+}
+
+void DiskStorageManager::CompactorLoop(size_t pages_per_second)
+{
+	// the budget is spent in slices of a tenth of a second
+	const auto slice = std::chrono::milliseconds(100);
+	size_t budget = std::max<size_t>(pages_per_second / 10, 2);
+
+	while (true)
+	{
+		if (CompactStep(budget) == 0 && !IsCompacting()) {
+			break;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_compactor_cond.wait_for(lock, slice, [this] { return m_compactor_stop; })) {
+			return;
+		}
+	}
 }
 
 void DiskStorageManager::Flush()
 {
-	m_index_file.seekp(0, std::ios_base::beg);
-	if (m_index_file.fail()) {
-		throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
+	PLAYDB_TRACE_SPAN("flush");
+	std::lock_guard<std::mutex> lock(m_mutex);
+	PLAYDB_TRACE_TIME(io_ns);
+	LatencyTimer timer(&m_stats.flush_latency);
+	m_stats.flushes++;
+
+	WriteIndex();
+}
+
+void DiskStorageManager::WriteIndex()
+{
+	EnsureFullIndex();
+	m_index_blocks.clear();
+
+	size_t blocks = (m_page_index.size() + INDEX_BLOCK_ENTRIES - 1) / INDEX_BLOCK_ENTRIES;
+	size_t sz = INDEX_HEADER_SIZE + m_empty_pages.size() * sizeof(int64_t) + blocks * INDEX_DIR_ENTRY_SIZE;
+	size_t records = sz;
+	for (auto& entry : m_page_index) {
+		sz += INDEX_ENTRY_SIZE + entry.second->m_pages.size() * sizeof(int64_t);
 	}
 
-	// write page size.
-	m_index_file.write(reinterpret_cast<const char*>(&m_page_size), sizeof(size_t));
-	if (m_index_file.fail()) {
-		throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
+	std::vector<byte> buf(sz);
+	byte* ptr = buf.data();
+
+	uint32_t magic = INDEX_MAGIC, version = INDEX_VERSION;
+	pack(magic, &ptr);
+	pack(version, &ptr);
+	pack(static_cast<uint64_t>(m_page_size), &ptr);
+	pack(static_cast<int64_t>(m_next_page), &ptr);
+	pack(static_cast<uint64_t>(m_codec), &ptr);
+	pack(static_cast<uint64_t>(m_empty_pages.size()), &ptr);
+	pack(static_cast<uint64_t>(m_page_index.size()), &ptr);
+	pack(static_cast<uint64_t>(blocks), &ptr);
+	pack(static_cast<uint64_t>(sizeof(id_type)), &ptr);
+
+	for (auto page : m_empty_pages) {
+		pack(static_cast<int64_t>(page), &ptr);
 	}
 
-	// write next page.
-	m_index_file.write(reinterpret_cast<const char*>(&m_next_page), sizeof(id_type));
-	if (m_index_file.fail()) {
-		throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
+	// directory, then the blocks it points to
+	byte* dir = ptr;
+	byte* rec = buf.data() + records;
+	size_t n = 0;
+	for (auto& entry : m_page_index)
+	{
+		if (n % INDEX_BLOCK_ENTRIES == 0)
+		{
+			size_t count = m_page_index.size() - n;
+			if (count > INDEX_BLOCK_ENTRIES) {
+				count = INDEX_BLOCK_ENTRIES;
+			}
+			pack(static_cast<int64_t>(entry.first), &dir);
+			pack(static_cast<uint64_t>(rec - buf.data()), &dir);
+			// the size is known once the block is written
+			byte* size_field = dir;
+			pack(static_cast<uint64_t>(0), &dir);
+			pack(static_cast<uint64_t>(count), &dir);
+
+			byte* block = rec;
+			auto itr = m_page_index.find(entry.first);
+			for (size_t i = 0; i < count; ++i, ++itr)
+			{
+				const Entry& e = *itr->second;
+				pack(static_cast<int64_t>(itr->first), &rec);
+				pack(static_cast<uint64_t>(e.m_length), &rec);
+				pack(static_cast<uint64_t>(e.m_raw_length), &rec);
+				pack(static_cast<uint64_t>(e.m_pages.size()), &rec);
+				for (auto page : e.m_pages) {
+					pack(static_cast<int64_t>(page), &rec);
+				}
+			}
+			pack(static_cast<uint64_t>(rec - block), &size_field);
+		}
+		++n;
 	}
+	assert(static_cast<size_t>(rec - buf.data()) == sz);
 
-	// write empty pages.
-	size_t count = m_empty_pages.size();
-	m_index_file.write(reinterpret_cast<const char*>(&count), sizeof(size_t));
+	// the pages must be on disk before the index points to them
+	m_data_file->Sync();
+
+	// a torn write only hits the temporary file, the old index stays
+	// whole until the rename
+	std::string tmp_path = m_index_path + ".tmp";
+	{
+		PageFile tmp(tmp_path, true, false);
+		tmp.Write(0, buf.data(), sz);
+		tmp.Sync();
+	}
+	m_index_file.close();
+	PageFile::Replace(tmp_path, m_index_path);
+
+	m_index_file.open(m_index_path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
 	if (m_index_file.fail()) {
-		throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
+		throw IllegalStateException("DiskStorageManager: Index file cannot be reopened.");
 	}
-	while (!m_empty_pages.empty())
+}
+
+void DiskStorageManager::LoadIndex()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	EnsureFullIndex();
+}
+
+bool DiskStorageManager::IsIndexLoaded() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_index_pending == 0 && m_free_loaded;
+}
+
+void DiskStorageManager::ReadLegacyIndex(const std::string& index_filepath,
+	                                     const std::string& data_filepath, bool direct_io)
+{
+	// files of the original build hold the index in the data file, so that
+	// one is tried first, a file of pages could pass for an empty index
+	std::fstream fin(data_filepath.c_str(), std::ios::in | std::ios::binary);
+	uint64_t index_size = file_size(m_index_file);
+	uint64_t data_size = file_size(fin);
+	if (!ParseLegacyIndex(fin, index_size))
 	{
-		id_type page = m_empty_pages.top(); m_empty_pages.pop();
-		m_index_file.write(reinterpret_cast<const char*>(&page), sizeof(id_type));
-		if (m_index_file.fail()) {
+		fin.close();
+		if (!ParseLegacyIndex(m_index_file, data_size)) {
 			throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
 		}
+		return;
 	}
+	fin.close();
 
-	// write page index.
-	count = m_page_index.size();
-	m_index_file.write(reinterpret_cast<const char*>(&count), sizeof(size_t));
+	// the files trade places, so the pages end up in the data file
+	m_index_file.close();
+	m_data_file.reset();
+
+	std::string tmp_path = index_filepath + ".swap";
+	PageFile::Replace(index_filepath, tmp_path);
+	PageFile::Replace(data_filepath, index_filepath);
+	PageFile::Replace(tmp_path, data_filepath);
+
+	m_index_file.open(index_filepath.c_str(), std::ios::in | std::ios::out | std::ios::binary);
 	if (m_index_file.fail()) {
-		throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
+		throw IllegalArgumentException("DiskStorageManager: Index/Data file cannot be read/writen.");
 	}
-	for (auto& entry : m_page_index)
+	m_data_file = std::make_unique<PageFile>(data_filepath, false, direct_io);
+}
+
+bool DiskStorageManager::ParseLegacyIndex(std::fstream& file, uint64_t pages_size)
+{
+	// bytes left to read, checked before every read, so a file of pages
+	// fails early
+	uint64_t rem = file_size(file);
+	file.seekg(0, std::ios_base::beg);
+	if (file.fail()) {
+		return false;
+	}
+	auto take = [&](void* dst, size_t len) -> bool
 	{
-		id_type id = entry.first;
-		m_index_file.write(reinterpret_cast<const char*>(&id), sizeof(id_type));
-		if (m_index_file.fail()) {
-			throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
+		if (rem < len) {
+			return false;
 		}
+		file.read(reinterpret_cast<char*>(dst), len);
+		rem -= len;
+		return !file.fail();
+	};
 
-		size_t length = entry.second->m_length;
-		m_index_file.write(reinterpret_cast<const char*>(&length), sizeof(size_t));
-		if (m_index_file.fail()) {
+	// page size, next page, the free list, then id, length and pages of
+	// each entry. Flush never truncated the file and emptied the free list
+	// as it wrote it, so stale bytes may follow the entries and the pages
+	// nobody owns are free.
+	size_t page_size, count;
+	int32_t next_page;
+	if (!take(&page_size, sizeof(size_t)) || page_size == 0 ||
+		!take(&next_page, sizeof(int32_t)) || next_page < 0 ||
+		static_cast<uint64_t>(next_page) > pages_size / page_size ||
+		!take(&count, sizeof(size_t)) || count > rem / sizeof(int32_t)) {
+		return false;
+	}
+
+	std::set<id_type> empty_pages;
+	for (size_t i = 0; i < count; ++i)
+	{
+		int32_t page = 0;
+		if (!take(&page, sizeof(int32_t)) || page < 0 || page >= next_page) {
+			return false;
+		}
+		empty_pages.insert(page);
+	}
+
+	if (!take(&count, sizeof(size_t))) {
+		return false;
+	}
+	std::map<id_type, std::unique_ptr<Entry>> page_index;
+	for (size_t i = 0; i < count; ++i)
+	{
+		int32_t id;
+		size_t length, page_count;
+		if (!take(&id, sizeof(int32_t)) || !take(&length, sizeof(size_t)) ||
+			!take(&page_count, sizeof(size_t)) || page_count != (length + page_size - 1) / page_size ||
+			page_count > rem / sizeof(int32_t)) {
+			return false;
+		}
+
+		auto e = std::make_unique<Entry>();
+		e->m_length = length;
+		e->m_raw_length = length;
+		for (size_t j = 0; j < page_count; ++j)
+		{
+			int32_t page = 0;
+			if (!take(&page, sizeof(int32_t)) || page < 0 || page >= next_page) {
+				return false;
+			}
+			e->m_pages.push_back(page);
+		}
+		if (!page_index.insert(std::make_pair(id, std::move(e))).second) {
+			return false;
+		}
+	}
+
+	// node pages hold ids in the width of the build that wrote them
+	if (sizeof(id_type) != sizeof(int32_t)) {
+		throw IllegalStateException("DiskStorageManager: File written with another page id width.");
+	}
+
+	m_page_size = page_size;
+	m_next_page = next_page;
+	m_codec = Codec::NONE;
+	m_empty_pages.swap(empty_pages);
+	m_page_index.swap(page_index);
+	for (auto& entry : m_page_index) {
+		for (auto page : entry.second->m_pages) {
+			SetOwner(page, entry.first);
+		}
+	}
+	for (id_type page = 0; page < m_next_page; ++page) {
+		if (GetOwner(page) == NEW_PAGE) {
+			m_empty_pages.insert(page);
+		}
+	}
+	return true;
+}
+
+void DiskStorageManager::ReadIndexDirectory()
+{
+	std::vector<byte> buf;
+	read_index(m_index_file, buf, sizeof(uint32_t));
+	byte* ptr = buf.data();
+
+	uint32_t version;
+	unpack(version, &ptr);
+	if (version != 2 && version != INDEX_VERSION) {
+		throw IllegalStateException("DiskStorageManager: Unknown index file version.");
+	}
+
+	size_t header = INDEX_HEADER_SIZE - 2 * sizeof(uint32_t);
+	if (version == 2) {
+		header -= sizeof(uint64_t);
+	}
+	read_index(m_index_file, buf, header);
+	ptr = buf.data();
+
+	uint64_t page_size, codec, free_count, entry_count, block_count;
+	int64_t next_page;
+	unpack(page_size, &ptr);
+	unpack(next_page, &ptr);
+	unpack(codec, &ptr);
+	unpack(free_count, &ptr);
+	unpack(entry_count, &ptr);
+	unpack(block_count, &ptr);
+
+	// version 2 files were all written with 32-bit ids
+	uint64_t id_size = sizeof(int32_t);
+	if (version != 2) {
+		unpack(id_size, &ptr);
+	}
+	// node pages hold ids in the width of the build that wrote them
+	if (id_size != sizeof(id_type)) {
+		throw IllegalStateException("DiskStorageManager: File written with another page id width.");
+	}
+	m_page_size = static_cast<size_t>(page_size);
+	m_next_page = to_id(next_page);
+	m_codec = static_cast<Codec>(codec);
+
+	// the free list is skipped, it is loaded with the blocks
+	m_free_offset = static_cast<uint64_t>(m_index_file.tellg());
+	m_free_count = free_count;
+	m_free_loaded = free_count == 0;
+
+	m_index_file.seekg(static_cast<std::streamoff>(m_free_offset + free_count * sizeof(int64_t)), std::ios_base::beg);
+	read_index(m_index_file, buf, block_count * INDEX_DIR_ENTRY_SIZE);
+	ptr = buf.data();
+
+	m_index_blocks.resize(block_count);
+	for (auto& block : m_index_blocks)
+	{
+		int64_t first_id;
+		unpack(first_id, &ptr);
+		unpack(block.offset, &ptr);
+		unpack(block.size, &ptr);
+		unpack(block.count, &ptr);
+		block.first_id = to_id(first_id);
+		block.loaded = false;
+	}
+	m_index_pending = m_index_blocks.size();
+}
+
+void DiskStorageManager::LoadIndexBlock(size_t block)
+{
+	IndexBlock& b = m_index_blocks[block];
+
+	std::vector<byte> buf;
+	m_index_file.clear();
+	m_index_file.seekg(static_cast<std::streamoff>(b.offset), std::ios_base::beg);
+	read_index(m_index_file, buf, b.size);
+
+	byte* ptr = buf.data();
+	const byte* end = ptr + buf.size();
+	for (uint64_t i = 0; i < b.count; ++i)
+	{
+		if (end - ptr < static_cast<ptrdiff_t>(INDEX_ENTRY_SIZE)) {
 			throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
 		}
 
-		count = entry.second->m_pages.size();
-		m_index_file.write(reinterpret_cast<const char*>(&count), sizeof(size_t));
-		if (m_index_file.fail()) {
+		auto e = std::make_unique<Entry>();
+		int64_t id;
+		uint64_t length, raw_length, count;
+		unpack(id, &ptr);
+		unpack(length, &ptr);
+		unpack(raw_length, &ptr);
+		unpack(count, &ptr);
+		e->m_length = static_cast<size_t>(length);
+		e->m_raw_length = static_cast<size_t>(raw_length);
+
+		if (static_cast<uint64_t>(end - ptr) / sizeof(int64_t) < count) {
 			throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
 		}
-		for (size_t i = 0; i < count; ++i)
+		e->m_pages.reserve(static_cast<size_t>(count));
+		for (uint64_t j = 0; j < count; ++j)
 		{
-			id_type page = entry.second->m_pages[i];
-			m_index_file.write(reinterpret_cast<const char*>(&page), sizeof(id_type));
-			if (m_index_file.fail()) {
-				throw IllegalStateException("DiskStorageManager: Corrupted storage manager index file.");
-			}
+			int64_t page;
+			unpack(page, &ptr);
+			e->m_pages.push_back(to_id(page));
+			SetOwner(to_id(page), to_id(id));
 		}
+
+		m_page_index.insert(std::make_pair(to_id(id), std::move(e)));
 	}
 
-	m_index_file.flush();
-	m_data_file.flush();
+	b.loaded = true;
+	--m_index_pending;
+}
+
+void DiskStorageManager::EnsureIndex(id_type id)
+{
+	if (m_index_pending == 0) {
+		return;
+	}
+
+	// the last block starting at or below id, ids below the first block
+	// are looked for in it too
+	auto itr = std::upper_bound(m_index_blocks.begin(), m_index_blocks.end(), id,
+		[](id_type id, const IndexBlock& b) { return id < b.first_id; });
+	size_t block = itr == m_index_blocks.begin() ? 0 : itr - m_index_blocks.begin() - 1;
+	if (!m_index_blocks[block].loaded) {
+		LoadIndexBlock(block);
+	}
+}
+
+void DiskStorageManager::EnsureFullIndex()
+{
+	for (size_t i = 0, n = m_index_blocks.size(); i < n && m_index_pending > 0; ++i) {
+		if (!m_index_blocks[i].loaded) {
+			LoadIndexBlock(i);
+		}
+	}
+	EnsureFreeList();
+}
+
+void DiskStorageManager::LoadFreeList()
+{
+	std::vector<byte> buf;
+	m_index_file.clear();
+	m_index_file.seekg(static_cast<std::streamoff>(m_free_offset), std::ios_base::beg);
+	read_index(m_index_file, buf, m_free_count * sizeof(int64_t));
+
+	byte* ptr = buf.data();
+	for (uint64_t i = 0; i < m_free_count; ++i)
+	{
+		int64_t page;
+		unpack(page, &ptr);
+		m_empty_pages.insert(to_id(page));
+	}
+
+	m_free_loaded = true;
+	m_free_count = 0;
+}
+
+void DiskStorageManager::EnsureFreeList()
+{
+	if (!m_free_loaded) {
+		LoadFreeList();
+	}
+}
+
+size_t DiskStorageManager::FreePageCount() const
+{
+	return m_empty_pages.size() + static_cast<size_t>(m_free_count);
+}
+
+void DiskStorageManager::IndexLoaderLoop()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_index_blocks.size() && !m_index_loader_stop; ++i)
+	{
+		if (m_index_blocks[i].loaded) {
+			continue;
+		}
+		try {
+			LoadIndexBlock(i);
+		} catch (...) {
+			// left to whoever needs the block, the error shows up there
+			return;
+		}
+
+		// callers waiting on the lock go in between blocks
+		lock.unlock();
+		std::this_thread::yield();
+		lock.lock();
+	}
+
+	if (!m_index_loader_stop)
+	{
+		try {
+			EnsureFreeList();
+		} catch (...) {
+			// as with the blocks
+		}
+	}
 }
 
 }
@@ -1,89 +1,162 @@
 #include "playdb/storage/MemoryStorageManager.h"
 #include "playdb/Exception.h"
+#include "playdb/Trace.h"
+
+#include <assert.h>
 
 namespace playdb
 {
 namespace storage
 {
 
-MemoryStorageManager::MemoryStorageManager()
+MemoryStorageManager::MemoryStorageManager(size_t page_size, size_t slab_pages)
+	: m_page_size(page_size)
+	, m_slab_pages(slab_pages)
 {
+	if (m_page_size == 0 || m_slab_pages == 0) {
+		throw IllegalArgumentException("MemoryStorageManager: page size and slab pages must be positive.");
+	}
 }
 
 MemoryStorageManager::~MemoryStorageManager()
 {
-	for (auto& entry : m_buffer) {
-		delete entry;
+	for (auto& slot : m_slots) {
+		if (slot.overflow) {
+			delete[] slot.data;
+		}
 	}
 }
 
 void MemoryStorageManager::LoadByteArray(const id_type id, size_t& len, byte** data)
 {
-	Entry* e;
-	try {
-		e = m_buffer.at(id);
-		if (e == nullptr) {
-			throw InvalidPageException(id);
-		}
-	} catch (std::out_of_range) {
-		throw InvalidPageException(id);
-	}
+	Slot& slot = GetSlot(id);
 
-	len = e->m_len;
+	len = slot.len;
 
 	*data = new byte[len];
-	memcpy(*data, e->m_data, len);
+	memcpy(*data, slot.data, len);
+
+	m_stats.loads++;
+	m_stats.bytes_read += len;
+	PLAYDB_TRACE_ADD(bytes_copied, len);
 }
 
 void MemoryStorageManager::StoreByteArray(id_type& id, const size_t len, const byte* const data)
 {
-	if (id == NEW_PAGE)
+	if (id == NEW_PAGE) {
+		id = AllocSlot();
+	}
+	Write(GetSlot(id), len, data);
+
+	m_stats.stores++;
+	m_stats.bytes_written += len;
+}
+
+void MemoryStorageManager::DeleteByteArray(const id_type id)
+{
+	Slot& slot = GetSlot(id);
+
+	// give the overflow buffer back, the slot falls back to its slab page
+	if (slot.overflow)
 	{
-		Entry* e = new Entry(len, data);
-		if (m_freelist.empty()) {
-			m_buffer.push_back(e);
-			id = m_buffer.size() - 1;
-		} else {
-			id = m_freelist.top(); m_freelist.pop();
-			m_buffer[id] = e;
-		}
+		delete[] slot.data;
+		size_t idx = static_cast<size_t>(id);
+		slot.data = m_slabs[idx / m_slab_pages].get() + (idx % m_slab_pages) * m_page_size;
+		slot.capacity = m_page_size;
+		slot.overflow = false;
+	}
+	slot.len = 0;
+	slot.used = false;
+
+	m_freelist.push_back(id);
+
+	m_stats.deletes++;
+	m_stats.pages_freed++;
+	m_stats.free_pages = m_freelist.size();
+}
+
+const byte* MemoryStorageManager::BorrowByteArray(const id_type id, size_t& len)
+{
+	Slot& slot = GetSlot(id);
+	len = slot.len;
+
+	m_stats.loads++;
+	m_stats.bytes_read += len;
+
+	return slot.data;
+}
+
+MemoryStorageManager::Slot& MemoryStorageManager::GetSlot(id_type id)
+{
+	if (id < 0 || static_cast<size_t>(id) >= m_slots.size()) {
+		throw InvalidPageException(id);
+	}
+	Slot& slot = m_slots[id];
+	if (!slot.used) {
+		throw InvalidPageException(id);
+	}
+	return slot;
+}
+
+id_type MemoryStorageManager::AllocSlot()
+{
+	id_type id;
+	if (!m_freelist.empty())
+	{
+		id = m_freelist.back(); m_freelist.pop_back();
 	}
 	else
 	{
-		Entry* e_old;
-		try {
-			e_old = m_buffer.at(id);
-			if (e_old == nullptr) {
-				throw InvalidPageException(id);
-			}
-		} catch (std::out_of_range) {
-			throw InvalidPageException(id);
+		size_t idx = m_slots.size();
+		if (idx % m_slab_pages == 0) {
+			m_slabs.emplace_back(new byte[m_slab_pages * m_page_size]);
 		}
 
-		Entry* e = new Entry(len, data);
+		Slot slot;
+		slot.data     = m_slabs.back().get() + (idx % m_slab_pages) * m_page_size;
+		slot.len      = 0;
+		slot.capacity = m_page_size;
+		slot.used     = false;
+		slot.overflow = false;
+		m_slots.push_back(slot);
 
-		delete e_old;
-		m_buffer[id] = e;
+		id = static_cast<id_type>(idx);
 	}
+
+	m_slots[id].used = true;
+
+	m_stats.pages_allocated++;
+	m_stats.pages = m_slots.size();
+	m_stats.free_pages = m_freelist.size();
+
+	return id;
 }
 
-void MemoryStorageManager::DeleteByteArray(const id_type id)
+void MemoryStorageManager::Write(Slot& slot, size_t len, const byte* data)
 {
-	Entry* e;
-	try {
-		e = m_buffer.at(id);
-		if (e == nullptr) {
-			throw InvalidPageException(id);
+	if (len > slot.capacity)
+	{
+		// grow geometrically so a slowly growing entry isn't moved every time
+		size_t cap = slot.capacity * 2;
+		if (cap < len) {
+			cap = len;
 		}
-	} catch (std::out_of_range) {
-		throw InvalidPageException(id);
+		byte* buf = new byte[cap];
+		if (slot.overflow) {
+			delete[] slot.data;
+		}
+		slot.data     = buf;
+		slot.capacity = cap;
+		slot.overflow = true;
 	}
 
-	m_buffer[id] = 0;
-	m_freelist.push(id);
-
-	delete e;
+	assert(len <= slot.capacity);
+	if (len > 0) {
+		memcpy(slot.data, data, len);
+	}
+	PLAYDB_TRACE_ADD(bytes_copied, len);
+	slot.len = len;
 }
 
 }
-}
\ No newline at end of file
+}
@@ -0,0 +1,102 @@
+#include "playdb/storage/PageCache.h"
+#include "playdb/storage/PageFile.h"
+#include "playdb/Exception.h"
+
+namespace
+{
+
+// frames are carved out of chunks of this many pages
+const size_t CHUNK_FRAMES = 64;
+
+}
+
+namespace playdb
+{
+namespace storage
+{
+
+PageCache::PageCache(size_t page_size, size_t capacity)
+	: m_page_size(page_size)
+	, m_max_frames(capacity / page_size)
+{
+	if (m_max_frames == 0) {
+		throw IllegalArgumentException("PageCache: Capacity is smaller than a page.");
+	}
+}
+
+PageCache::~PageCache()
+{
+	for (auto chunk : m_chunks) {
+		PageFile::FreeAligned(chunk);
+	}
+}
+
+byte* PageCache::Find(id_type page)
+{
+	auto itr = m_map.find(page);
+	if (itr == m_map.end()) {
+		return nullptr;
+	}
+
+	m_lru.splice(m_lru.begin(), m_lru, itr->second);
+	return itr->second->data;
+}
+
+byte* PageCache::Insert(id_type page)
+{
+	byte* data;
+	if (m_lru.size() < m_max_frames)
+	{
+		data = AllocFrame();
+	}
+	else
+	{
+		Frame& victim = m_lru.back();
+		data = victim.data;
+		m_map.erase(victim.page);
+		m_lru.pop_back();
+	}
+
+	Frame frame;
+	frame.page = page;
+	frame.data = data;
+	m_lru.push_front(frame);
+	m_map.insert(std::make_pair(page, m_lru.begin()));
+
+	return data;
+}
+
+void PageCache::Erase(id_type page)
+{
+	auto itr = m_map.find(page);
+	if (itr == m_map.end()) {
+		return;
+	}
+
+	m_free_frames.push_back(itr->second->data);
+	m_lru.erase(itr->second);
+	m_map.erase(itr);
+}
+
+byte* PageCache::AllocFrame()
+{
+	if (m_free_frames.empty())
+	{
+		size_t n = m_max_frames - m_chunks.size() * CHUNK_FRAMES;
+		if (n > CHUNK_FRAMES) {
+			n = CHUNK_FRAMES;
+		}
+		byte* chunk = PageFile::AllocAligned(n * m_page_size);
+		m_chunks.push_back(chunk);
+		for (size_t i = 0; i < n; ++i) {
+			m_free_frames.push_back(chunk + (n - 1 - i) * m_page_size);
+		}
+	}
+
+	byte* data = m_free_frames.back();
+	m_free_frames.pop_back();
+	return data;
+}
+
+}
+}
@@ -0,0 +1,287 @@
+#include "playdb/storage/PageFile.h"
+#include "playdb/Exception.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif // NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif // _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif // _WIN32
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <new>
+
+namespace playdb
+{
+namespace storage
+{
+
+#ifdef _WIN32
+
+PageFile::PageFile(const std::string& filepath, bool truncate, bool direct_io)
+	: m_path(filepath)
+	, m_direct(direct_io)
+{
+	if (direct_io) {
+		throw IllegalArgumentException("PageFile: Direct I/O is not supported on this platform.");
+	}
+
+	auto mode = std::ios::in | std::ios::out | std::ios::binary;
+	if (truncate) {
+		mode |= std::ios::trunc;
+	}
+	m_file.open(filepath.c_str(), mode);
+	if (m_file.fail()) {
+		throw IllegalArgumentException("PageFile: Data file cannot be opened.");
+	}
+}
+
+PageFile::~PageFile()
+{
+	m_file.close();
+}
+
+void PageFile::Read(uint64_t offset, byte* buf, size_t len)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_file.seekg(static_cast<std::streamoff>(offset), std::ios_base::beg);
+	m_file.read(reinterpret_cast<char*>(buf), len);
+	if (m_file.fail()) {
+		throw IllegalStateException("PageFile: Corrupted data file.");
+	}
+}
+
+void PageFile::Write(uint64_t offset, const byte* buf, size_t len)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_file.seekp(static_cast<std::streamoff>(offset), std::ios_base::beg);
+	m_file.write(reinterpret_cast<const char*>(buf), len);
+	if (m_file.fail()) {
+		throw IllegalStateException("PageFile: Corrupted data file.");
+	}
+}
+
+void PageFile::Flush()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_file.flush();
+}
+
+void PageFile::Sync()
+{
+	// fstream has no handle to flush the system buffers through
+	Flush();
+}
+
+void PageFile::Replace(const std::string& src, const std::string& dst)
+{
+	if (!MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		throw IllegalStateException("PageFile: Failed replacing " + dst + ".");
+	}
+}
+
+void PageFile::Truncate(uint64_t size)
+{
+	// fstream can't shrink a file, it is cut through a handle of its own
+	// while the stream is closed
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_file.close();
+
+	HANDLE handle = CreateFileA(m_path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	bool done = handle != INVALID_HANDLE_VALUE;
+	if (done)
+	{
+		LARGE_INTEGER end;
+		end.QuadPart = static_cast<LONGLONG>(size);
+		done = SetFilePointerEx(handle, end, nullptr, FILE_BEGIN) && SetEndOfFile(handle);
+		CloseHandle(handle);
+	}
+
+	m_file.open(m_path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+	if (!done || m_file.fail()) {
+		throw IllegalStateException("PageFile: Failed truncating data file.");
+	}
+}
+
+void PageFile::Advise(uint64_t offset, size_t len)
+{
+}
+
+byte* PageFile::AllocAligned(size_t len)
+{
+	void* p = _aligned_malloc(len, DIRECT_IO_ALIGNMENT);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return static_cast<byte*>(p);
+}
+
+void PageFile::FreeAligned(byte* buf)
+{
+	_aligned_free(buf);
+}
+
+#else
+
+// file offsets are page id * page size, see _FILE_OFFSET_BITS
+static_assert(sizeof(off_t) >= sizeof(uint64_t), "PageFile: off_t is too small for large files.");
+
+PageFile::PageFile(const std::string& filepath, bool truncate, bool direct_io)
+	: m_fd(-1)
+	, m_direct(direct_io)
+{
+	int flags = O_RDWR | O_CREAT;
+	if (truncate) {
+		flags |= O_TRUNC;
+	}
+#ifdef O_DIRECT
+	if (direct_io) {
+		flags |= O_DIRECT;
+	}
+#endif // O_DIRECT
+
+	m_fd = open(filepath.c_str(), flags, 0644);
+	if (m_fd < 0) {
+		throw IllegalArgumentException("PageFile: Data file cannot be opened.");
+	}
+
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+	if (direct_io && fcntl(m_fd, F_NOCACHE, 1) != 0) {
+		close(m_fd);
+		throw IllegalArgumentException("PageFile: Direct I/O is not supported.");
+	}
+#elif !defined(O_DIRECT)
+	if (direct_io) {
+		close(m_fd);
+		throw IllegalArgumentException("PageFile: Direct I/O is not supported on this platform.");
+	}
+#endif
+}
+
+PageFile::~PageFile()
+{
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+void PageFile::Read(uint64_t offset, byte* buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = pread(m_fd, buf, len, static_cast<off_t>(offset));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		// pages are always written whole, a short read means a broken file
+		if (n <= 0) {
+			throw IllegalStateException("PageFile: Corrupted data file.");
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+}
+
+void PageFile::Write(uint64_t offset, const byte* buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = pwrite(m_fd, buf, len, static_cast<off_t>(offset));
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			throw IllegalStateException("PageFile: Failed writing data file.");
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+}
+
+void PageFile::Flush()
+{
+	// writes go straight to the kernel (or the device), nothing is buffered
+}
+
+void PageFile::Sync()
+{
+	int ret;
+	do {
+		ret = fsync(m_fd);
+	} while (ret != 0 && errno == EINTR);
+	if (ret != 0) {
+		throw IllegalStateException("PageFile: Failed syncing data file.");
+	}
+}
+
+void PageFile::Replace(const std::string& src, const std::string& dst)
+{
+	if (rename(src.c_str(), dst.c_str()) != 0) {
+		throw IllegalStateException("PageFile: Failed replacing " + dst + ".");
+	}
+
+	// the rename is only durable once the directory is synced
+	size_t slash = dst.find_last_of('/');
+	std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : dst.substr(0, slash));
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		throw IllegalStateException("PageFile: Failed opening directory " + dir + ".");
+	}
+	int ret;
+	do {
+		ret = fsync(fd);
+	} while (ret != 0 && errno == EINTR);
+	close(fd);
+	if (ret != 0) {
+		throw IllegalStateException("PageFile: Failed syncing directory " + dir + ".");
+	}
+}
+
+void PageFile::Truncate(uint64_t size)
+{
+	int ret;
+	do {
+		ret = ftruncate(m_fd, static_cast<off_t>(size));
+	} while (ret != 0 && errno == EINTR);
+	if (ret != 0) {
+		throw IllegalStateException("PageFile: Failed truncating data file.");
+	}
+}
+
+void PageFile::Advise(uint64_t offset, size_t len)
+{
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(m_fd, static_cast<off_t>(offset), static_cast<off_t>(len), POSIX_FADV_WILLNEED);
+#endif // POSIX_FADV_WILLNEED
+}
+
+byte* PageFile::AllocAligned(size_t len)
+{
+	void* p = nullptr;
+	if (posix_memalign(&p, DIRECT_IO_ALIGNMENT, len) != 0) {
+		throw std::bad_alloc();
+	}
+	return static_cast<byte*>(p);
+}
+
+void PageFile::FreeAligned(byte* buf)
+{
+	free(buf);
+}
+
+#endif // _WIN32
+
+}
+}
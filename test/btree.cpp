@@ -1,10 +1,24 @@
 #include "playdb.h"
 #include "playdb/btree/BTree.h"
+#include "playdb/btree/BufferedBTree.h"
+#include "playdb/btree/IndexedBTree.h"
+#include "playdb/btree/ShardedBTree.h"
+#include "playdb/btree/BloomFilter.h"
+#include "playdb/btree/FrequencySketch.h"
 #include "playdb/btree/tools.h"
 #include "playdb/storage/MemoryStorageManager.h"
 
 #include <sstream>
+#include <string>
+#include <memory>
+#include <map>
+#include <set>
+#include <random>
+#include <thread>
+#include <vector>
+#include <algorithm>
 
+#include <stdio.h>
 #include <string.h>
 
 class PrintVisitor : public playdb::IVisitor
@@ -13,14 +27,14 @@ public:
 	virtual void VisitNode(const playdb::INode& node)
 	{
 		printf("visit node: id %d, leaf %d, child_n %d\n", 
-			node.GetID(), node.IsLeaf(), node.GetChildrenCount());
+			(int)node.GetID(), node.IsLeaf(), (int)node.GetChildrenCount());
 	}
 
 	virtual void VisitData(const playdb::IData& data)
 	{
 		auto entry = dynamic_cast<const playdb::btree::Data<int>&>(data);
 		printf("++ visit data: id %d, key %d, %s\n", 
-			entry.id, entry.key, (const char*)entry.data);
+			(int)entry.id, entry.key, (const char*)entry.data);
 	}
 
 }; // PrintVisitor
@@ -30,10 +44,783 @@ void insert_node(playdb::btree::BTree<int>& tree, int n)
 	std::ostringstream ss;
 	ss << "data" << n;
 	auto str = ss.str();
-	int zz = str.size();
 	tree.InsertData(n, str.size() + 1, (playdb::byte*)(str.c_str()));
 }
 
+bool check_data(playdb::btree::BTree<int>& tree, const std::map<int, std::string>& expect)
+{
+	for (auto& kv : expect)
+	{
+		playdb::btree::Data<int> data;
+		if (!tree.Query(kv.first, data) || kv.second != (const char*)data.data) {
+			return false;
+		}
+	}
+	return tree.GetStatistics().data == expect.size();
+}
+
+void insert_node(playdb::btree::BTree<int>& tree, int n, std::map<int, std::string>& expect)
+{
+	insert_node(tree, n);
+
+	std::ostringstream ss;
+	ss << "data" << n;
+	expect[n] = ss.str();
+}
+
+// appends after inserts that split the rightmost leaf
+bool test_append_fast_path()
+{
+	bool ok = true;
+	{
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> tree(storage_mgr.get(), 3);
+		tree.EnableAppendFastPath(true);
+
+		std::map<int, std::string> expect;
+		for (int i = 0; i < 200; i += 10) {
+			insert_node(tree, i, expect);
+		}
+		for (int i = 195; i > 150; i -= 2) {
+			insert_node(tree, i, expect);
+		}
+		for (int i = 200; i < 230; i += 10) {
+			insert_node(tree, i, expect);
+		}
+		ok = check_data(tree, expect);
+	}
+
+	for (int seed = 0; seed < 20 && ok; ++seed)
+	{
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> tree(storage_mgr.get(), 3);
+		tree.EnableAppendFastPath(true);
+
+		std::mt19937 rng(seed);
+		std::map<int, std::string> expect;
+		int next = 0;
+		for (int i = 0; i < 2000; ++i)
+		{
+			if (rng() % 3 == 0) {
+				next += 1 + rng() % 5;
+				insert_node(tree, next, expect);
+			} else if (next > 0) {
+				int key = rng() % next;
+				if (expect.find(key) == expect.end()) {
+					insert_node(tree, key, expect);
+				}
+			}
+		}
+		ok = check_data(tree, expect);
+	}
+
+	printf("append fast path: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+bool check_snapshot(playdb::btree::BTree<int>::Snapshot& snapshot, const std::map<int, std::string>& expect)
+{
+	for (int key = 0; key < 500; ++key)
+	{
+		playdb::btree::Data<int> data;
+		auto itr = expect.find(key);
+		bool found = snapshot.Query(key, data);
+		if (found != (itr != expect.end()) || (found && itr->second != (const char*)data.data)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// snapshots taken and released while batches are open
+bool test_snapshot_batch()
+{
+	bool ok = true;
+	try {
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> tree(storage_mgr.get(), 3);
+
+		typedef std::unique_ptr<playdb::btree::BTree<int>::Snapshot> SnapshotPtr;
+		std::vector<std::pair<SnapshotPtr, std::map<int, std::string>>> snapshots;
+
+		std::mt19937 rng(7);
+		std::map<int, std::string> expect;
+		bool batch = false;
+		for (int i = 0; i < 20000 && ok; ++i)
+		{
+			int op = rng() % 100, key = rng() % 500;
+			if (op < 50) {
+				if (expect.find(key) == expect.end()) {
+					insert_node(tree, key, expect);
+				}
+			} else if (op < 90) {
+				ok = tree.DeleteData(key) == (expect.erase(key) > 0);
+			} else if (op < 94) {
+				batch ? tree.CommitBatch() : tree.BeginBatch();
+				batch = !batch;
+			} else if (op < 97) {
+				snapshots.emplace_back(tree.CreateSnapshot(), expect);
+			} else if (!snapshots.empty()) {
+				size_t idx = rng() % snapshots.size();
+				ok = check_snapshot(*snapshots[idx].first, snapshots[idx].second);
+				snapshots.erase(snapshots.begin() + idx);
+			}
+		}
+		snapshots.clear();
+		if (batch) {
+			tree.CommitBatch();
+		}
+		ok = ok && check_data(tree, expect);
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("snapshots in batches: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+void update_node(playdb::btree::BTree<int>& tree, int key, const std::string& value,
+	             std::map<int, std::string>& expect, bool upsert)
+{
+	if (upsert) {
+		tree.Upsert(key, value.size() + 1, (const playdb::byte*)value.c_str());
+	} else {
+		tree.Update(key, value.size() + 1, (const playdb::byte*)value.c_str());
+	}
+	expect[key] = value;
+}
+
+// first letter to upper case, the size stays
+void capitalize(playdb::byte* data, size_t len)
+{
+	if (len > 0 && data[0] >= 'a' && data[0] <= 'z') {
+		data[0] = data[0] - 'a' + 'A';
+	}
+}
+
+// updates that grow and shrink values, upserts, and modifies in a batch
+// and behind a snapshot
+bool test_update()
+{
+	bool ok = true;
+	try {
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> tree(storage_mgr.get(), 3);
+
+		std::map<int, std::string> expect;
+		for (int i = 0; i < 200; i += 2) {
+			insert_node(tree, i, expect);
+		}
+
+		// longer, then shorter than before
+		for (int i = 0; i < 200; i += 4) {
+			update_node(tree, i, std::string(100 + i, 'x'), expect, false);
+		}
+		for (int i = 0; i < 200; i += 8) {
+			update_node(tree, i, "s", expect, false);
+		}
+		std::string missing = "missing";
+		ok = !tree.Update(1, missing.size() + 1, (const playdb::byte*)missing.c_str());
+		ok = ok && check_data(tree, expect);
+
+		// existing keys get the new value, missing ones are inserted
+		for (int i = 0; i < 200; i += 3) {
+			update_node(tree, i, "upsert" + std::to_string(i), expect, true);
+		}
+		ok = ok && check_data(tree, expect);
+
+		tree.BeginBatch();
+		for (int i = 0; i < 200; i += 5)
+		{
+			if (tree.Modify(i, capitalize)) {
+				capitalize((playdb::byte*)&expect[i][0], expect[i].size());
+			}
+		}
+		tree.CommitBatch();
+		ok = ok && check_data(tree, expect);
+
+		// the snapshot keeps the values as of its creation
+		auto old = expect;
+		auto snapshot = tree.CreateSnapshot();
+		for (int i = 1; i < 200; i += 7)
+		{
+			if (tree.Modify(i, capitalize)) {
+				capitalize((playdb::byte*)&expect[i][0], expect[i].size());
+			}
+		}
+		for (int i = 0; i < 200; i += 11) {
+			update_node(tree, i, std::string(300, 'y'), expect, true);
+		}
+		ok = ok && check_snapshot(*snapshot, old) && check_data(tree, expect);
+		snapshot.reset();
+		ok = ok && check_data(tree, expect);
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("update: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+// hot keys are served from the value cache, a scan of cold keys doesn't
+// push them out, and writes to a key drop it
+// counts are never under, saturate at 15 and halve once aged, two 4-bit
+// counters share a byte without spilling into each other
+bool test_sketch()
+{
+	playdb::btree::FrequencySketch sketch(64);
+	for (int i = 0; i < 64; ++i) {
+		for (int n = 0; n < i % 16; ++n) {
+			sketch.Increment(playdb::btree::bloom_hash(i));
+		}
+	}
+
+	bool ok = true;
+	int exact = 0;
+	for (int i = 0; i < 64; ++i)
+	{
+		size_t freq = sketch.Frequency(playdb::btree::bloom_hash(i));
+		ok = ok && freq >= static_cast<size_t>(i % 16);
+		exact += freq == static_cast<size_t>(i % 16) ? 1 : 0;
+	}
+	ok = ok && exact >= 56;
+
+	uint64_t hot = playdb::btree::bloom_hash(1000);
+	for (int n = 0; n < 30; ++n) {
+		sketch.Increment(hot);
+	}
+	ok = ok && sketch.Frequency(hot) == 15;
+
+	for (int i = 2000; i < 3000 && sketch.Frequency(hot) == 15; ++i) {
+		sketch.Increment(playdb::btree::bloom_hash(i));
+	}
+	ok = ok && sketch.Frequency(hot) == 7;
+	// just aged, so no counter is above 7
+	for (int i = 0; i < 3000; ++i) {
+		ok = ok && sketch.Frequency(playdb::btree::bloom_hash(i)) <= 7;
+	}
+
+	printf("frequency sketch: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+bool test_value_cache()
+{
+	bool ok = true;
+	try {
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> tree(storage_mgr.get(), 8);
+		tree.SetValueCacheCapacity(16 * 1024);
+
+		std::map<int, std::string> expect;
+		for (int i = 0; i < 5000; ++i) {
+			insert_node(tree, i, expect);
+		}
+
+		const int HOT = 50, ROUNDS = 20;
+		for (int round = 0; round < ROUNDS; ++round) {
+			for (int i = 0; i < HOT; ++i) {
+				playdb::btree::Data<int> data;
+				ok = tree.Query(i, data) && expect[i] == (const char*)data.data && ok;
+			}
+		}
+		size_t hits = tree.GetStatistics().value_hits.Get();
+		ok = ok && hits >= HOT * (ROUNDS - 2);
+
+		// several times what the cache holds, but short of aging the
+		// hot keys out of the sketch
+		for (int i = HOT; i < 1000; ++i) {
+			playdb::btree::Data<int> data;
+			tree.Query(i, data);
+		}
+		hits = tree.GetStatistics().value_hits.Get();
+		for (int i = 0; i < HOT; ++i) {
+			playdb::btree::Data<int> data;
+			tree.Query(i, data);
+		}
+		ok = ok && tree.GetStatistics().value_hits.Get() - hits >= HOT * 9 / 10;
+
+		update_node(tree, 1, "updated", expect, false);
+		update_node(tree, 2, "upserted", expect, true);
+		tree.Modify(3, capitalize);
+		capitalize((playdb::byte*)&expect[3][0], expect[3].size());
+		tree.DeleteData(4);
+		expect.erase(4);
+		tree.InsertData(4, 9, (const playdb::byte*)"inserted");
+		expect[4] = "inserted";
+		tree.DeleteData(5);
+		expect.erase(5);
+
+		for (int i = 1; i <= 5; ++i)
+		{
+			playdb::btree::Data<int> data;
+			auto itr = expect.find(i);
+			bool found = tree.Query(i, data);
+			ok = ok && found == (itr != expect.end()) && (!found || itr->second == (const char*)data.data);
+		}
+		ok = ok && check_data(tree, expect);
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("value cache: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+class CollectVisitor : public playdb::IVisitor
+{
+public:
+	virtual void VisitNode(const playdb::INode& node)
+	{
+		nodes.push_back(node.GetID());
+	}
+
+	virtual void VisitData(const playdb::IData& data)
+	{
+		auto& entry = static_cast<const playdb::btree::Data<int>&>(data);
+		entries[entry.key] = (const char*)entry.data;
+		keys.push_back(entry.key);
+		++count;
+	}
+
+	std::vector<playdb::id_type> nodes;
+	std::map<int, std::string> entries;
+	// in visiting order
+	std::vector<int> keys;
+	size_t count = 0;
+
+}; // CollectVisitor
+
+void insert_value(playdb::btree::BufferedBTree<int>& tree, int key, int version,
+	              std::map<int, std::string>& expect)
+{
+	std::ostringstream ss;
+	ss << "data" << key << "." << version;
+	auto str = ss.str();
+	tree.InsertData(key, str.size() + 1, (const playdb::byte*)str.c_str());
+	expect[key] = str;
+}
+
+bool check_buffered(playdb::btree::BufferedBTree<int>& tree, const std::map<int, std::string>& expect)
+{
+	for (int key = 0; key < 1000; ++key)
+	{
+		playdb::btree::Data<int> data;
+		auto itr = expect.find(key);
+		bool found = tree.Query(key, data);
+		if (found != (itr != expect.end()) || (found && itr->second != (const char*)data.data)) {
+			return false;
+		}
+	}
+
+	CollectVisitor visitor;
+	tree.RangeQuery(0, 1000, visitor);
+	return visitor.count == expect.size() && visitor.entries == expect;
+}
+
+// overwrites and deletes before and after the memtable is merged
+// the parallel traversal visits every node and entry once, as the serial
+// one does, the node cache kept small so the threads load nodes too
+bool test_parallel_traverse()
+{
+	bool ok = true;
+	try {
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> tree(storage_mgr.get(), 4);
+		for (int i = 0; i < 5000; ++i) {
+			insert_node(tree, i * 7919 % 5000);
+		}
+		tree.SetCacheCapacity(16);
+
+		CollectVisitor serial;
+		tree.LayerTraverse(serial);
+		std::sort(serial.nodes.begin(), serial.nodes.end());
+
+		const size_t threads[] = { 1, 3, 8 };
+		for (auto n : threads)
+		{
+			for (int ordered = 0; ordered < 2; ++ordered)
+			{
+				CollectVisitor all;
+				tree.ParallelTraverse(n,
+					[]() { return std::unique_ptr<playdb::IVisitor>(new CollectVisitor); },
+					[&all](playdb::IVisitor& v)
+					{
+						auto& part = static_cast<CollectVisitor&>(v);
+						all.nodes.insert(all.nodes.end(), part.nodes.begin(), part.nodes.end());
+						all.entries.insert(part.entries.begin(), part.entries.end());
+						all.count += part.count;
+					},
+					ordered != 0);
+				std::sort(all.nodes.begin(), all.nodes.end());
+				ok = ok && all.nodes == serial.nodes && all.entries == serial.entries
+					&& all.count == serial.count;
+			}
+		}
+		ok = ok && serial.count == 5000;
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("parallel traverse: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+template <typename Tree>
+void apply_op(Tree& tree, int op, int key, const std::string& value, bool& result)
+{
+	const playdb::byte* data = (const playdb::byte*)value.c_str();
+	switch (op)
+	{
+	case 0:
+		tree.InsertData(key, value.size() + 1, data);
+		break;
+	case 1:
+		result = tree.DeleteData(key);
+		break;
+	case 2:
+		result = tree.Update(key, value.size() + 1, data);
+		break;
+	case 3:
+		tree.Upsert(key, value.size() + 1, data);
+		break;
+	default:
+		result = tree.Modify(key, capitalize);
+		break;
+	}
+}
+
+bool same_range(playdb::btree::ShardedBTree<int>& sharded, playdb::btree::BTree<int>& single, int lo, int hi)
+{
+	CollectVisitor a, b;
+	sharded.RangeQuery(lo, hi, a);
+	single.RangeQuery(lo, hi, b);
+	return a.keys == b.keys && a.entries == b.entries;
+}
+
+// hash and range shards give the answers of one tree fed the same calls,
+// also once reopened
+bool test_sharded()
+{
+	bool ok = true;
+	try {
+		for (int ranged = 0; ranged < 2 && ok; ++ranged)
+		{
+			std::vector<std::unique_ptr<playdb::storage::MemoryStorageManager>> storages;
+			std::vector<playdb::IStorageManager*> ptrs;
+			for (int i = 0; i < 4; ++i) {
+				storages.push_back(std::make_unique<playdb::storage::MemoryStorageManager>());
+				ptrs.push_back(storages.back().get());
+			}
+			std::vector<int> splits = { 250, 500, 750 };
+
+			auto single_storage = std::make_unique<playdb::storage::MemoryStorageManager>();
+			playdb::btree::BTree<int> single(single_storage.get(), 4);
+			{
+				std::unique_ptr<playdb::btree::ShardedBTree<int>> sharded(ranged
+					? new playdb::btree::ShardedBTree<int>(ptrs, splits, 4)
+					: new playdb::btree::ShardedBTree<int>(ptrs, 4));
+
+				std::mt19937 rng(ranged);
+				std::set<int> present;
+				for (int i = 0; i < 5000 && ok; ++i)
+				{
+					int key = static_cast<int>(rng() % 1200) - 100;
+					int op = rng() % 5;
+					// keys stay unique, as the single tree needs
+					if (op == 0 && present.count(key) > 0) {
+						op = 3;
+					}
+					std::string value = "v" + std::to_string(key) + "." + std::to_string(i);
+					bool a = false, b = false;
+					apply_op(*sharded, op, key, value, a);
+					apply_op(single, op, key, value, b);
+					if (op == 0 || op == 3) {
+						present.insert(key);
+					} else if (op == 1) {
+						present.erase(key);
+					}
+
+					playdb::btree::Data<int> da, db;
+					bool fa = sharded->Query(key, da), fb = single.Query(key, db);
+					ok = a == b && fa == fb && (!fa || std::string((const char*)da.data) == (const char*)db.data);
+					if (i % 100 == 0) {
+						int lo = static_cast<int>(rng() % 1200) - 100;
+						ok = ok && same_range(*sharded, single, lo, lo + static_cast<int>(rng() % 400));
+					}
+				}
+				ok = ok && sharded->GetDataCount() == single.GetStatistics().data.Get()
+					&& same_range(*sharded, single, -1000, 2000);
+				sharded->Flush();
+			}
+
+			std::unique_ptr<playdb::btree::ShardedBTree<int>> reopened(ranged
+				? new playdb::btree::ShardedBTree<int>(ptrs, splits)
+				: new playdb::btree::ShardedBTree<int>(ptrs));
+			ok = ok && reopened->GetDataCount() == single.GetStatistics().data.Get()
+				&& same_range(*reopened, single, -1000, 2000);
+			if (ranged) {
+				ok = ok && reopened->GetShard(-100) == 0 && reopened->GetShard(250) == 1
+					&& reopened->GetShard(1099) == 3;
+			}
+		}
+
+		// writers on threads of their own, each to keys of every shard
+		std::vector<std::unique_ptr<playdb::storage::MemoryStorageManager>> storages;
+		std::vector<playdb::IStorageManager*> ptrs;
+		for (int i = 0; i < 4; ++i) {
+			storages.push_back(std::make_unique<playdb::storage::MemoryStorageManager>());
+			ptrs.push_back(storages.back().get());
+		}
+		playdb::btree::ShardedBTree<int> sharded(ptrs, 4);
+		std::vector<std::thread> writers;
+		for (int t = 0; t < 4; ++t)
+		{
+			writers.emplace_back([&sharded, t]()
+			{
+				for (int i = t; i < 4000; i += 4)
+				{
+					std::string value = "v" + std::to_string(i);
+					sharded.InsertData(i, value.size() + 1, (const playdb::byte*)value.c_str());
+				}
+			});
+		}
+		for (auto& w : writers) {
+			w.join();
+		}
+
+		auto single_storage = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> single(single_storage.get(), 4);
+		for (int i = 0; i < 4000; ++i)
+		{
+			std::string value = "v" + std::to_string(i);
+			single.InsertData(i, value.size() + 1, (const playdb::byte*)value.c_str());
+		}
+		ok = ok && same_range(sharded, single, 0, 4000);
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("sharded tree: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+bool test_buffered()
+{
+	bool ok = true;
+	try {
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> tree(storage_mgr.get(), 8);
+		std::map<int, std::string> expect;
+		{
+			playdb::btree::BufferedBTree<int> buffered(&tree);
+
+			// all in the memtable
+			for (int i = 0; i < 1000; i += 2) {
+				insert_value(buffered, i, 0, expect);
+			}
+			for (int i = 0; i < 1000; i += 6) {
+				insert_value(buffered, i, 1, expect);
+			}
+			ok = check_buffered(buffered, expect);
+
+			// all in the tree
+			buffered.Flush();
+			ok = ok && check_buffered(buffered, expect);
+
+			// overwrites and deletes of merged keys, before and after merging
+			for (int i = 0; i < 1000; i += 4) {
+				insert_value(buffered, i, 2, expect);
+			}
+			for (int i = 0; i < 1000; i += 10)
+			{
+				bool found = expect.erase(i) > 0;
+				ok = ok && buffered.DeleteData(i) == found;
+			}
+			ok = ok && check_buffered(buffered, expect);
+			buffered.Flush();
+			ok = ok && check_buffered(buffered, expect);
+		}
+		ok = ok && check_data(tree, expect);
+
+		// merges in the background while inserts go on
+		std::map<int, std::string> expect2;
+		auto storage_mgr2 = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> tree2(storage_mgr2.get(), 8);
+		{
+			playdb::btree::BufferedBTree<int> buffered(&tree2, 1024);
+			std::mt19937 rng(3);
+			for (int i = 0; i < 20000 && ok; ++i)
+			{
+				int key = rng() % 1000;
+				if (rng() % 4 == 0) {
+					bool found = expect2.erase(key) > 0;
+					ok = buffered.DeleteData(key) == found;
+				} else {
+					insert_value(buffered, key, i, expect2);
+				}
+			}
+			ok = ok && check_buffered(buffered, expect2);
+		}
+		ok = ok && check_data(tree2, expect2);
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("buffered tree: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+bool check_index(playdb::btree::IndexedBTree<int>::Index<int>& index, const std::map<int, int>& expect)
+{
+	for (int lo = 0; lo < 100; lo += 7)
+	{
+		std::vector<int> keys, want;
+		index.Find(lo, lo + 10, keys);
+		for (auto& kv : expect) {
+			if (kv.second >= lo && kv.second <= lo + 10) {
+				want.push_back(kv.first);
+			}
+		}
+		std::sort(keys.begin(), keys.end());
+		if (keys != want) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// a secondary index on the value through inserts, updates and deletes
+bool test_indexed()
+{
+	bool ok = true;
+	try {
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::btree::BTree<int> primary(storage_mgr.get(), 4);
+		playdb::btree::BTree<playdb::btree::IndexKey<int, int>> by_value(storage_mgr.get(), 4);
+		playdb::btree::BTree<playdb::btree::IndexKey<int, int>> by_value2(storage_mgr.get(), 4);
+
+		playdb::btree::IndexedBTree<int> tree(&primary);
+		auto extract = [](const playdb::byte* data, size_t len) { return *(const int*)data; };
+
+		std::mt19937 rng(11);
+		std::map<int, int> expect;
+		auto put = [&](int key) {
+			int value = rng() % 100;
+			tree.InsertData(key, sizeof(value), (const playdb::byte*)&value);
+			expect[key] = value;
+		};
+
+		// built from the entries already there
+		for (int i = 0; i < 300; ++i) {
+			put(i);
+		}
+		auto index = tree.AddIndex<int>(&by_value, extract);
+		ok = check_index(*index, expect);
+
+		// kept up to date
+		for (int i = 0; i < 3000 && ok; ++i)
+		{
+			int key = rng() % 500;
+			if (rng() % 3 == 0) {
+				bool found = expect.erase(key) > 0;
+				ok = tree.DeleteData(key) == found;
+			} else {
+				put(key);
+			}
+		}
+		ok = ok && check_index(*index, expect);
+		ok = ok && by_value.GetStatistics().data == expect.size();
+
+		// added without a build, filled by later changes only
+		auto index2 = tree.AddIndex<int>(&by_value2, extract, false);
+		tree.BeginBatch();
+		for (auto& kv : expect) {
+			tree.InsertData(kv.first, sizeof(kv.second), (const playdb::byte*)&kv.second);
+		}
+		tree.CommitBatch();
+		ok = ok && check_index(*index2, expect) && check_index(*index, expect);
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("indexed tree: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+// no false negatives, few false positives, kept with the tree
+bool test_filter()
+{
+	bool ok = true;
+	try {
+		playdb::btree::BloomFilter filter(10000, 10);
+		for (int i = 0; i < 10000; ++i) {
+			filter.Add(playdb::btree::bloom_hash(i * 2));
+		}
+		size_t positives = 0;
+		for (int i = 0; i < 10000; ++i)
+		{
+			ok = ok && filter.MayContain(playdb::btree::bloom_hash(i * 2));
+			if (filter.MayContain(playdb::btree::bloom_hash(i * 2 + 1))) {
+				++positives;
+			}
+		}
+		// ~1% at 10 bits per key
+		ok = ok && positives < 300;
+
+		// five uint64 fields and the words in every build, read back whole
+		ok = ok && filter.GetByteArraySize() == 5 * 8 + (10000 * 10 + 63) / 64 * 8;
+		playdb::byte* bytes = nullptr;
+		size_t len = 0;
+		filter.StoreToByteArray(&bytes, len);
+		std::unique_ptr<playdb::byte[]> holder(bytes);
+		playdb::btree::BloomFilter loaded;
+		loaded.LoadFromByteArray(bytes);
+		ok = ok && loaded.GetCount() == 10000 && loaded.GetCapacity() == 10000 && loaded.GetBitsPerKey() == 10;
+		for (int i = 0; i < 10000; ++i) {
+			ok = ok && loaded.MayContain(playdb::btree::bloom_hash(i * 2));
+		}
+
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		std::map<int, std::string> expect;
+		{
+			playdb::btree::BTree<int> tree(storage_mgr.get(), 8);
+			tree.EnableFilter();
+			for (int i = 0; i < 5000; i += 2) {
+				insert_node(tree, i, expect);
+			}
+		}
+		playdb::btree::BTree<int> tree(storage_mgr.get());
+		ok = ok && check_data(tree, expect);
+		playdb::btree::Data<int> data;
+		for (int i = 1; i < 5000; i += 2) {
+			ok = ok && !tree.Query(i, data);
+		}
+		ok = ok && tree.GetStatistics().filter_negatives > 2400;
+
+		// keys that compare equal hash the same
+		playdb::btree::BTree<double> doubles(storage_mgr.get(), 8);
+		doubles.EnableFilter();
+		playdb::byte value = 1;
+		doubles.InsertData(0.0, 1, &value);
+		playdb::btree::Data<double> found;
+		ok = ok && doubles.Query(-0.0, found);
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("filter: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
 int main()
 {
 	PrintVisitor visitor;
@@ -65,5 +852,16 @@ int main()
 		printf("query 15: %s\n", data.data);
 	}
 
-	return 0;
+	bool ok = test_append_fast_path();
+	ok = test_snapshot_batch() && ok;
+	ok = test_update() && ok;
+	ok = test_sketch() && ok;
+	ok = test_value_cache() && ok;
+	ok = test_parallel_traverse() && ok;
+	ok = test_sharded() && ok;
+	ok = test_buffered() && ok;
+	ok = test_indexed() && ok;
+	ok = test_filter() && ok;
+
+	return ok ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,130 @@
+#include "playdb/Catalog.h"
+#include "playdb/Exception.h"
+#include "playdb/btree/BTree.h"
+#include "playdb/storage/DiskStorageManager.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+
+#include <stdio.h>
+
+void insert_range(playdb::btree::BTree<int>& tree, int begin, int end, int tag)
+{
+	for (int i = begin; i < end; ++i) {
+		int value[2] = { i, tag };
+		tree.InsertData(i, sizeof(value), (const playdb::byte*)value);
+	}
+}
+
+bool check_range(playdb::btree::BTree<int>& tree, int begin, int end, int tag)
+{
+	for (int i = begin; i < end; ++i)
+	{
+		playdb::btree::Data<int> data;
+		if (!tree.Query(i, data) || ((const int*)data.data)[1] != tag) {
+			return false;
+		}
+	}
+	return tree.GetStatistics().data == static_cast<size_t>(end - begin);
+}
+
+// trees created, dropped and opened again by name
+bool test_names()
+{
+	bool ok = true;
+	try {
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_catalog.idx", "test_catalog.dat", true, 1024);
+			playdb::Catalog catalog(&storage_mgr);
+
+			playdb::btree::BTree<int> a(catalog, "a", 8);
+			playdb::btree::BTree<int> b(catalog, "b", 8);
+			playdb::btree::BTree<int> c(catalog, "c", 8);
+			insert_range(a, 0, 500, 1);
+			insert_range(b, 0, 300, 2);
+			insert_range(c, 100, 900, 3);
+
+			ok = catalog.Erase("b") && !catalog.Erase("b");
+
+			bool threw = false;
+			try {
+				playdb::btree::BTree<int> a2(catalog, "a", 8);
+			} catch (playdb::IllegalArgumentException&) {
+				threw = true;
+			}
+			ok = ok && threw;
+		}
+
+		playdb::storage::DiskStorageManager storage_mgr("test_catalog.idx", "test_catalog.dat");
+		playdb::Catalog catalog(&storage_mgr);
+		ok = ok && catalog.GetNames() == std::vector<std::string>({ "a", "c" });
+
+		bool threw = false;
+		try {
+			playdb::btree::BTree<int> b(catalog, "b");
+		} catch (playdb::IllegalArgumentException&) {
+			threw = true;
+		}
+		ok = ok && threw;
+
+		playdb::btree::BTree<int> a(catalog, "a");
+		playdb::btree::BTree<int> c(catalog, "c");
+		ok = ok && check_range(a, 0, 500, 1) && check_range(c, 100, 900, 3);
+
+		// the name is free again
+		playdb::btree::BTree<int> b(catalog, "b", 4);
+		insert_range(b, 0, 10, 4);
+		ok = ok && check_range(b, 0, 10, 4) && catalog.GetSize() == 3;
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("catalog names: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+// the open trees split the catalog's node cache budget
+bool test_cache_budget()
+{
+	const size_t BUDGET = 300;
+	bool ok = true;
+	try {
+		playdb::storage::DiskStorageManager storage_mgr("test_catalog.idx", "test_catalog.dat", true, 1024);
+		playdb::Catalog catalog(&storage_mgr, BUDGET);
+
+		std::vector<std::unique_ptr<playdb::btree::BTree<int>>> trees;
+		for (int i = 0; i < 3; ++i)
+		{
+			trees.emplace_back(new playdb::btree::BTree<int>(catalog, std::to_string(i), 4));
+			insert_range(*trees.back(), 0, 5000, i);
+		}
+		for (auto& tree : trees) {
+			insert_range(*tree, 5000, 6000, 0);
+			// nodes on the path in use can't be dropped
+			ok = ok && tree->GetCachedNodes() <= BUDGET / 3 + tree->GetStatistics().tree_height;
+		}
+
+		// one tree fewer, a larger share each
+		trees.pop_back();
+		insert_range(*trees[0], 6000, 8000, 0);
+		size_t cached = trees[0]->GetCachedNodes();
+		ok = ok && cached > BUDGET / 3 + trees[0]->GetStatistics().tree_height
+			&& cached <= BUDGET / 2 + trees[0]->GetStatistics().tree_height;
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	printf("catalog cache budget: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+int main()
+{
+	bool ok = test_names();
+	ok = test_cache_budget() && ok;
+
+	return ok ? 0 : 1;
+}
@@ -3,7 +3,16 @@
 #include "playdb/storage/DiskStorageManager.h"
 
 #include <sstream>
+#include <string>
+#include <fstream>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <random>
+
+#include <stdio.h>
+#include <string.h>
 
 class PrintVisitor : public playdb::IVisitor
 {
@@ -11,27 +20,61 @@ public:
 	virtual void VisitNode(const playdb::INode& node)
 	{
 		printf("visit node: id %d, leaf %d, child_n %d\n",
-			node.GetID(), node.IsLeaf(), node.GetChildrenCount());
+			(int)node.GetID(), node.IsLeaf(), (int)node.GetChildrenCount());
 	}
 
 	virtual void VisitData(const playdb::IData& data)
 	{
 		auto entry = dynamic_cast<const playdb::btree::Data<int>&>(data);
 		printf("++ visit data: id %d, key %d, %s\n",
-			entry.id, entry.key, (const char*)entry.data);
+			(int)entry.id, entry.key, (const char*)entry.data);
 	}
 
 }; // PrintVisitor
 
-void insert_node(playdb::btree::BTree<int>& tree, int n)
+class CollectVisitor : public playdb::IVisitor
+{
+public:
+	virtual void VisitNode(const playdb::INode& node)
+	{
+		nodes.push_back(node.GetID());
+	}
+
+	virtual void VisitData(const playdb::IData& data)
+	{
+		auto& entry = static_cast<const playdb::btree::Data<int>&>(data);
+		entries.emplace_back(entry.key, (const char*)entry.data);
+	}
+
+	std::vector<playdb::id_type> nodes;
+	std::vector<std::pair<int, std::string>> entries;
+
+}; // CollectVisitor
+
+template <typename T>
+void insert_node(playdb::btree::BTree<T>& tree, T n)
 {
 	std::ostringstream ss;
 	ss << "data" << n;
 	auto str = ss.str();
-	int zz = str.size();
 	tree.InsertData(n, str.size() + 1, (playdb::byte*)(str.c_str()));
 }
 
+template <typename T>
+bool check_nodes(playdb::btree::BTree<T>& tree, const std::vector<T>& keys)
+{
+	for (auto key : keys)
+	{
+		std::ostringstream ss;
+		ss << "data" << key;
+		playdb::btree::Data<T> data;
+		if (!tree.Query(key, data) || ss.str() != (const char*)data.data) {
+			return false;
+		}
+	}
+	return tree.GetStatistics().data == keys.size();
+}
+
 void test_write()
 {
 	auto storage_mgr = std::make_unique<playdb::storage::DiskStorageManager>(
@@ -56,10 +99,694 @@ void test_read()
 	tree.LayerTraverse(visitor);
 }
 
+// an empty storage with page 0 free for the tree header and the other
+// pages from first on: an index file with no entries and one free page,
+// and an empty data file
+void make_sparse(const char* idx, const char* dat, uint64_t page_size, int64_t first)
+{
+	uint32_t magic = 0x49424450, version = 3;
+	uint64_t fields[] = { page_size, static_cast<uint64_t>(first), 0, 1, 0, 0, sizeof(playdb::id_type) };
+	int64_t free_page = 0;
+
+	std::ofstream fidx(idx, std::ios::out | std::ios::binary | std::ios::trunc);
+	fidx.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+	fidx.write(reinterpret_cast<const char*>(&version), sizeof(version));
+	fidx.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+	fidx.write(reinterpret_cast<const char*>(&free_page), sizeof(free_page));
+
+	std::ofstream fdat(dat, std::ios::out | std::ios::binary | std::ios::trunc);
+}
+
+// nodes past page first, the data file is sparse below them
+bool test_large(int64_t first)
+{
+	const size_t PAGE_SIZE = 4096;
+	const int COUNT = 2000;
+	make_sparse("test_large.idx", "test_large.dat", PAGE_SIZE, first);
+
+	bool ok = true;
+	{
+		playdb::storage::DiskStorageManager storage_mgr("test_large.idx", "test_large.dat");
+		playdb::btree::BTree<int> tree(&storage_mgr, 16);
+		for (int i = 0; i < COUNT; ++i) {
+			insert_node(tree, i);
+		}
+	}
+	{
+		playdb::storage::DiskStorageManager storage_mgr("test_large.idx", "test_large.dat");
+		playdb::btree::BTree<int> tree(&storage_mgr);
+		for (int i = 0; i < COUNT && ok; ++i)
+		{
+			std::ostringstream ss;
+			ss << "data" << i;
+			playdb::btree::Data<int> data;
+			ok = tree.Query(i, data) && ss.str() == (const char*)data.data;
+		}
+		ok = ok && storage_mgr.GetPageCount() > static_cast<size_t>(first);
+	}
+
+	std::ifstream fdat("test_large.dat", std::ios::in | std::ios::binary | std::ios::ate);
+	ok = ok && static_cast<uint64_t>(fdat.tellg()) > static_cast<uint64_t>(first) * PAGE_SIZE;
+	fdat.close();
+
+	remove("test_large.idx");
+	remove("test_large.dat");
+
+	printf("large file from page %lld: %s\n", (long long)first, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+void copy_file(const char* src, const char* dst)
+{
+	std::ifstream fin(src, std::ios::in | std::ios::binary);
+	std::ofstream fout(dst, std::ios::out | std::ios::binary | std::ios::trunc);
+	fout << fin.rdbuf();
+}
+
+bool check_odd(const char* idx, const char* dat, int count)
+{
+	playdb::storage::DiskStorageManager storage_mgr(idx, dat);
+	playdb::btree::BTree<int> tree(&storage_mgr);
+	for (int i = 0; i < count; ++i)
+	{
+		std::ostringstream ss;
+		ss << "data" << i;
+		playdb::btree::Data<int> data;
+		bool found = tree.Query(i, data);
+		if (found != (i % 2 == 1) || (found && ss.str() != (const char*)data.data)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// the files copied after each step stand for a crash there, ordered lays
+// the nodes out back to front, so every slot taken holds another entry
+bool test_compact(bool ordered)
+{
+	const int COUNT = 500;
+	bool ok = true;
+	size_t pages = 0;
+	{
+		playdb::storage::DiskStorageManager storage_mgr("test_compact.idx", "test_compact.dat", true, 256);
+		std::vector<playdb::id_type> order;
+		{
+			playdb::btree::BTree<int> tree(&storage_mgr, 4);
+			for (int i = 0; i < COUNT; ++i) {
+				insert_node(tree, i);
+			}
+			for (int i = 0; i < COUNT; i += 2) {
+				tree.DeleteData(i);
+			}
+			if (ordered) {
+				tree.GetPageOrder(order);
+				std::reverse(order.begin(), order.end());
+			}
+		}
+		storage_mgr.Flush();
+		pages = storage_mgr.GetPageCount();
+
+		storage_mgr.BeginCompaction(order);
+		while (storage_mgr.CompactStep(8) > 0 && ok)
+		{
+			copy_file("test_compact.idx", "test_crash.idx");
+			copy_file("test_compact.dat", "test_crash.dat");
+			ok = check_odd("test_crash.idx", "test_crash.dat", COUNT);
+		}
+		ok = ok && !storage_mgr.IsCompacting() && storage_mgr.GetEmptyPageCount() == 0
+			&& storage_mgr.GetPageCount() < pages;
+	}
+	ok = ok && check_odd("test_compact.idx", "test_compact.dat", COUNT);
+
+	remove("test_compact.idx");
+	remove("test_compact.dat");
+	remove("test_crash.idx");
+	remove("test_crash.dat");
+
+	printf("compact in steps%s: %s\n", ordered ? ", ordered" : "", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+bool check_entry(playdb::storage::DiskStorageManager& storage_mgr, playdb::id_type id, int value)
+{
+	size_t len = 0;
+	playdb::byte* data = nullptr;
+	storage_mgr.LoadByteArray(id, len, &data);
+	std::unique_ptr<playdb::byte[]> holder(data);
+	return len == sizeof(int) && memcmp(data, &value, sizeof(int)) == 0;
+}
+
+// more entries than fit in one index block, so the index is read block by
+// block after opening, usually still loading when the first entry is read
+bool test_lazy_index()
+{
+	const int COUNT = 10000;
+	std::vector<playdb::id_type> ids(COUNT);
+	{
+		playdb::storage::DiskStorageManager storage_mgr("test_lazy.idx", "test_lazy.dat", true, 64);
+		for (int i = 0; i < COUNT; ++i)
+		{
+			ids[i] = playdb::storage::NEW_PAGE;
+			storage_mgr.StoreByteArray(ids[i], sizeof(int), reinterpret_cast<const playdb::byte*>(&i));
+		}
+		for (int i = 0; i < COUNT; i += 10) {
+			storage_mgr.DeleteByteArray(ids[i]);
+		}
+	}
+
+	bool ok = true;
+	{
+		playdb::storage::DiskStorageManager storage_mgr("test_lazy.idx", "test_lazy.dat");
+		// from the last block, then a free page for a new entry
+		ok = check_entry(storage_mgr, ids[COUNT - 1], COUNT - 1);
+
+		int value = -1;
+		playdb::id_type id = playdb::storage::NEW_PAGE;
+		storage_mgr.StoreByteArray(id, sizeof(int), reinterpret_cast<const playdb::byte*>(&value));
+		ok = ok && id == ids[0];
+
+		storage_mgr.LoadIndex();
+		ok = ok && storage_mgr.IsIndexLoaded() && storage_mgr.GetEmptyPageCount() == COUNT / 10 - 1;
+		for (int i = 1; i < COUNT && ok; ++i) {
+			ok = i % 10 == 0 || check_entry(storage_mgr, ids[i], i);
+		}
+	}
+	{
+		playdb::storage::DiskStorageManager storage_mgr("test_lazy.idx", "test_lazy.dat");
+		ok = ok && storage_mgr.GetEmptyPageCount() == COUNT / 10 - 1 && check_entry(storage_mgr, ids[0], -1);
+		std::ifstream ftmp("test_lazy.idx.tmp");
+		ok = ok && ftmp.fail();
+	}
+
+	remove("test_lazy.idx");
+	remove("test_lazy.dat");
+
+	printf("lazy index: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+std::string legacy_value(int i)
+{
+	return std::string(i % 40 + 1, static_cast<char>('a' + i % 26));
+}
+
+// index and pages as the original build wrote them: native size_t fields,
+// full pages, the index in the data file and the pages in the index file.
+// Deleted entries leave their pages in the free list or, after a second
+// flush, nowhere, and stale bytes follow the entries.
+void make_legacy(const char* idx, const char* dat, size_t page_size, int count, std::vector<int32_t>& ids)
+{
+	std::ofstream fpages(idx, std::ios::out | std::ios::binary | std::ios::trunc);
+	std::vector<std::vector<int32_t>> pages(count);
+	int32_t next_page = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		std::string value = legacy_value(i);
+		value.resize((value.size() + page_size - 1) / page_size * page_size, '\0');
+		for (size_t off = 0; off < value.size(); off += page_size) {
+			pages[i].push_back(next_page++);
+		}
+		fpages.write(value.data(), value.size());
+		ids.push_back(pages[i][0]);
+	}
+
+	std::vector<int32_t> free_pages;
+	for (int i = 0; i < count; i += 10) {
+		free_pages.insert(free_pages.end(), pages[i].begin(), pages[i].end());
+	}
+
+	std::ofstream findex(dat, std::ios::out | std::ios::binary | std::ios::trunc);
+	auto put_size = [&](size_t v) { findex.write(reinterpret_cast<const char*>(&v), sizeof(v)); };
+	auto put_id = [&](int32_t v) { findex.write(reinterpret_cast<const char*>(&v), sizeof(v)); };
+	put_size(page_size);
+	put_id(next_page);
+	put_size(free_pages.size());
+	for (auto page : free_pages) {
+		put_id(page);
+	}
+	put_size(count - (count + 4) / 5);
+	for (int i = 0; i < count; ++i)
+	{
+		if (i % 5 == 0) {
+			continue;
+		}
+		put_id(ids[i]);
+		put_size(legacy_value(i).size());
+		put_size(pages[i].size());
+		for (auto page : pages[i]) {
+			put_id(page);
+		}
+	}
+	findex.write("stale index bytes", 17);
+}
+
+bool check_legacy(playdb::storage::DiskStorageManager& storage_mgr, const std::vector<int32_t>& ids)
+{
+	bool ok = true;
+	for (size_t i = 0; i < ids.size() && ok; ++i)
+	{
+		if (i % 5 == 0) {
+			continue;
+		}
+		size_t len = 0;
+		playdb::byte* data = nullptr;
+		storage_mgr.LoadByteArray(ids[i], len, &data);
+		std::unique_ptr<playdb::byte[]> holder(data);
+		ok = std::string(reinterpret_cast<const char*>(data), len) == legacy_value(static_cast<int>(i));
+	}
+	return ok;
+}
+
+// files from before the block layout are read, moved to their own paths
+// and written in the block layout on the next flush
+bool test_legacy_index()
+{
+	const size_t PAGE_SIZE = 16;
+	const int COUNT = 500;
+	std::vector<int32_t> ids;
+	make_legacy("test_legacy.idx", "test_legacy.dat", PAGE_SIZE, COUNT, ids);
+
+	// pages of every fifth entry are free, listed or not
+	size_t free_pages = 0;
+	for (int i = 0; i < COUNT; i += 5) {
+		free_pages += (legacy_value(i).size() + PAGE_SIZE - 1) / PAGE_SIZE;
+	}
+
+	bool ok = true;
+	try {
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_legacy.idx", "test_legacy.dat");
+			ok = storage_mgr.GetEmptyPageCount() == free_pages && check_legacy(storage_mgr, ids);
+		}
+		{
+			std::ifstream fidx("test_legacy.idx", std::ios::in | std::ios::binary);
+			uint32_t magic = 0;
+			fidx.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+			ok = ok && magic == 0x49424450;
+		}
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_legacy.idx", "test_legacy.dat");
+			ok = ok && storage_mgr.GetEmptyPageCount() == free_pages && check_legacy(storage_mgr, ids);
+
+			// a new entry takes a free page
+			size_t page_count = storage_mgr.GetPageCount();
+			int value = 7;
+			playdb::id_type id = playdb::storage::NEW_PAGE;
+			storage_mgr.StoreByteArray(id, sizeof(int), reinterpret_cast<const playdb::byte*>(&value));
+			ok = ok && storage_mgr.GetPageCount() == page_count && storage_mgr.GetEmptyPageCount() == free_pages - 1;
+			ok = ok && check_entry(storage_mgr, id, value);
+		}
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	remove("test_legacy.idx");
+	remove("test_legacy.dat");
+
+	printf("legacy index: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+// written with each codec built in, the codec is kept with the file
+bool test_codecs()
+{
+	const playdb::storage::Codec codecs[] = {
+		playdb::storage::Codec::NONE, playdb::storage::Codec::LZ,
+		playdb::storage::Codec::LZ4, playdb::storage::Codec::ZSTD
+	};
+
+	bool ok = true;
+	size_t raw_pages = 0;
+	for (auto codec : codecs)
+	{
+		if (!playdb::storage::codec_available(codec)) {
+			continue;
+		}
+
+		std::vector<int> keys;
+		for (int i = 0; i < 2000; ++i) {
+			keys.push_back(i * 7 % 2000);
+		}
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_codec.idx", "test_codec.dat", true, 512, codec);
+			playdb::btree::BTree<int> tree(&storage_mgr, 16);
+			for (auto key : keys) {
+				insert_node(tree, key);
+			}
+			ok = check_nodes(tree, keys) && ok;
+		}
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_codec.idx", "test_codec.dat");
+			playdb::btree::BTree<int> tree(&storage_mgr);
+			ok = storage_mgr.GetCodec() == codec && check_nodes(tree, keys) && ok;
+
+			// the node pages compress well
+			if (codec == playdb::storage::Codec::NONE) {
+				raw_pages = storage_mgr.GetPageCount();
+			} else {
+				ok = storage_mgr.GetPageCount() < raw_pages && ok;
+			}
+		}
+	}
+
+	remove("test_codec.idx");
+	remove("test_codec.dat");
+
+	printf("codecs: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+// page cache in front of a file opened for direct I/O, which the file
+// system may not support
+bool test_direct_io()
+{
+	const size_t PAGE_SIZE = playdb::storage::PageFile::DIRECT_IO_ALIGNMENT;
+	const size_t CACHE_SIZE = 16 * PAGE_SIZE;
+
+	std::vector<int> keys;
+	for (int i = 0; i < 3000; ++i) {
+		keys.push_back(i * 13 % 3000);
+	}
+
+	bool ok = true;
+	try {
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_direct.idx", "test_direct.dat", true,
+				PAGE_SIZE, playdb::storage::Codec::NONE, CACHE_SIZE, true);
+			playdb::btree::BTree<int> tree(&storage_mgr, 32);
+			for (auto key : keys) {
+				insert_node(tree, key);
+			}
+			for (int i = 0; i < 3000; i += 3) {
+				tree.DeleteData(i);
+			}
+			keys.erase(std::remove_if(keys.begin(), keys.end(), [](int key) { return key % 3 == 0; }), keys.end());
+			ok = check_nodes(tree, keys);
+		}
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_direct.idx", "test_direct.dat", false,
+				0, playdb::storage::Codec::NONE, CACHE_SIZE, true);
+			playdb::btree::BTree<int> tree(&storage_mgr);
+			ok = check_nodes(tree, keys) && ok;
+
+			// a page read again right away comes from the cache
+			size_t hits = 0;
+			for (int i = 0; i < 2; ++i)
+			{
+				hits = storage_mgr.GetStatistics().cache_hits.Get();
+				size_t len = 0;
+				playdb::byte* data = nullptr;
+				storage_mgr.LoadByteArray(tree.GetHeaderID(), len, &data);
+				delete[] data;
+			}
+			ok = storage_mgr.GetStatistics().cache_hits.Get() > hits && ok;
+		}
+		printf("direct io: %s\n", ok ? "ok" : "FAILED");
+	} catch (playdb::IllegalArgumentException& e) {
+		printf("direct io: skipped, %s\n", e.what().c_str());
+	}
+
+	remove("test_direct.idx");
+	remove("test_direct.dat");
+	return ok;
+}
+
+// integer keys packed relative to the smallest key of a node, spanning
+// the whole int64_t range at the extremes
+bool test_compact_pages()
+{
+	std::vector<int64_t> keys;
+	for (int64_t i = -1000; i < 1000; ++i) {
+		keys.push_back(i * 3);
+	}
+	for (int i = 0; i < 1000; ++i) {
+		keys.push_back((static_cast<int64_t>(i) - 500) * (static_cast<int64_t>(1) << 40));
+	}
+	keys.push_back(std::numeric_limits<int64_t>::min());
+	keys.push_back(std::numeric_limits<int64_t>::max());
+	keys.push_back(std::numeric_limits<int64_t>::min() + 1);
+	keys.push_back(std::numeric_limits<int64_t>::max() - 1);
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+	bool ok = true;
+	size_t compact_pages = 0, plain_pages = 0;
+	for (int compact = 0; compact < 2; ++compact)
+	{
+		std::vector<int64_t> order = keys;
+		std::mt19937 rng(compact);
+		std::shuffle(order.begin(), order.end(), rng);
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_packed.idx", "test_packed.dat", true, 128);
+			playdb::btree::BTree<int64_t> tree(&storage_mgr, 16);
+			tree.EnableCompactPages(compact != 0);
+			for (auto key : order) {
+				insert_node(tree, key);
+			}
+			ok = check_nodes(tree, keys) && ok;
+		}
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_packed.idx", "test_packed.dat");
+			playdb::btree::BTree<int64_t> tree(&storage_mgr);
+			ok = check_nodes(tree, keys) && ok;
+			(compact ? compact_pages : plain_pages) = storage_mgr.GetPageCount();
+
+			// written back in the format kept with the tree
+			for (size_t i = 0; i < keys.size(); i += 2) {
+				tree.DeleteData(keys[i]);
+			}
+		}
+		{
+			playdb::storage::DiskStorageManager storage_mgr("test_packed.idx", "test_packed.dat");
+			playdb::btree::BTree<int64_t> tree(&storage_mgr);
+			std::vector<int64_t> left;
+			for (size_t i = 1; i < keys.size(); i += 2) {
+				left.push_back(keys[i]);
+			}
+			ok = check_nodes(tree, left) && ok;
+		}
+	}
+	ok = ok && compact_pages < plain_pages;
+
+	remove("test_packed.idx");
+	remove("test_packed.dat");
+
+	printf("compact pages: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+// scans and traversals of a file laid out in key order, read with the
+// node cache nearly off so every node comes from the storage
+void read_layout(size_t cache_size, size_t read_ahead, std::vector<CollectVisitor>& results)
+{
+	// each run writes to a copy of its own
+	copy_file("test_ahead.idx", "test_ahead_run.idx");
+	copy_file("test_ahead.dat", "test_ahead_run.dat");
+
+	playdb::storage::DiskStorageManager storage_mgr("test_ahead_run.idx", "test_ahead_run.dat", false,
+		0, playdb::storage::Codec::NONE, cache_size);
+	storage_mgr.SetReadAhead(read_ahead);
+	playdb::btree::BTree<int> tree(&storage_mgr);
+	tree.SetCacheCapacity(4);
+
+	results.clear();
+	results.resize(4);
+	tree.RangeQuery(0, 5000, results[0]);
+	tree.LayerTraverse(results[1]);
+	tree.RangeQuery(1234, 3456, results[2]);
+
+	// writes in between must not leave stale prefetched pages behind
+	for (int i = 0; i < 5000; i += 97)
+	{
+		std::string str = "new" + std::to_string(i);
+		tree.Update(i, str.size() + 1, (const playdb::byte*)str.c_str());
+		CollectVisitor visitor;
+		tree.RangeQuery(i - 50, i + 50, visitor);
+		results[3].entries.insert(results[3].entries.end(), visitor.entries.begin(), visitor.entries.end());
+	}
+}
+
+bool same_results(const std::vector<CollectVisitor>& a, const std::vector<CollectVisitor>& b)
+{
+	for (size_t i = 0; i < a.size(); ++i) {
+		if (a[i].nodes != b[i].nodes || a[i].entries != b[i].entries) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// read-ahead, with and without a page cache, returns what plain reads do
+bool test_read_ahead()
+{
+	const size_t PAGE_SIZE = 256;
+	{
+		playdb::storage::DiskStorageManager storage_mgr("test_ahead.idx", "test_ahead.dat", true, PAGE_SIZE);
+		{
+			playdb::btree::BTree<int> tree(&storage_mgr, 8);
+			for (int i = 0; i < 5000; ++i) {
+				insert_node(tree, i * 7919 % 5000);
+			}
+
+			std::vector<playdb::id_type> order;
+			tree.GetPageOrder(order);
+			storage_mgr.BeginCompaction(order);
+		}
+		while (storage_mgr.CompactStep(1024) > 0) {
+		}
+	}
+
+	std::vector<CollectVisitor> plain, cached, uncached;
+	read_layout(0, 0, plain);
+	read_layout(64 * PAGE_SIZE, 16, cached);
+	read_layout(0, 16, uncached);
+
+	bool ok = plain[0].entries.size() == 5000 && plain[2].entries.size() == 3456 - 1234 + 1
+		&& same_results(plain, cached) && same_results(plain, uncached);
+
+	remove("test_ahead.idx");
+	remove("test_ahead.dat");
+	remove("test_ahead_run.idx");
+	remove("test_ahead_run.dat");
+
+	printf("read-ahead: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+// exact counters after a known mix of calls, two pages per entry
+bool test_statistics()
+{
+	const size_t PAGE_SIZE = 64;
+	std::vector<playdb::byte> value(100, 7);
+
+	std::vector<playdb::id_type> ids(10, playdb::storage::NEW_PAGE);
+	bool ok = true;
+	try {
+		playdb::storage::DiskStorageManager storage_mgr("test_stats.idx", "test_stats.dat", true, PAGE_SIZE);
+		for (auto& id : ids) {
+			storage_mgr.StoreByteArray(id, value.size(), value.data());
+		}
+		for (int i = 0; i < 4; ++i)
+		{
+			size_t len = 0;
+			playdb::byte* data = nullptr;
+			storage_mgr.LoadByteArray(ids[i], len, &data);
+			delete[] data;
+		}
+		size_t len = 0;
+		storage_mgr.BorrowByteArray(ids[4], len);
+
+		// one page is enough now, the second one is freed
+		storage_mgr.StoreByteArray(ids[5], 30, value.data());
+		for (int i = 7; i < 10; ++i) {
+			storage_mgr.DeleteByteArray(ids[i]);
+		}
+		storage_mgr.Flush();
+		storage_mgr.Flush();
+
+		auto stats = storage_mgr.GetStatistics();
+		ok = stats.stores == 11 && stats.loads == 5 && stats.deletes == 3;
+		ok = ok && stats.bytes_written == 21 * PAGE_SIZE && stats.bytes_read == 10 * PAGE_SIZE;
+		ok = ok && stats.cache_hits == 0 && stats.cache_misses == 0;
+		ok = ok && stats.pages_allocated == 20 && stats.pages_freed == 7;
+		ok = ok && stats.pages == 20 && stats.free_pages == 7;
+		ok = ok && stats.flushes == 2 && stats.flush_latency.GetCount() == 2;
+		ok = ok && stats.flush_latency.GetMax() > 0 && stats.flush_latency.GetSum() >= stats.flush_latency.GetMax();
+
+		// freed pages are taken before the file grows
+		playdb::id_type id = playdb::storage::NEW_PAGE;
+		storage_mgr.StoreByteArray(id, value.size(), value.data());
+		stats = storage_mgr.GetStatistics();
+		ok = ok && stats.pages_allocated == 22 && stats.pages == 20 && stats.free_pages == 5;
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	// every page read once through the cache, then from it
+	try {
+		playdb::storage::DiskStorageManager storage_mgr("test_stats.idx", "test_stats.dat", false, 0,
+			playdb::storage::Codec::NONE, 16 * PAGE_SIZE);
+		size_t len = 0;
+		storage_mgr.BorrowByteArray(ids[0], len);
+		storage_mgr.BorrowByteArray(ids[0], len);
+		auto stats = storage_mgr.GetStatistics();
+		ok = ok && stats.loads == 2 && stats.cache_misses == 2 && stats.cache_hits == 2;
+		ok = ok && stats.bytes_read == 2 * PAGE_SIZE && stats.bytes_written == 0 && stats.flushes == 0;
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	// one record per call, none while tracking is off
+	try {
+		playdb::storage::DiskStorageManager storage_mgr("test_stats.idx", "test_stats.dat", true, 512);
+		playdb::btree::BTree<int> tree(&storage_mgr, 8);
+		for (int i = 0; i < 10; ++i) {
+			insert_node(tree, i);
+		}
+		tree.EnableLatencyTracking(true);
+		for (int i = 10; i < 110; ++i) {
+			insert_node(tree, i);
+		}
+		playdb::btree::Data<int> data;
+		for (int i = 0; i < 20; ++i) {
+			tree.Query(i * 7, data);
+		}
+		CollectVisitor visitor;
+		for (int i = 0; i < 3; ++i) {
+			tree.RangeQuery(i * 10, i * 10 + 5, visitor);
+		}
+		for (int i = 0; i < 5; ++i) {
+			tree.DeleteData(i);
+		}
+		playdb::byte b = 1;
+		tree.Update(50, 1, &b);
+		tree.Update(1000, 1, &b);
+		tree.EnableLatencyTracking(false);
+		tree.Query(60, data);
+
+		auto stats = tree.GetStatistics();
+		ok = ok && stats.insert_latency.GetCount() == 100 && stats.query_latency.GetCount() == 20;
+		ok = ok && stats.range_latency.GetCount() == 3 && stats.delete_latency.GetCount() == 5;
+		ok = ok && stats.update_latency.GetCount() == 2 && stats.data == 105;
+		ok = ok && stats.insert_latency.Percentile(0.5) <= stats.insert_latency.GetMax();
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	remove("test_stats.idx");
+	remove("test_stats.dat");
+
+	printf("statistics: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
 int main()
 {
-//	test_write();
+	test_write();
 	test_read();
 
-	return 0;
+	// offsets past 4GB
+	bool ok = test_large((1LL << 20) + 100);
+	// ids past 2^31
+	if (sizeof(playdb::id_type) == sizeof(int64_t)) {
+		ok = test_large((1LL << 31) + 100) && ok;
+	}
+	ok = test_compact(false) && ok;
+	ok = test_compact(true) && ok;
+	ok = test_lazy_index() && ok;
+	// the original build only had 32-bit ids
+	if (sizeof(playdb::id_type) == sizeof(int32_t)) {
+		ok = test_legacy_index() && ok;
+	}
+	ok = test_codecs() && ok;
+	ok = test_direct_io() && ok;
+	ok = test_compact_pages() && ok;
+	ok = test_read_ahead() && ok;
+	ok = test_statistics() && ok;
+
+	return ok ? 0 : 1;
 }
\ No newline at end of file
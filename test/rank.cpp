@@ -0,0 +1,110 @@
+#include "playdb/btree/BTree.h"
+#include "playdb/btree/tools.h"
+#include "playdb/storage/MemoryStorageManager.h"
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <memory>
+
+#include <stdio.h>
+
+class RankVisitor : public playdb::IVisitor
+{
+public:
+	virtual void VisitNode(const playdb::INode& node)
+	{
+		++nodes;
+	}
+
+	virtual void VisitData(const playdb::IData& data)
+	{
+		auto& entry = dynamic_cast<const playdb::btree::Data<int>&>(data);
+		scores.push_back(entry.key);
+	}
+
+	size_t nodes = 0;
+	std::vector<int> scores;
+
+}; // RankVisitor
+
+void insert_score(playdb::btree::BTree<int>& tree, int score, int player)
+{
+	tree.InsertData(score, sizeof(player), (const playdb::byte*)&player);
+}
+
+bool check_ranks(playdb::btree::BTree<int>& tree, const std::vector<int>& sorted)
+{
+	if (tree.GetDataCount() != sorted.size()) {
+		return false;
+	}
+
+	for (int score = -10; score < 10010; score += 37)
+	{
+		size_t expect = std::lower_bound(sorted.begin(), sorted.end(), score) - sorted.begin();
+		if (tree.Rank(score) != expect) {
+			return false;
+		}
+
+		size_t in_range = std::upper_bound(sorted.begin(), sorted.end(), score + 500)
+			- std::lower_bound(sorted.begin(), sorted.end(), score);
+		if (tree.CountRange(score, score + 500) != in_range) {
+			return false;
+		}
+	}
+
+	for (size_t k = 0; k < sorted.size(); k += 101)
+	{
+		playdb::btree::Data<int> data;
+		if (!tree.SelectByRank(k, data) || data.key != sorted[k]) {
+			return false;
+		}
+	}
+
+	// one page of the leaderboard
+	size_t first = sorted.size() / 2;
+	RankVisitor visitor;
+	tree.SelectByRank(first, 100, visitor);
+	printf("page: %d entries, %d nodes read\n", (int)visitor.scores.size(), (int)visitor.nodes);
+	return std::equal(visitor.scores.begin(), visitor.scores.end(), sorted.begin() + first)
+		&& visitor.scores.size() == 100;
+}
+
+int main()
+{
+	std::mt19937 rng(11);
+	std::uniform_int_distribution<int> score(0, 10000);
+
+	auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+	playdb::btree::BTree<int> tree(storage_mgr.get(), 8, true);
+
+	std::vector<int> sorted;
+	for (int player = 0; player < 20000; ++player) {
+		int s = score(rng);
+		insert_score(tree, s, player);
+		sorted.push_back(s);
+	}
+	std::sort(sorted.begin(), sorted.end());
+
+	if (!check_ranks(tree, sorted)) {
+		printf("insert: FAILED\n");
+		return 1;
+	}
+
+	// players leave, counts must follow the merges and rotations
+	for (int i = 0; i < 15000; ++i)
+	{
+		size_t k = rng() % sorted.size();
+		if (!tree.DeleteData(sorted[k])) {
+			printf("delete %d: FAILED\n", sorted[k]);
+			return 1;
+		}
+		sorted.erase(sorted.begin() + k);
+	}
+	if (tree.DeleteData(-1) || !check_ranks(tree, sorted)) {
+		printf("delete: FAILED\n");
+		return 1;
+	}
+
+	return 0;
+}
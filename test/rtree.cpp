@@ -0,0 +1,165 @@
+#include "playdb/rtree/RTree.h"
+#include "playdb/rtree/tools.h"
+#include "playdb/storage/MemoryStorageManager.h"
+
+#include <vector>
+#include <set>
+#include <random>
+#include <algorithm>
+#include <memory>
+
+#include <stdio.h>
+
+using Region = playdb::rtree::Region<2>;
+
+class CollectVisitor : public playdb::IVisitor
+{
+public:
+	virtual void VisitNode(const playdb::INode& node)
+	{
+		++nodes;
+	}
+
+	virtual void VisitData(const playdb::IData& data)
+	{
+		auto& entry = dynamic_cast<const playdb::rtree::Data<2>&>(data);
+		ids.push_back(entry.id);
+	}
+
+	size_t nodes = 0;
+	std::vector<playdb::id_type> ids;
+
+}; // CollectVisitor
+
+struct Entity
+{
+	playdb::id_type id;
+	double pos[2];
+};
+
+Region box(double x0, double y0, double x1, double y1)
+{
+	double lo[2] = { x0, y0 }, hi[2] = { x1, y1 };
+	return Region(lo, hi);
+}
+
+bool check_range(playdb::rtree::RTree<2>& tree, const std::vector<Entity>& entities, const Region& query)
+{
+	CollectVisitor visitor;
+	tree.IntersectsWithQuery(query, visitor);
+
+	std::set<playdb::id_type> expect;
+	for (auto& e : entities) {
+		if (query.Intersects(Region::Point(e.pos))) {
+			expect.insert(e.id);
+		}
+	}
+	std::set<playdb::id_type> got(visitor.ids.begin(), visitor.ids.end());
+	printf("range: %d hits, %d nodes read\n", (int)got.size(), (int)visitor.nodes);
+	return got == expect && got.size() == visitor.ids.size();
+}
+
+bool check_knn(playdb::rtree::RTree<2>& tree, const std::vector<Entity>& entities, const double* p, size_t k)
+{
+	CollectVisitor visitor;
+	tree.NearestNeighborQuery(k, p, visitor);
+
+	std::vector<double> expect;
+	for (auto& e : entities) {
+		expect.push_back(Region::Point(e.pos).MinDist2(p));
+	}
+	std::sort(expect.begin(), expect.end());
+	expect.resize(k);
+
+	if (visitor.ids.size() != k) {
+		return false;
+	}
+	for (size_t i = 0; i < k; ++i) {
+		auto& e = entities[visitor.ids[i]];
+		if (Region::Point(e.pos).MinDist2(p) != expect[i]) {
+			return false;
+		}
+	}
+	printf("knn: %d nodes read\n", (int)visitor.nodes);
+	return true;
+}
+
+int main()
+{
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<double> coord(0, 1000);
+
+	std::vector<Entity> entities(5000);
+	for (size_t i = 0; i < entities.size(); ++i) {
+		entities[i].id = static_cast<playdb::id_type>(i);
+		entities[i].pos[0] = coord(rng);
+		entities[i].pos[1] = coord(rng);
+	}
+
+	double center[2] = { 500, 500 };
+
+	// R* inserts, then delete a third of the entities
+	{
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::rtree::RTree<2> tree(storage_mgr.get(), 16);
+		for (auto& e : entities) {
+			tree.InsertData(Region::Point(e.pos), e.id, sizeof(e.pos), (const playdb::byte*)e.pos);
+		}
+		if (!check_range(tree, entities, box(100, 100, 250, 180))
+		 || !check_knn(tree, entities, center, 10)) {
+			printf("insert: FAILED\n");
+			return 1;
+		}
+
+		std::vector<Entity> alive;
+		for (auto& e : entities) {
+			if (e.id % 3 == 0) {
+				if (!tree.DeleteData(Region::Point(e.pos), e.id)) {
+					printf("delete %d: FAILED\n", (int)e.id);
+					return 1;
+				}
+			} else {
+				alive.push_back(e);
+			}
+		}
+		if (!check_range(tree, alive, box(0, 0, 1000, 1000))
+		 || !check_range(tree, alive, box(600, 20, 700, 400))) {
+			printf("delete: FAILED\n");
+			return 1;
+		}
+	}
+
+	// STR bulk load
+	{
+		auto storage_mgr = std::make_unique<playdb::storage::MemoryStorageManager>();
+		playdb::rtree::RTree<2> tree(storage_mgr.get(), 32);
+
+		std::vector<playdb::rtree::Entry<2>> bulk;
+		for (auto& e : entities) {
+			bulk.push_back(playdb::rtree::Entry<2>(Region::Point(e.pos), e.id, sizeof(e.pos), (const playdb::byte*)e.pos));
+		}
+		tree.BulkLoad(bulk);
+
+		if (!check_range(tree, entities, box(100, 100, 250, 180))
+		 || !check_knn(tree, entities, center, 25)) {
+			printf("bulk load: FAILED\n");
+			return 1;
+		}
+
+		CollectVisitor visitor;
+		tree.RadiusQuery(center, 50, visitor);
+		size_t expect = 0;
+		for (auto& e : entities) {
+			if (Region::Point(e.pos).MinDist2(center) <= 50 * 50) {
+				++expect;
+			}
+		}
+		printf("radius: %d hits, %d nodes read\n", (int)visitor.ids.size(), (int)visitor.nodes);
+		if (visitor.ids.size() != expect) {
+			printf("radius: FAILED\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
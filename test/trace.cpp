@@ -0,0 +1,136 @@
+#include "playdb/Trace.h"
+#include "playdb/Exception.h"
+#include "playdb/btree/BTree.h"
+#include "playdb/storage/DiskStorageManager.h"
+
+#include <vector>
+#include <string>
+#include <sstream>
+
+#include <stdio.h>
+
+class CountVisitor : public playdb::IVisitor
+{
+public:
+	virtual void VisitNode(const playdb::INode& node) {}
+	virtual void VisitData(const playdb::IData& data) { ++count; }
+
+	size_t count = 0;
+
+}; // CountVisitor
+
+void run_ops(playdb::btree::BTree<int>& tree, playdb::storage::DiskStorageManager& storage_mgr)
+{
+	for (int i = 0; i < 2000; ++i) {
+		tree.InsertData(i, sizeof(i), (const playdb::byte*)&i);
+	}
+
+	playdb::btree::Data<int> data;
+	tree.Query(1000, data);
+
+	CountVisitor visitor;
+	tree.RangeQuery(100, 200, visitor);
+
+	tree.DeleteData(1000);
+	storage_mgr.Flush();
+}
+
+#ifdef PLAYDB_TRACE
+
+size_t count_ops(const std::vector<playdb::trace::Record>& records, const char* op)
+{
+	size_t n = 0;
+	for (auto& r : records) {
+		n += std::string(r.op) == op ? 1 : 0;
+	}
+	return n;
+}
+
+// every call is slow past a threshold of 0, so each leaves a record
+bool test_trace()
+{
+	bool ok = true;
+	try {
+		playdb::trace::SetSlowThreshold(0);
+		playdb::trace::SetSlowOpCapacity(10000);
+
+		playdb::storage::DiskStorageManager storage_mgr("test_trace_on.idx", "test_trace_on.dat", true, 256);
+		playdb::btree::BTree<int> tree(&storage_mgr, 8);
+		tree.SetCacheCapacity(4);
+		playdb::trace::ClearSlowOps();
+
+		run_ops(tree, storage_mgr);
+
+		auto records = playdb::trace::GetSlowOps();
+		ok = count_ops(records, "insert") == 2000 && count_ops(records, "query") == 1
+			&& count_ops(records, "range_query") == 1 && count_ops(records, "delete") == 1
+			&& count_ops(records, "flush") == 1;
+
+		size_t nodes = 0, loads = 0, pages_read = 0, pages_written = 0;
+		for (auto& r : records)
+		{
+			nodes += r.nodes;
+			loads += r.node_loads;
+			pages_read += r.pages_read;
+			pages_written += r.pages_written;
+		}
+		ok = ok && nodes > 0 && loads > 0 && pages_read > 0 && pages_written > 0;
+		ok = ok && playdb::trace::Current() == nullptr;
+
+		std::ostringstream ss;
+		playdb::trace::DumpSlowOps(ss);
+		ok = ok && ss.str().find("range_query") != std::string::npos;
+
+		// nothing is that slow
+		playdb::trace::SetSlowThreshold(60ull * 1000 * 1000 * 1000);
+		playdb::trace::ClearSlowOps();
+		playdb::btree::Data<int> data;
+		tree.Query(1, data);
+		ok = ok && playdb::trace::GetSlowOps().empty();
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	remove("test_trace_on.idx");
+	remove("test_trace_on.dat");
+
+	printf("trace: %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+#else
+
+// the hooks expand to nothing
+bool test_trace()
+{
+	PLAYDB_TRACE_SPAN("test");
+	PLAYDB_TRACE_TIME(io_ns);
+	PLAYDB_TRACE_ADD(nodes, 1);
+
+	bool ok = true;
+	try {
+		playdb::storage::DiskStorageManager storage_mgr("test_trace.idx", "test_trace.dat", true, 256);
+		playdb::btree::BTree<int> tree(&storage_mgr, 8);
+		run_ops(tree, storage_mgr);
+		ok = tree.GetStatistics().data == 1999;
+	} catch (playdb::Exception& e) {
+		printf("%s\n", e.what().c_str());
+		ok = false;
+	}
+
+	remove("test_trace.idx");
+	remove("test_trace.dat");
+
+	printf("trace (not built in): %s\n", ok ? "ok" : "FAILED");
+	return ok;
+}
+
+#endif // PLAYDB_TRACE
+
+int main()
+{
+	bool ok = test_trace();
+
+	return ok ? 0 : 1;
+}